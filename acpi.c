@@ -0,0 +1,327 @@
+/*
+ * acpi.c - ACPI table walker: MADT, SRAT, SLIT (CSE 597)
+ */
+
+#include <types.h>
+#include <multiboot2.h>
+#include <printf.h>
+#include <acpi.h>
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_addr;
+	/* ACPI 2.0+ */
+	uint32_t length;
+	uint64_t xsdt_addr;
+	uint8_t ext_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+	struct acpi_header hdr;
+	uint32_t lapic_addr;
+	uint32_t flags;
+	uint8_t entries[];
+} __attribute__((packed));
+
+struct acpi_srat {
+	struct acpi_header hdr;
+	uint8_t reserved[12];
+	uint8_t entries[];
+} __attribute__((packed));
+
+struct acpi_slit {
+	struct acpi_header hdr;
+	uint64_t localities;
+	uint8_t entries[];
+} __attribute__((packed));
+
+/* Sub-table entry, common to MADT and SRAT */
+struct acpi_entry {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed));
+
+#define MADT_LAPIC			0
+#define MADT_IOAPIC			1
+#define MADT_OVERRIDE		2
+#define MADT_LAPIC_ADDR		5
+#define MADT_X2APIC			9
+
+#define SRAT_CPU			0
+#define SRAT_MEMORY			1
+#define SRAT_X2APIC			2
+
+#define ACPI_ENABLED		0x1U
+
+struct acpi_info acpi;
+
+static struct acpi_header *root_sdt;
+static int root_is_xsdt;
+static uint32_t node_domains[ACPI_MAX_NODES];
+
+static int checksum_ok(const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	uint8_t sum = 0;
+
+	while (len--)
+		sum += *b++;
+	return sum == 0;
+}
+
+static int sig_eq(const char *a, const char *b, size_t n)
+{
+	while (n--) {
+		if (*a++ != *b++)
+			return 0;
+	}
+	return 1;
+}
+
+void *acpi_find_table(const char *sig)
+{
+	size_t i, n, width;
+
+	if (!root_sdt)
+		return NULL;
+	width = root_is_xsdt ? 8 : 4;
+	n = (root_sdt->length - sizeof(struct acpi_header)) / width;
+	for (i = 0; i < n; i++) {
+		uint8_t *ptr = (uint8_t *) (root_sdt + 1) + i * width;
+		uint64_t addr = root_is_xsdt ? *(uint64_t *) ptr : *(uint32_t *) ptr;
+		struct acpi_header *hdr = (struct acpi_header *) (uintptr_t) addr;
+
+		if (sig_eq(hdr->signature, sig, 4) && checksum_ok(hdr, hdr->length))
+			return hdr;
+	}
+	return NULL;
+}
+
+/* Compact node number for a proximity domain */
+static unsigned int domain_node(uint32_t domain)
+{
+	unsigned int i;
+
+	for (i = 0; i < acpi.num_nodes; i++) {
+		if (node_domains[i] == domain)
+			return i;
+	}
+	if (acpi.num_nodes == ACPI_MAX_NODES)
+		return 0;
+	node_domains[acpi.num_nodes] = domain;
+	return acpi.num_nodes++;
+}
+
+static void add_cpu(uint32_t apic_id)
+{
+	if (acpi.num_cpus == MAX_CPUS)
+		return;
+	acpi.cpus[acpi.num_cpus].apic_id = apic_id;
+	acpi.cpus[acpi.num_cpus].node = 0;
+	acpi.num_cpus++;
+}
+
+static void parse_madt(struct acpi_madt *madt)
+{
+	uint8_t *cur = madt->entries;
+	uint8_t *end = (uint8_t *) madt + madt->hdr.length;
+
+	acpi.lapic_addr = madt->lapic_addr;
+	for (; cur < end; cur += ((struct acpi_entry *) cur)->length) {
+		struct acpi_entry *e = (struct acpi_entry *) cur;
+
+		if (e->length < 2)
+			break;
+		switch (e->type) {
+		case MADT_LAPIC:
+			if (*(uint32_t *) (cur + 4) & ACPI_ENABLED)
+				add_cpu(cur[3]);
+			break;
+		case MADT_X2APIC:
+			if (*(uint32_t *) (cur + 8) & ACPI_ENABLED)
+				add_cpu(*(uint32_t *) (cur + 4));
+			break;
+		case MADT_IOAPIC:
+			if (acpi.num_ioapics < ACPI_MAX_IOAPICS) {
+				struct acpi_ioapic *io = &acpi.ioapics[acpi.num_ioapics++];
+				io->id = cur[2];
+				io->addr = *(uint32_t *) (cur + 4);
+				io->gsi_base = *(uint32_t *) (cur + 8);
+			}
+			break;
+		case MADT_OVERRIDE:
+			if (acpi.num_overrides < ACPI_MAX_OVERRIDES) {
+				struct acpi_override *o = &acpi.overrides[acpi.num_overrides++];
+				o->irq = cur[3];
+				o->gsi = *(uint32_t *) (cur + 4);
+				o->flags = *(uint16_t *) (cur + 8);
+			}
+			break;
+		case MADT_LAPIC_ADDR:
+			acpi.lapic_addr = *(uint64_t *) (cur + 4);
+			break;
+		}
+	}
+}
+
+static void set_cpu_node(uint32_t apic_id, uint32_t domain)
+{
+	for (unsigned int i = 0; i < acpi.num_cpus; i++) {
+		if (acpi.cpus[i].apic_id == apic_id)
+			acpi.cpus[i].node = domain_node(domain);
+	}
+}
+
+static void parse_srat(struct acpi_srat *srat)
+{
+	uint8_t *cur = srat->entries;
+	uint8_t *end = (uint8_t *) srat + srat->hdr.length;
+
+	for (; cur < end; cur += ((struct acpi_entry *) cur)->length) {
+		struct acpi_entry *e = (struct acpi_entry *) cur;
+
+		if (e->length < 2)
+			break;
+		switch (e->type) {
+		case SRAT_CPU:
+			if (*(uint32_t *) (cur + 4) & ACPI_ENABLED)
+				set_cpu_node(cur[3], cur[2] | (uint32_t) cur[9] << 8
+					| (uint32_t) cur[10] << 16 | (uint32_t) cur[11] << 24);
+			break;
+		case SRAT_X2APIC:
+			if (*(uint32_t *) (cur + 12) & ACPI_ENABLED)
+				set_cpu_node(*(uint32_t *) (cur + 8), *(uint32_t *) (cur + 4));
+			break;
+		case SRAT_MEMORY:
+			if ((*(uint32_t *) (cur + 28) & ACPI_ENABLED)
+					&& acpi.num_mem_ranges < ACPI_MAX_MEM_RANGES) {
+				struct acpi_mem_range *r =
+					&acpi.mem_ranges[acpi.num_mem_ranges++];
+				r->start = *(uint64_t *) (cur + 8);
+				r->end = r->start + *(uint64_t *) (cur + 16);
+				r->node = domain_node(*(uint32_t *) (cur + 2));
+			}
+			break;
+		}
+	}
+}
+
+static void parse_slit(struct acpi_slit *slit)
+{
+	uint64_t n = slit->localities;
+
+	/* Localities are numbered by proximity domain */
+	for (unsigned int i = 0; i < acpi.num_nodes; i++) {
+		for (unsigned int j = 0; j < acpi.num_nodes; j++) {
+			if (node_domains[i] < n && node_domains[j] < n)
+				acpi.distance[i][j] =
+					slit->entries[node_domains[i] * n + node_domains[j]];
+		}
+	}
+}
+
+static struct acpi_rsdp *find_rsdp(uintptr_t mb_addr)
+{
+	struct multiboot_tag *tag = (struct multiboot_tag *) (mb_addr + 8);
+	struct acpi_rsdp *rsdp = NULL;
+
+	while (tag->type != MULTIBOOT_TAG_TYPE_END) {
+		if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW)
+			return (struct acpi_rsdp *) ((struct multiboot_tag_new_acpi *) tag)->rsdp;
+		if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD)
+			rsdp = (struct acpi_rsdp *) ((struct multiboot_tag_old_acpi *) tag)->rsdp;
+		tag = (struct multiboot_tag *) (((uintptr_t) tag + tag->size + 7) & ~7ULL);
+	}
+	return rsdp;
+}
+
+void acpi_init(uintptr_t mb_addr)
+{
+	struct acpi_rsdp *rsdp = find_rsdp(mb_addr);
+	void *table;
+
+	acpi.num_nodes = 0;
+	if (!rsdp || !sig_eq(rsdp->signature, "RSD PTR ", 8)
+			|| !checksum_ok(rsdp, 20)) {
+		printf("ACPI: no valid RSDP\n");
+	} else if (rsdp->revision >= 2 && rsdp->xsdt_addr) {
+		root_sdt = (struct acpi_header *) (uintptr_t) rsdp->xsdt_addr;
+		root_is_xsdt = 1;
+	} else {
+		root_sdt = (struct acpi_header *) (uintptr_t) rsdp->rsdt_addr;
+	}
+
+	if ((table = acpi_find_table("APIC")))
+		parse_madt(table);
+	if ((table = acpi_find_table("SRAT")))
+		parse_srat(table);
+
+	if (acpi.num_nodes == 0)
+		acpi.num_nodes = 1;
+	for (unsigned int i = 0; i < acpi.num_nodes; i++) {
+		for (unsigned int j = 0; j < acpi.num_nodes; j++)
+			acpi.distance[i][j] = (i == j) ? 10 : 20;
+	}
+	if ((table = acpi_find_table("SLIT")))
+		parse_slit(table);
+
+	printf("ACPI: %u CPUs, %u IOAPICs, %u NUMA nodes\n",
+		acpi.num_cpus, acpi.num_ioapics, acpi.num_nodes);
+}
+
+unsigned int acpi_apic_node(uint32_t apic_id)
+{
+	for (unsigned int i = 0; i < acpi.num_cpus; i++) {
+		if (acpi.cpus[i].apic_id == apic_id)
+			return acpi.cpus[i].node;
+	}
+	return 0;
+}
+
+unsigned int acpi_addr_node(uint64_t addr)
+{
+	for (unsigned int i = 0; i < acpi.num_mem_ranges; i++) {
+		if (addr >= acpi.mem_ranges[i].start && addr < acpi.mem_ranges[i].end)
+			return acpi.mem_ranges[i].node;
+	}
+	return 0;
+}
+
+void acpi_print_topology(void)
+{
+	unsigned int i, j;
+
+	printf("Local APIC at %llx\n", acpi.lapic_addr);
+	for (i = 0; i < acpi.num_cpus; i++)
+		printf("CPU %u: APIC ID %u, node %u\n", i,
+			acpi.cpus[i].apic_id, acpi.cpus[i].node);
+	for (i = 0; i < acpi.num_ioapics; i++)
+		printf("IOAPIC %u: at %x, GSI base %u\n", acpi.ioapics[i].id,
+			acpi.ioapics[i].addr, acpi.ioapics[i].gsi_base);
+	for (i = 0; i < acpi.num_mem_ranges; i++)
+		printf("Memory %llx-%llx: node %u\n", acpi.mem_ranges[i].start,
+			acpi.mem_ranges[i].end - 1, acpi.mem_ranges[i].node);
+	printf("Node distances:\n");
+	for (i = 0; i < acpi.num_nodes; i++) {
+		printf("  ");
+		for (j = 0; j < acpi.num_nodes; j++)
+			printf(" %3u", acpi.distance[i][j]);
+		printf("\n");
+	}
+}
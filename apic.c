@@ -5,27 +5,13 @@
 
 #include <types.h>
 #include <msr.h>
+#include <cpu.h>
 #include <apic.h>
 #include <printf.h>
+#include <vm.h>
 
 static void *lapic_base = NULL;
-
-static inline void
-cpuid(uint32_t level, uint32_t *eax_out, uint32_t *ebx_out,
-		uint32_t *ecx_out, uint32_t *edx_out)
-{
-	uint32_t eax_, ebx_, ecx_, edx_;
-
-	__asm__ __volatile__ (
-		"cpuid"
-		: "=a" (eax_), "=b" (ebx_), "=c" (ecx_), "=d" (edx_)
-		: "0" (level), "2" (0)
-	);
-	*eax_out = eax_;
-	*ebx_out = ebx_;
-	*ecx_out = ecx_;
-	*edx_out = edx_;
-}
+static int lapic_mapped = 0;
 
 uint32_t
 x86_lapic_read(uint32_t offset)
@@ -65,6 +51,20 @@ x86_lapic_write(uint32_t offset, uint32_t value)
 	*(volatile uint32_t *) (lapic_base + (offset << 4)) = value;
 }
 
+/*
+ * The EOI on every interrupt's way out. Unlike an IPI it does not have
+ * to order earlier stores, so an x2APIC gets no fence before it.
+ */
+void
+x86_lapic_eoi(void)
+{
+	if (lapic_base == X86_LAPIC_X2APIC) {
+		wrmsr(X86_MSR_X2APIC_BASE + X86_LAPIC_EOI, 0);
+		return;
+	}
+	*(volatile uint32_t *) (lapic_base + (X86_LAPIC_EOI << 4)) = 0;
+}
+
 static inline void
 x86_x2apic_write_icr(uint32_t cmd_low, uint32_t cmd_high)
 {
@@ -84,6 +84,23 @@ x86_lapic_write_icr(uint32_t cmd)
 				& 0x1000U) ;
 }
 
+/* Send cmd (vector and delivery mode) to the LAPIC with the given ID */
+void
+x86_lapic_send_ipi(uint32_t apic_id, uint32_t cmd)
+{
+	uint64_t irq;
+
+	if (lapic_base == X86_LAPIC_X2APIC) {
+		x86_x2apic_write_icr(cmd, apic_id);
+		return;
+	}
+	/* The two halves of the ICR must not be split by another sender */
+	irq = irq_save();
+	*(volatile uint32_t *) (lapic_base + (X86_LAPIC_ICR_HIGH << 4)) = apic_id << 24;
+	x86_lapic_write_icr(cmd);
+	irq_restore(irq);
+}
+
 void
 x86_lapic_enable(void)
 {
@@ -121,6 +138,11 @@ x86_lapic_enable(void)
 		printf("x2APIC enabled\n");
 	} else {
 		printf("APIC enabled, base: %p\n", lapic_base);
+		/* The identity map is WB; the page is shared by all CPUs */
+		if (!lapic_mapped) {
+			vm_set_cache((uintptr_t) lapic_base, PAGE_SIZE, VM_CACHE_UC);
+			lapic_mapped = 1;
+		}
 	}
 
 	x86_lapic_write(X86_LAPIC_SVR, 0xFF | (0x1U << 8));
@@ -0,0 +1,147 @@
+/*
+ * bench.c - in-kernel microbenchmarks (CSE 597)
+ */
+
+#include <types.h>
+#include <printf.h>
+#include <bench.h>
+#include <slab.h>
+#include <vm.h>
+#include <fb.h>
+#include <string.h>
+#include <sched.h>
+#include <smp.h>
+#include <job.h>
+#include <fpu.h>
+#include <wait.h>
+#include <timer.h>
+#include <spinlock.h>
+#include <ring.h>
+#include <softirq.h>
+#include <irq.h>
+#include <clocksource.h>
+
+struct bench {
+	const char *name;
+	const char *desc;
+	void (*fn)(void);
+};
+
+static const struct bench benches[] = {
+	{ "slab", "kmalloc/kfree vs. a first-fit list", slab_bench },
+	{ "vmalloc", "demand-zero faults on a sparse buffer", vmalloc_bench },
+	{ "pcid", "address space switches with and without PCID", vm_space_bench },
+	{ "fb", "glyph draws and scrolls, UC vs. write-combining", fb_bench },
+	{ "mem", "memcpy/memset variants from 16 B to 8 MiB", string_bench },
+	{ "sched", "yield among 2 to 1000 tasks, fast vs. trap switch", sched_bench },
+	{ "idle", "wakeup latency of an idle CPU, HLT vs. MWAIT", sched_idle_bench },
+	{ "fpu", "switches with 0, 1 and 2 SSE users, lazy vs. eager", fpu_bench },
+	{ "wait", "semaphore ping-pong, mutex contention, spin vs. sleep", wait_bench },
+	{ "bh", "latency of work queued for this and another CPU", softirq_bench },
+	{ "timers", "mod_timer/del_timer with 0 to 100k timers armed", timer_bench },
+	{ "locks", "TTAS vs. ticket vs. MCS on 1 to all CPUs", lock_bench },
+	{ "smp", "the same work spread over 1, 2, 4, ... CPUs", smp_bench },
+	{ "rings", "SPSC, MPSC and MPMC messages between CPUs", ring_bench },
+	{ "ipi", "remote calls one at a time vs. batched per IPI", smp_call_bench },
+	{ "irq", "self-IPI and EOI cost, timer latency in a slow device handler", irq_bench },
+	{ "jobs", "parallel_for hashing 32 MiB on 1 to all CPUs", job_bench },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int streq(const char *a, const char *b)
+{
+	while (*a && *a == *b) {
+		a++;
+		b++;
+	}
+	return *a == *b;
+}
+
+/* Per-operation time (to 0.1 ns) and throughput from a TSC interval */
+void bench_report(const char *what, uint64_t ops, uint64_t cycles)
+{
+	uint64_t ns = cycles_to_ns(cycles);
+
+	if (!ops)
+		return;
+	printf("  %s: %llu ops, %llu.%llu ns/op (%llu cycles), %llu ops/s\n",
+		what, ops, ns / ops, ns * 10 / ops % 10, cycles / ops,
+		ns ? ops * NSEC_PER_SEC / ns : 0);
+}
+
+/*
+ * Tasks started by bench_task_start() count as running until they call
+ * bench_task_done(). The count goes up before each task is created, so
+ * that one which finishes right away cannot take it below zero, and a
+ * task that cannot be created is simply not counted.
+ */
+static struct wait_queue bench_wq = WAIT_QUEUE_INIT;
+static volatile unsigned int bench_running;
+
+/* fn(arg) on cpu at BENCH_PRIO; returns -1 if it cannot be created */
+int bench_task_start(unsigned int cpu, const char *name, void (*fn)(void *),
+		void *arg)
+{
+	__atomic_add_fetch(&bench_running, 1, __ATOMIC_SEQ_CST);
+	if (!task_create_on(cpu, name, fn, arg, BENCH_PRIO)) {
+		__atomic_sub_fetch(&bench_running, 1, __ATOMIC_SEQ_CST);
+		printf("%s: out of tasks\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* The last thing a task from bench_task_start() does */
+void bench_task_done(void)
+{
+	if (__atomic_sub_fetch(&bench_running, 1, __ATOMIC_SEQ_CST) == 0)
+		wake_up_all(&bench_wq);
+}
+
+/* Sleep until every started task is done, then free them; returns the cycles since start */
+uint64_t bench_tasks_wait(uint64_t start)
+{
+	uint64_t cycles;
+
+	wait_event(&bench_wq, bench_running == 0);
+	cycles = bench_now() - start;
+	sched_reap();
+	return cycles;
+}
+
+/*
+ * Start n tasks of fn(arg), task i on CPU i % ncpus, and wait for all
+ * of them; returns the cycles that took. Interrupts stay off while they
+ * are created, so that those on this CPU only preempt us once all of
+ * them are queued.
+ */
+uint64_t bench_tasks_run(unsigned int n, unsigned int ncpus, const char *name,
+		void (*fn)(void *), void *arg)
+{
+	uint64_t start, irq;
+
+	irq = irq_save();
+	start = bench_now();
+	for (unsigned int i = 0; i < n; i++)
+		bench_task_start(i % ncpus, name, fn, arg);
+	irq_restore(irq);
+	return bench_tasks_wait(start);
+}
+
+void bench_run(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_BENCHES; i++) {
+		if (!name) {
+			printf("  %s - %s\n", benches[i].name, benches[i].desc);
+		} else if (streq(name, benches[i].name)) {
+			printf("Running %s...\n", benches[i].name);
+			benches[i].fn();
+			return;
+		}
+	}
+	if (name)
+		printf("Unknown benchmark: %s\n", name);
+}
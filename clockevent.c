@@ -0,0 +1,226 @@
+/*
+ * clockevent.c - the LAPIC timer as a one-shot event source (CSE 597)
+ *
+ * Instead of a periodic tick, the timer is armed for the next event
+ * that matters (the end of a time slice or the next timer on the
+ * wheel, whichever comes first) and left off otherwise, so an idle
+ * CPU or a lone runnable task takes no timer interrupts.
+ * Deadlines are absolute TSC values. With TSC-deadline support they
+ * are written to IA32_TSC_DEADLINE as is; otherwise the LAPIC count
+ * is derived from the LAPIC/TSC rate measured at boot, which also
+ * gives the LAPIC frequency once the TSC itself is calibrated. Every
+ * CPU has its own LAPIC timer; APs reuse the mode and rate of the BSP.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <msr.h>
+#include <smp.h>
+#include <apic.h>
+#include <printf.h>
+#include <clocksource.h>
+#include <clockevent.h>
+
+#define LAPIC_DIVIDE_16			0x03U
+#define LAPIC_CALIBRATE_TICKS	100000U
+#define LAPIC_PERIODIC_COUNT	200000U		/* with divide by 128, as before */
+#define LAPIC_DIVIDE_128		0x0AU
+
+struct clockevent_cpu {
+	uint64_t deadline;			/* armed TSC deadline, 0 if none */
+	uint64_t slice;				/* wanted by the scheduler, 0 if none */
+	uint64_t timer;				/* wanted by the timer wheel, 0 if none */
+	uint64_t irqs;
+	uint64_t late_n;			/* interrupts for an armed deadline */
+	uint64_t late_sum;			/* cycles past it, since clockevent_latency() */
+	uint64_t late_max;
+	uint64_t late_worst;		/* ever */
+	uint64_t sample_irqs;		/* at the last clockevent_print_info() */
+	uint64_t sample_tsc;
+} __attribute__((aligned(64)));
+
+static struct clockevent_cpu clockevent_cpus[MAX_CPUS];
+static enum clockevent_mode mode;
+static uint64_t lapic_per_tsc;	/* LAPIC timer ticks per TSC cycle, 32.32 */
+
+static const char *mode_names[] = { "periodic", "one-shot", "TSC-deadline" };
+
+/* Time a LAPIC count-down (masked) against the TSC */
+static void calibrate_lapic(void)
+{
+	uint64_t start, cycles, ticks;
+
+	x86_lapic_write(X86_LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+	x86_lapic_write(X86_LAPIC_TIMER, X86_LAPIC_TIMER_MASKED
+		| X86_LAPIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+	x86_lapic_write(X86_LAPIC_TIMER_INIT, 0xFFFFFFFFU);
+	start = rdtsc();
+	while (x86_lapic_read(X86_LAPIC_TIMER_CUR) > 0xFFFFFFFFU - LAPIC_CALIBRATE_TICKS)
+		;
+	cycles = rdtsc() - start;
+	ticks = 0xFFFFFFFFU - x86_lapic_read(X86_LAPIC_TIMER_CUR);
+	x86_lapic_write(X86_LAPIC_TIMER_INIT, 0);
+	lapic_per_tsc = cycles ? (ticks << 32) / cycles : 0;
+}
+
+/* Program the LVT timer entry for the chosen mode on the calling CPU */
+static void clockevent_setup(void)
+{
+#ifdef TIMER_PERIODIC
+	x86_lapic_write(X86_LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_128);
+	x86_lapic_write(X86_LAPIC_TIMER, X86_LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+	x86_lapic_write(X86_LAPIC_TIMER_INIT, LAPIC_PERIODIC_COUNT);
+#else
+	if (mode == CLOCKEVENT_TSC_DEADLINE) {
+		x86_lapic_write(X86_LAPIC_TIMER,
+			X86_LAPIC_TIMER_TSC_DEADLINE | APIC_TIMER_VECTOR);
+		/* Order the LVT write before any IA32_TSC_DEADLINE write */
+		__asm__ __volatile__ ("mfence" : : : "memory");
+	} else {
+		x86_lapic_write(X86_LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+		x86_lapic_write(X86_LAPIC_TIMER,
+			X86_LAPIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+	}
+#endif
+	clockevent_cpus[smp_cpu_id()].sample_tsc = rdtsc();
+}
+
+void clockevent_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	x86_lapic_enable();
+	calibrate_lapic();
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+
+#ifdef TIMER_PERIODIC
+	mode = CLOCKEVENT_PERIODIC;
+#else
+	mode = (ecx & (1U << 24)) ? CLOCKEVENT_TSC_DEADLINE : CLOCKEVENT_ONESHOT;
+#endif
+	clockevent_setup();
+	printf("APIC timer: %s mode, vector %u, %llu kHz after divide by 16\n",
+		mode_names[mode], APIC_TIMER_VECTOR,
+		(lapic_per_tsc * (tsc_hz / 1000)) >> 32);
+}
+
+/* The same for an AP, which shares the mode and rate found on the BSP */
+void clockevent_cpu_init(void)
+{
+	x86_lapic_enable();
+	clockevent_setup();
+}
+
+/* Fire the timer at TSC value deadline (0: never); a past deadline fires now */
+static void clockevent_program(struct clockevent_cpu *ce)
+{
+	uint64_t deadline = ce->slice, now, count;
+
+	if (ce->timer && (!deadline || ce->timer < deadline))
+		deadline = ce->timer;
+	if (mode == CLOCKEVENT_PERIODIC || deadline == ce->deadline)
+		return;
+	ce->deadline = deadline;
+	if (mode == CLOCKEVENT_TSC_DEADLINE) {
+		wrmsr(MSR_TSC_DEADLINE, deadline);
+		return;
+	}
+	if (!deadline) {
+		x86_lapic_write(X86_LAPIC_TIMER_INIT, 0);
+		return;
+	}
+	now = rdtsc();
+	count = deadline > now
+		? (uint64_t) (((unsigned __int128) (deadline - now) * lapic_per_tsc) >> 32)
+		: 0;
+	if (count == 0)
+		count = 1;
+	else if (count > 0xFFFFFFFFU)
+		count = 0xFFFFFFFFU;
+	x86_lapic_write(X86_LAPIC_TIMER_INIT, (uint32_t) count);
+}
+
+/* The end of the current time slice; interrupts disabled */
+void clockevent_set(uint64_t deadline)
+{
+	struct clockevent_cpu *ce = &clockevent_cpus[smp_cpu_id()];
+
+	ce->slice = deadline;
+	clockevent_program(ce);
+}
+
+/* The next event on this CPU's timer wheel; interrupts disabled */
+void clockevent_set_timer(uint64_t deadline)
+{
+	struct clockevent_cpu *ce = &clockevent_cpus[smp_cpu_id()];
+
+	ce->timer = deadline;
+	clockevent_program(ce);
+}
+
+/*
+ * How late the timer interrupt came on this CPU, in cycles past the
+ * deadline it was armed for, since the previous call
+ */
+void clockevent_latency(uint64_t *worst, uint64_t *mean)
+{
+	struct clockevent_cpu *ce = &clockevent_cpus[smp_cpu_id()];
+	uint64_t irq = irq_save();
+
+	*worst = ce->late_max;
+	*mean = ce->late_n ? ce->late_sum / ce->late_n : 0;
+	ce->late_n = 0;
+	ce->late_sum = 0;
+	ce->late_max = 0;
+	irq_restore(irq);
+}
+
+/*
+ * Called on every timer interrupt, before the timer wheel and the
+ * scheduler run; both of them ask for their next deadline again.
+ */
+void clockevent_interrupt(void)
+{
+	struct clockevent_cpu *ce = &clockevent_cpus[smp_cpu_id()];
+	uint64_t now = rdtsc(), late;
+
+	ce->irqs++;
+	if (ce->deadline) {
+		late = now > ce->deadline ? now - ce->deadline : 0;
+		ce->late_n++;
+		ce->late_sum += late;
+		if (late > ce->late_max)
+			ce->late_max = late;
+		if (late > ce->late_worst)
+			ce->late_worst = late;
+	}
+	ce->deadline = 0;
+	ce->slice = 0;
+	ce->timer = 0;
+}
+
+/* Timer interrupts per second since the previous call */
+void clockevent_print_info(void)
+{
+	struct clockevent_cpu *ce = &clockevent_cpus[smp_cpu_id()];
+	uint64_t now = rdtsc();
+	uint64_t irqs = ce->irqs - ce->sample_irqs;
+	uint64_t ms = cycles_to_ns(now - ce->sample_tsc) / NSEC_PER_MSEC;
+
+	ce->sample_irqs = ce->irqs;
+	ce->sample_tsc = now;
+	printf("APIC timer: %s mode, interrupts per CPU:", mode_names[mode]);
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (cpu_locals[cpu].online)
+			printf(" %llu", clockevent_cpus[cpu].irqs);
+	}
+	printf("\nworst latency per CPU, us:");
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (cpu_locals[cpu].online)
+			printf(" %llu", cycles_to_ns(clockevent_cpus[cpu].late_worst) / NSEC_PER_USEC);
+	}
+	printf("\n");
+	if (ms)
+		printf("%llu interrupts/s on CPU %u over the last %llu ms\n",
+			irqs * 1000 / ms, smp_cpu_id(), ms);
+}
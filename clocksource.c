@@ -0,0 +1,165 @@
+/*
+ * clocksource.c - calibrated time from the TSC, HPET or PIT (CSE 597)
+ *
+ * The TSC is calibrated once at boot against the HPET main counter (if
+ * ACPI describes one) or else PIT channel 2. With an invariant TSC,
+ * ktime_get_ns() is then an rdtsc and a multiply-shift; without one,
+ * the HPET counter is read instead, since the TSC rate may change with
+ * the CPU frequency. Conversions use 32.32 fixed-point multipliers so
+ * that no 128-bit division is needed at run time.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <printf.h>
+#include <acpi.h>
+#include <vm.h>
+#include <clocksource.h>
+
+#define CALIBRATE_MS		50ULL
+
+#define PIT_HZ				1193182ULL
+#define PIT_CH2				0x42
+#define PIT_CMD				0x43
+#define PIT_GATE			0x61
+
+#define HPET_CAP			0x000
+#define HPET_CONFIG			0x010
+#define HPET_COUNTER		0x0F0
+#define HPET_ENABLE			0x1ULL
+#define FSEC_PER_NSEC		1000000ULL
+
+struct acpi_hpet {
+	char signature[4];
+	uint32_t length;
+	uint8_t header_rest[28];
+	uint32_t event_timer_block_id;
+	uint8_t space_id;			/* generic address structure */
+	uint8_t bit_width;
+	uint8_t bit_offset;
+	uint8_t access_size;
+	uint64_t address;
+} __attribute__((packed));
+
+uint64_t tsc_hz;
+
+static volatile uint64_t *hpet;
+static uint64_t hpet_period_fs;
+static int tsc_invariant;
+static const char *calibrated_by = "nothing";
+
+/* ns = (count - base) * mult >> 32, for the TSC and the HPET */
+static uint64_t tsc_ns_mult, tsc_cycles_mult, hpet_ns_mult;
+static uint64_t tsc_base, hpet_base;
+
+static inline uint64_t hpet_read(unsigned int reg)
+{
+	return hpet[reg / 8];
+}
+
+static inline uint64_t mul_shift32(uint64_t a, uint64_t mult)
+{
+	return (uint64_t) (((unsigned __int128) a * mult) >> 32);
+}
+
+uint64_t cycles_to_ns(uint64_t cycles)
+{
+	return mul_shift32(cycles, tsc_ns_mult);
+}
+
+uint64_t ns_to_cycles(uint64_t ns)
+{
+	return mul_shift32(ns, tsc_cycles_mult);
+}
+
+uint64_t ktime_get_ns(void)
+{
+	if (tsc_invariant || !hpet)
+		return cycles_to_ns(rdtsc() - tsc_base);
+	return mul_shift32(hpet_read(HPET_COUNTER) - hpet_base, hpet_ns_mult);
+}
+
+static int hpet_init(void)
+{
+	struct acpi_hpet *table = acpi_find_table("HPET");
+
+	if (!table || table->space_id != 0 || !table->address)
+		return -1;
+	vm_set_cache(table->address, PAGE_SIZE, VM_CACHE_UC);
+	hpet = (volatile uint64_t *) (uintptr_t) table->address;
+	hpet_period_fs = hpet_read(HPET_CAP) >> 32;
+	if (hpet_period_fs == 0 || hpet_period_fs > 100000000ULL) {
+		hpet = NULL;
+		return -1;
+	}
+	hpet[HPET_CONFIG / 8] = hpet_read(HPET_CONFIG) | HPET_ENABLE;
+	hpet_ns_mult = (hpet_period_fs << 32) / FSEC_PER_NSEC;
+	return 0;
+}
+
+/* TSC cycles per second, timed over CALIBRATE_MS of HPET counts */
+static uint64_t calibrate_hpet(void)
+{
+	uint64_t ticks = CALIBRATE_MS * NSEC_PER_MSEC * FSEC_PER_NSEC / hpet_period_fs;
+	uint64_t start, tsc_start, cycles, elapsed_us;
+
+	start = hpet_read(HPET_COUNTER);
+	tsc_start = rdtsc();
+	while (hpet_read(HPET_COUNTER) - start < ticks)
+		;
+	cycles = rdtsc() - tsc_start;
+	elapsed_us = (hpet_read(HPET_COUNTER) - start) * hpet_period_fs
+		/ (FSEC_PER_NSEC * NSEC_PER_USEC);
+	return elapsed_us ? cycles * 1000000ULL / elapsed_us : 0;
+}
+
+/* The same with PIT channel 2 in mode 0, polling its output on port 0x61 */
+static uint64_t calibrate_pit(void)
+{
+	uint16_t latch = PIT_HZ * CALIBRATE_MS / 1000;
+	uint64_t tsc_start, cycles;
+
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);	/* gate on, speaker off */
+	outb(PIT_CMD, 0xB0);		/* channel 2, lo/hi byte, mode 0, binary */
+	outb(PIT_CH2, latch & 0xFF);
+	outb(PIT_CH2, latch >> 8);
+	tsc_start = rdtsc();
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+	cycles = rdtsc() - tsc_start;
+	return cycles * (1000 / CALIBRATE_MS);
+}
+
+void clocksource_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (cpuid_max(0x80000000) >= 0x80000007) {
+		cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+		tsc_invariant = (edx >> 8) & 1;
+	}
+
+	if (hpet_init() == 0) {
+		tsc_hz = calibrate_hpet();
+		calibrated_by = "HPET";
+	}
+	if (!tsc_hz) {
+		tsc_hz = calibrate_pit();
+		calibrated_by = "PIT";
+	}
+
+	tsc_ns_mult = (NSEC_PER_SEC << 32) / tsc_hz;
+	tsc_cycles_mult = ((tsc_hz / 1000) << 32) / (NSEC_PER_SEC / 1000);
+	tsc_base = rdtsc();
+	if (hpet)
+		hpet_base = hpet_read(HPET_COUNTER);
+	clocksource_print_info();
+}
+
+void clocksource_print_info(void)
+{
+	printf("TSC: %llu.%03llu MHz (calibrated by %s), %s\n",
+		tsc_hz / 1000000, (tsc_hz / 1000) % 1000, calibrated_by,
+		tsc_invariant ? "invariant" : (hpet ? "not invariant, using HPET"
+			: "not invariant"));
+}
@@ -5,6 +5,10 @@
 
 #include <fb.h>
 #include <types.h>
+#include <printf.h>
+#include <bench.h>
+#include <vm.h>
+#include <string.h>
 
 extern unsigned char __ascii_font[2048]; /* ascii_font.c */
 
@@ -12,23 +16,22 @@ extern unsigned char __ascii_font[2048]; /* ascii_font.c */
 #define FONT_HEIGHT 16
 
 static unsigned int *Fb;
-static unsigned int Width, PosX, PosY, MaxX, MaxY;
+static unsigned int Width, Height, PosX, PosY, MaxX, MaxY;
 
 #define HELLO_STATEMENT \
 	"Framebuffer Console (CSE 597)\nCopyright (C) 2024 Ruslan Nikolaev\n\n"
 
 void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
 {
-	size_t i, num = (size_t) width * height;
+	size_t i;
 	const char *__hello_statement = HELLO_STATEMENT;
 
 
-	for (i = 0; i < num; i++) {
-		fb[i] = 0x00000000U;
-	}
+	memset(fb, 0, (size_t) width * height * sizeof(*fb));
 
 	Fb = fb;
 	Width = width;
+	Height = height;
 	PosX = 0;
 	PosY = 0;
 	MaxX = width / FONT_WIDTH;
@@ -42,23 +45,34 @@ void fb_init(unsigned int *fb, unsigned int width, unsigned int height)
 static void fb_scrollup(void)
 {
 
-	size_t cur = 0, count = Width * ((MaxY - 1) * FONT_HEIGHT);
+	size_t count = Width * ((MaxY - 1) * FONT_HEIGHT);
 	size_t row = Width * FONT_HEIGHT;
-	do {
-		Fb[cur] = Fb[cur+row];
-		cur++;
-	} while (--count != 0);
-
-	do {
-		Fb[cur] = 0x00000000U;
-		cur++;
-	} while (--row != 0);
+
+	memmove(Fb, Fb + row, count * sizeof(*Fb));
+	memset(Fb + count, 0, row * sizeof(*Fb));
 }
 
-void fb_output(char ch)
+static void fb_draw_char(unsigned int x, unsigned int y, char ch)
 {
-	size_t cur;
 	unsigned char *ptr;
+	size_t cur;
+
+	ptr = &__ascii_font[(unsigned char) ch * (FONT_WIDTH * FONT_HEIGHT / 8)];
+	cur = (size_t) x * FONT_WIDTH + (y * FONT_HEIGHT) * Width;
+	for (size_t j = 0; j < FONT_HEIGHT; j++) {
+	
+		signed char bitmap = ptr[j];
+		for (size_t i = 0; i < FONT_WIDTH; i++) {
+			signed char color = (bitmap >> 7);
+			Fb[cur + i] = (signed int) color;
+			bitmap <<= 1;
+		}
+		cur += Width;
+	}
+}
+
+void fb_output(char ch)
+{
 	if ((signed char) ch <= 0) { 
 		if (ch == 0) return;
 		ch = '?'; 
@@ -73,17 +87,55 @@ void fb_output(char ch)
 	}
 	if (ch == '\n')
 		return;
-	ptr = &__ascii_font[(unsigned char) ch * (FONT_WIDTH * FONT_HEIGHT / 8)];
-	cur = (size_t) PosX * FONT_WIDTH + (PosY * FONT_HEIGHT) * Width;
-	for (size_t j = 0; j < FONT_HEIGHT; j++) {
-	
-		signed char bitmap = ptr[j];
-		for (size_t i = 0; i < FONT_WIDTH; i++) {
-			signed char color = (bitmap >> 7);
-			Fb[cur + i] = (signed int) color;
-			bitmap <<= 1;
+	fb_draw_char(PosX, PosY, ch);
+	PosX++;
+}
+
+#define BENCH_GLYPHS	20000ULL
+#define BENCH_SCROLLS	100ULL
+
+/*
+ * Draw glyphs and scroll the whole screen, first with the framebuffer
+ * mapped WB in the PAT (so the MTRR type, usually UC, applies) and then
+ * write-combining, which is how it is left afterwards. The console lock
+ * keeps printf() on other CPUs from drawing in between; it is dropped
+ * around vm_set_cache(), whose shootdown needs the others to answer.
+ */
+void fb_bench(void)
+{
+	static const char *names[2] = { "PAT WB/MTRR", "PAT WC" };
+	const uint64_t types[2] = { VM_CACHE_WB, VM_CACHE_WC };
+	uint64_t size = (uint64_t) Width * Height * sizeof(*Fb);
+	uint64_t glyphs[2], scrolls[2], start, i, irq;
+	char what[48];
+
+	for (int t = 0; t < 2; t++) {
+		if (vm_set_cache((uintptr_t) Fb, size, types[t]) != 0) {
+			printf("fb bench: cannot change the framebuffer memory type\n");
+			return;
 		}
-		cur += Width;
+		irq = console_lock_irqsave();
+		start = bench_now();
+		for (i = 0; i < BENCH_GLYPHS; i++)
+			fb_draw_char(i % MaxX, (i / MaxX) % MaxY, 'A' + i % 26);
+		glyphs[t] = bench_now() - start;
+
+		start = bench_now();
+		for (i = 0; i < BENCH_SCROLLS; i++)
+			fb_scrollup();
+		scrolls[t] = bench_now() - start;
+		console_unlock_irqrestore(irq);
+	}
+
+	irq = console_lock_irqsave();
+	memset(Fb, 0, size);
+	PosX = 0;
+	PosY = 0;
+	console_unlock_irqrestore(irq);
+	for (int t = 0; t < 2; t++) {
+		snprintf(what, sizeof(what), "glyph draws, %s", names[t]);
+		bench_report(what, BENCH_GLYPHS, glyphs[t]);
+		snprintf(what, sizeof(what), "full-screen scrolls, %s", names[t]);
+		bench_report(what, BENCH_SCROLLS, scrolls[t]);
 	}
-	PosX++;
 }
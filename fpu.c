@@ -0,0 +1,351 @@
+/*
+ * fpu.c - lazy x87/SSE/AVX state switching (CSE 597)
+ *
+ * Every task has an extended-state area, sized from CPUID leaf 0xD for
+ * the features string_init() enabled in XCR0 (or 512 bytes for FXSAVE
+ * without XSAVE). The registers are not switched with the task: a CPU
+ * just remembers whose state they hold, and the scheduler sets CR0.TS
+ * whenever any other task runs. The first SIMD instruction of that
+ * task then raises #NM, and only then is the old owner's state saved
+ * (XSAVEOPT skips the parts that were not modified since they were
+ * restored) and the new one's loaded. Tasks that never touch SIMD, or
+ * a SIMD task that only shares the CPU with such tasks, never pay for
+ * more than the CR0 write.
+ *
+ * Tasks stay on their CPU, so the owner of a CPU's registers is always
+ * one of its own tasks, and only that CPU frees its area (sched_reap()).
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <printf.h>
+#include <bench.h>
+#include <slab.h>
+#include <string.h>
+#include <sched.h>
+#include <fpu.h>
+#include <irq.h>
+
+#define FPU_ALIGN			64			/* XSAVE needs it, FXSAVE 16 */
+#define FXSAVE_SIZE			512
+#define FPU_FCW_DEFAULT		0x037F		/* all exceptions masked */
+#define FPU_MXCSR_DEFAULT	0x1F80
+#define XFEATURE_YMM		(1ULL << 2)	/* upper halves of ymm0-15 */
+
+enum fpu_mode {
+	FPU_FXSAVE,
+	FPU_XSAVE,
+	FPU_XSAVEOPT,
+};
+
+static const char *fpu_mode_names[] = { "FXSAVE", "XSAVE", "XSAVEOPT" };
+
+struct fpu_cpu {
+	void *owner;				/* whose state is in the registers, or NULL */
+	int ts;						/* CR0.TS is set */
+	uint64_t traps;				/* #NM that loaded a state */
+	uint64_t saves;				/* of which had to save the old owner's */
+} __attribute__((aligned(64)));
+
+static struct fpu_cpu fpu_cpus[MAX_CPUS];
+static struct kmem_cache *fpu_cache;
+static enum fpu_mode fpu_mode;
+static size_t fpu_size;
+static uint64_t fpu_xfeatures;
+
+static void fpu_trap(struct irq_frame *f);
+
+static inline struct fpu_cpu *this_fpu(void)
+{
+	return &fpu_cpus[smp_cpu_id()];
+}
+
+static void fpu_save(void *area)
+{
+	uint32_t lo = (uint32_t) fpu_xfeatures, hi = fpu_xfeatures >> 32;
+
+	switch (fpu_mode) {
+	case FPU_XSAVEOPT:
+		__asm__ __volatile__ ("xsaveopt64 (%0)"
+			: : "r" (area), "a" (lo), "d" (hi) : "memory");
+		break;
+	case FPU_XSAVE:
+		__asm__ __volatile__ ("xsave64 (%0)"
+			: : "r" (area), "a" (lo), "d" (hi) : "memory");
+		break;
+	default:
+		__asm__ __volatile__ ("fxsave64 (%0)" : : "r" (area) : "memory");
+	}
+}
+
+static void fpu_restore(void *area)
+{
+	uint32_t lo = (uint32_t) fpu_xfeatures, hi = fpu_xfeatures >> 32;
+
+	if (fpu_mode == FPU_FXSAVE)
+		__asm__ __volatile__ ("fxrstor64 (%0)" : : "r" (area) : "memory");
+	else
+		__asm__ __volatile__ ("xrstor64 (%0)"
+			: : "r" (area), "a" (lo), "d" (hi) : "memory");
+}
+
+/* x87 and SSE are always there; #NM instead of emulation, TS clear */
+void fpu_cpu_init(void)
+{
+	struct fpu_cpu *fc = this_fpu();
+
+	write_cr0((read_cr0() | X86_CR0_MP) & ~(X86_CR0_EM | X86_CR0_TS));
+	fc->owner = NULL;
+	fc->ts = 0;
+}
+
+/* After string_init() has set up XCR0, before any task exists */
+void fpu_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	fpu_mode = FPU_FXSAVE;
+	fpu_size = FXSAVE_SIZE;
+	if (read_cr4() & X86_CR4_OSXSAVE) {
+		fpu_xfeatures = xgetbv(0);
+		cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+		fpu_size = ebx;			/* for the features enabled in XCR0 */
+		cpuid_count(0xD, 1, &eax, &ebx, &ecx, &edx);
+		fpu_mode = (eax & 1) ? FPU_XSAVEOPT : FPU_XSAVE;
+	}
+	fpu_size = (fpu_size + FPU_ALIGN - 1) & ~(size_t) (FPU_ALIGN - 1);
+
+	/* Slab objects start at a 64-byte header, so these stay aligned */
+	fpu_cache = kmem_cache_create("fpu", fpu_size, 0);
+	if (!fpu_cache)
+		printf("fpu: cannot create the state cache\n");
+	fpu_cpu_init();
+	irq_register(7, "#NM", fpu_trap);
+	printf("FPU: lazy switching with %s, %llu-byte areas (XCR0 %llx)\n",
+		fpu_mode_names[fpu_mode], (uint64_t) fpu_size, fpu_xfeatures);
+}
+
+/* A state area in the initial configuration */
+void *fpu_alloc(void)
+{
+	uint8_t *area;
+
+	if (!fpu_cache || !(area = kmem_cache_alloc(fpu_cache)))
+		return NULL;
+	memset(area, 0, fpu_size);
+	*(uint16_t *) area = FPU_FCW_DEFAULT;
+	*(uint32_t *) (area + 24) = FPU_MXCSR_DEFAULT;
+	return area;
+}
+
+/* Only called on the CPU whose task owned the area */
+void fpu_free(void *area)
+{
+	struct fpu_cpu *fc;
+	uint64_t irq;
+
+	if (!area)
+		return;
+	irq = irq_save();
+	fc = this_fpu();
+	if (fc->owner == area)
+		fc->owner = NULL;
+	irq_restore(irq);
+	kmem_cache_free(fpu_cache, area);
+}
+
+/* The registers already hold the state of the task with this area */
+void fpu_own(void *area)
+{
+	this_fpu()->owner = area;
+}
+
+/* The scheduler is about to run the task with this area */
+void fpu_switch(void *area)
+{
+	struct fpu_cpu *fc = this_fpu();
+
+	if (area == fc->owner) {
+		if (fc->ts) {
+			clts();
+			fc->ts = 0;
+		}
+	} else if (!fc->ts) {
+		write_cr0(read_cr0() | X86_CR0_TS);
+		fc->ts = 1;
+	}
+}
+
+/* #NM: the task wants its state */
+static void fpu_trap(struct irq_frame *f)
+{
+	struct fpu_cpu *fc = this_fpu();
+	struct task *t = task_current();
+
+	clts();
+	fc->ts = 0;
+	if (!t || !t->fpu || t->fpu == fc->owner)
+		return;
+	if (fc->owner) {
+		fpu_save(fc->owner);
+		fc->saves++;
+	}
+	fpu_restore(t->fpu);
+	fc->owner = t->fpu;
+	fc->traps++;
+}
+
+void fpu_print_info(void)
+{
+	printf("FPU: %s, %llu-byte areas\n", fpu_mode_names[fpu_mode],
+		(uint64_t) fpu_size);
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (cpu_locals[cpu].online)
+			printf("  CPU %u: %llu #NM loads, %llu saves\n", cpu,
+				fpu_cpus[cpu].traps, fpu_cpus[cpu].saves);
+	}
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_SWITCHES		200000ULL
+#define BENCH_SAVES			100000ULL
+#define BENCH_REGS			16
+#define BENCH_IPI_EVERY		64			/* switches between self-IPIs */
+
+static volatile int64_t bench_left;
+static uint64_t bench_lost;
+
+/*
+ * Fill xmm0-15, or ymm0-15 with AVX in XCR0, from p (32 bytes per
+ * register), and store them back to p. The kernel's C is built with
+ * -mgeneral-regs-only, so nothing the compiler generates lives in these
+ * registers and the asm does not have to list them.
+ */
+static void bench_load(const uint8_t *p)
+{
+	if (fpu_xfeatures & XFEATURE_YMM)
+		__asm__ __volatile__ (
+			".irp n,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15\n\t"
+			"vmovdqu \\n*32(%0), %%ymm\\n\n\t"
+			".endr" : : "r" (p) : "memory");
+	else
+		__asm__ __volatile__ (
+			".irp n,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15\n\t"
+			"movdqu \\n*32(%0), %%xmm\\n\n\t"
+			".endr" : : "r" (p) : "memory");
+}
+
+static void bench_store(uint8_t *p)
+{
+	if (fpu_xfeatures & XFEATURE_YMM)
+		__asm__ __volatile__ (
+			".irp n,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15\n\t"
+			"vmovdqu %%ymm\\n, \\n*32(%0)\n\t"
+			".endr" : : "r" (p) : "memory");
+	else
+		__asm__ __volatile__ (
+			".irp n,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15\n\t"
+			"movdqu %%xmm\\n, \\n*32(%0)\n\t"
+			".endr" : : "r" (p) : "memory");
+}
+
+/*
+ * Users load a pattern of their own into the registers and check it
+ * after the other task ran, and every BENCH_IPI_EVERY switches after a
+ * self-IPI whose handler may switch as well.
+ */
+static void bench_task(void *arg)
+{
+	unsigned int id = (uintptr_t) arg >> 1, use_sse = (uintptr_t) arg & 1;
+	uint8_t want[BENCH_REGS * 32] __attribute__((aligned(32)));
+	uint8_t got[BENCH_REGS * 32] __attribute__((aligned(32)));
+	size_t len = (fpu_xfeatures & XFEATURE_YMM) ? 32 : 16;
+	uint64_t n = 0;
+
+	while (__atomic_sub_fetch(&bench_left, 1, __ATOMIC_RELAXED) > 0) {
+		n++;
+		if (use_sse) {
+			for (unsigned int i = 0; i < sizeof(want); i++)
+				want[i] = (uint8_t) (id * 0x61 + n + i);
+			bench_load(want);
+		}
+		sched_yield();
+		if (n % BENCH_IPI_EVERY == 0)
+			smp_send_ipi(smp_cpu_id(), SMP_RESCHED_VECTOR);
+		if (use_sse) {
+			bench_store(got);
+			for (unsigned int r = 0; r < BENCH_REGS; r++) {
+				if (memcmp(want + r * 32, got + r * 32, len) != 0) {
+					__atomic_add_fetch(&bench_lost, 1, __ATOMIC_RELAXED);
+					break;
+				}
+			}
+		}
+	}
+	bench_task_done();
+}
+
+/* Two tasks ping-pong as in 'bench sched', users of them touch SSE */
+static void bench_pingpong(unsigned int users)
+{
+	struct fpu_cpu *fc = this_fpu();
+	uint64_t start, cycles, traps, lost, irq;
+	char what[40];
+
+	irq = irq_save();
+	bench_left = BENCH_SWITCHES;
+	lost = bench_lost;
+	for (unsigned int i = 0; i < 2; i++) {
+		if (bench_task_start(smp_cpu_id(), "fpu-bench", bench_task,
+				(void *) (uintptr_t) (i << 1 | (i < users))) != 0)
+			break;
+	}
+	traps = fc->traps;
+	start = bench_now();
+	sched_yield();
+	cycles = bench_now() - start;
+	traps = fc->traps - traps;
+	irq_restore(irq);
+	lost = bench_lost - lost;
+	bench_tasks_wait(0);
+
+	snprintf(what, sizeof(what), "%u of 2 tasks use SSE, switches", users);
+	bench_report(what, BENCH_SWITCHES, cycles);
+	printf("    #NM loads: %llu\n", traps);
+	if (lost)
+		printf("    registers changed under a task: %llu times\n", lost);
+}
+
+/* What an eager switch would add to every switch: one save and restore */
+static void bench_eager(void)
+{
+	void *area = fpu_alloc();
+	uint64_t start, cycles, irq;
+
+	if (!area)
+		return;
+	/* Own the registers first, so that saving them is not a trap */
+	__asm__ __volatile__ ("xorps %xmm1, %xmm1");
+	irq = irq_save();
+	start = bench_now();
+	for (uint64_t i = 0; i < BENCH_SAVES; i++) {
+		fpu_save(area);
+		fpu_restore(area);
+	}
+	cycles = bench_now() - start;
+	irq_restore(irq);
+	fpu_free(area);
+
+	bench_report("eager save + restore", BENCH_SAVES, cycles);
+}
+
+void fpu_bench(void)
+{
+	for (unsigned int users = 0; users <= 2; users++)
+		bench_pingpong(users);
+	bench_eager();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <types.h>
+#include <smp.h>
+
+#define ACPI_MAX_IOAPICS	8
+#define ACPI_MAX_OVERRIDES	16
+#define ACPI_MAX_NODES		8
+#define ACPI_MAX_MEM_RANGES	16
+
+struct acpi_cpu {
+	uint32_t apic_id;
+	uint32_t node;
+};
+
+struct acpi_ioapic {
+	uint32_t id;
+	uint32_t addr;
+	uint32_t gsi_base;
+};
+
+/* ISA IRQ -> GSI remapping (MADT interrupt source override) */
+struct acpi_override {
+	uint8_t irq;
+	uint16_t flags;
+	uint32_t gsi;
+};
+
+struct acpi_mem_range {
+	uint64_t start;
+	uint64_t end;
+	uint32_t node;
+};
+
+struct acpi_info {
+	uint64_t lapic_addr;
+	unsigned int num_cpus;
+	struct acpi_cpu cpus[MAX_CPUS];
+	unsigned int num_ioapics;
+	struct acpi_ioapic ioapics[ACPI_MAX_IOAPICS];
+	unsigned int num_overrides;
+	struct acpi_override overrides[ACPI_MAX_OVERRIDES];
+	/* NUMA (SRAT/SLIT); a single node 0 spanning everything without SRAT */
+	unsigned int num_nodes;
+	unsigned int num_mem_ranges;
+	struct acpi_mem_range mem_ranges[ACPI_MAX_MEM_RANGES];
+	uint8_t distance[ACPI_MAX_NODES][ACPI_MAX_NODES];
+};
+
+extern struct acpi_info acpi;
+
+void acpi_init(uintptr_t mb_addr);
+void *acpi_find_table(const char *sig);
+unsigned int acpi_apic_node(uint32_t apic_id);
+unsigned int acpi_addr_node(uint64_t addr);
+void acpi_print_topology(void);
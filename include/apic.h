@@ -13,12 +13,28 @@
 #define X86_LAPIC_DFR			0x0EU
 #define X86_LAPIC_SVR			0x0FU
 #define X86_LAPIC_ICR			0x30U
+#define X86_LAPIC_ICR_HIGH		0x31U
 
 #define X86_LAPIC_EOI			0x0BU
 #define X86_LAPIC_TIMER			0x32U
 #define X86_LAPIC_TIMER_INIT	0x38U
+#define X86_LAPIC_TIMER_CUR		0x39U
 #define X86_LAPIC_TIMER_DIVIDE	0x3EU
 
+/* LVT timer modes */
+#define X86_LAPIC_TIMER_ONESHOT		(0x0U << 17)
+#define X86_LAPIC_TIMER_PERIODIC	(0x1U << 17)
+#define X86_LAPIC_TIMER_TSC_DEADLINE	(0x2U << 17)
+#define X86_LAPIC_TIMER_MASKED		(0x1U << 16)
+
+/* ICR delivery modes */
+#define X86_LAPIC_ICR_FIXED			(0x0U << 8)
+#define X86_LAPIC_ICR_INIT			(0x5U << 8)
+#define X86_LAPIC_ICR_STARTUP		(0x6U << 8)
+#define X86_LAPIC_ICR_ASSERT		(0x1U << 14)
+
 void x86_lapic_enable(void);
 uint32_t x86_lapic_read(uint32_t offset);
-void x86_lapic_write(uint32_t offset, uint32_t value);
\ No newline at end of file
+void x86_lapic_write(uint32_t offset, uint32_t value);
+void x86_lapic_eoi(void);
+void x86_lapic_send_ipi(uint32_t apic_id, uint32_t cmd);
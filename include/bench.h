@@ -0,0 +1,24 @@
+#pragma once
+
+#include <types.h>
+#include <cpu.h>
+#include <sched.h>
+
+/* Benchmark tasks preempt the shell, which sleeps until they are done */
+#define BENCH_PRIO			(SCHED_PRIO_DEFAULT - 1)
+
+/* Timestamps for benchmarks, in TSC cycles */
+static inline uint64_t bench_now(void)
+{
+	__asm__ __volatile__ ("lfence" ::: "memory");
+	return rdtsc();
+}
+
+void bench_report(const char *what, uint64_t ops, uint64_t cycles);
+int bench_task_start(unsigned int cpu, const char *name, void (*fn)(void *),
+	void *arg);
+void bench_task_done(void);
+uint64_t bench_tasks_wait(uint64_t start);
+uint64_t bench_tasks_run(unsigned int n, unsigned int ncpus, const char *name,
+	void (*fn)(void *), void *arg);
+void bench_run(const char *name);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <types.h>
+
+enum clockevent_mode {
+	CLOCKEVENT_PERIODIC,		/* -DTIMER_PERIODIC: the old fixed tick */
+	CLOCKEVENT_ONESHOT,			/* LAPIC count-down, reprogrammed per event */
+	CLOCKEVENT_TSC_DEADLINE,	/* IA32_TSC_DEADLINE, no conversion needed */
+};
+
+extern unsigned int APIC_TIMER_VECTOR;		/* kernel.c */
+
+void clockevent_init(void);
+void clockevent_cpu_init(void);
+void clockevent_set(uint64_t deadline);
+void clockevent_set_timer(uint64_t deadline);
+void clockevent_interrupt(void);
+void clockevent_latency(uint64_t *worst, uint64_t *mean);
+void clockevent_print_info(void);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <types.h>
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_USEC		1000ULL
+
+extern uint64_t tsc_hz;
+
+void clocksource_init(void);
+uint64_t ktime_get_ns(void);
+uint64_t cycles_to_ns(uint64_t cycles);
+uint64_t ns_to_cycles(uint64_t ns);
+void clocksource_print_info(void);
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <types.h>
+
+#define X86_CR0_MP			(1ULL << 1)
+#define X86_CR0_EM			(1ULL << 2)
+#define X86_CR0_TS			(1ULL << 3)
+
+#define X86_CR4_PGE			(1ULL << 7)
+#define X86_CR4_PCIDE		(1ULL << 17)
+#define X86_CR4_OSXSAVE		(1ULL << 18)
+
+static inline void cpuid_count(uint32_t level, uint32_t subleaf,
+		uint32_t *eax_out, uint32_t *ebx_out,
+		uint32_t *ecx_out, uint32_t *edx_out)
+{
+	uint32_t eax_, ebx_, ecx_, edx_;
+
+	__asm__ __volatile__ (
+		"cpuid"
+		: "=a" (eax_), "=b" (ebx_), "=c" (ecx_), "=d" (edx_)
+		: "0" (level), "2" (subleaf)
+	);
+	*eax_out = eax_;
+	*ebx_out = ebx_;
+	*ecx_out = ecx_;
+	*edx_out = edx_;
+}
+
+static inline void cpuid(uint32_t level, uint32_t *eax_out, uint32_t *ebx_out,
+		uint32_t *ecx_out, uint32_t *edx_out)
+{
+	cpuid_count(level, 0, eax_out, ebx_out, ecx_out, edx_out);
+}
+
+/* Highest supported leaf of the basic or extended (0x8000xxxx) range */
+static inline uint32_t cpuid_max(uint32_t range)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(range, &eax, &ebx, &ecx, &edx);
+	return eax;
+}
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+static inline uint64_t read_cr0(void)
+{
+	uint64_t val;
+
+	__asm__ __volatile__ ("mov %%cr0, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr0(uint64_t val)
+{
+	__asm__ __volatile__ ("mov %0, %%cr0" : : "r" (val) : "memory");
+}
+
+/* Clear CR0.TS without a read-modify-write of CR0 */
+static inline void clts(void)
+{
+	__asm__ __volatile__ ("clts" : : : "memory");
+}
+
+static inline uint64_t read_cr2(void)
+{
+	uint64_t val;
+
+	__asm__ __volatile__ ("mov %%cr2, %0" : "=r" (val));
+	return val;
+}
+
+static inline uint64_t read_cr3(void)
+{
+	uint64_t val;
+
+	__asm__ __volatile__ ("mov %%cr3, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr3(uint64_t val)
+{
+	__asm__ __volatile__ ("mov %0, %%cr3" : : "r" (val) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+	uint64_t val;
+
+	__asm__ __volatile__ ("mov %%cr4, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr4(uint64_t val)
+{
+	__asm__ __volatile__ ("mov %0, %%cr4" : : "r" (val) : "memory");
+}
+
+/* The task priority register of the LAPIC, bits 7:4, as seen by the CPU */
+static inline uint64_t read_cr8(void)
+{
+	uint64_t val;
+
+	__asm__ __volatile__ ("mov %%cr8, %0" : "=r" (val));
+	return val;
+}
+
+static inline void write_cr8(uint64_t val)
+{
+	__asm__ __volatile__ ("mov %0, %%cr8" : : "r" (val) : "memory");
+}
+
+static inline void invlpg(void *addr)
+{
+	__asm__ __volatile__ ("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+static inline uint64_t xgetbv(uint32_t reg)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (reg));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t val)
+{
+	__asm__ __volatile__ ("xsetbv"
+		:
+		: "a" ((uint32_t) val), "d" ((uint32_t) (val >> 32)), "c" (reg));
+}
+
+static inline void wbinvd(void)
+{
+	__asm__ __volatile__ ("wbinvd" : : : "memory");
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+	uint8_t ret;
+
+	__asm__ __volatile__ ("inb %1, %0" : "=a" (ret) : "Nd" (port));
+	return ret;
+}
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+	__asm__ __volatile__ ("outb %0, %1" : : "a" (val), "Nd" (port));
+}
+
+static inline uint64_t irq_save(void)
+{
+	uint64_t flags;
+
+	__asm__ __volatile__ ("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+	__asm__ __volatile__ ("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
+}
@@ -6,6 +6,7 @@ extern "C" {
 
 void fb_init(unsigned int *fb, unsigned int width, unsigned int height);
 void fb_output(char ch);
+void fb_bench(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <types.h>
+
+void fpu_init(void);
+void fpu_cpu_init(void);
+void *fpu_alloc(void);
+void fpu_free(void *area);
+void fpu_own(void *area);
+void fpu_switch(void *area);
+void fpu_print_info(void);
+void fpu_bench(void);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <types.h>
+
+#define IRQ_VECTOR_BASE		0x30		/* ISA IRQ n comes in at IRQ_VECTOR_BASE + n */
+
+void ioapic_init(void);
+int ioapic_route(unsigned int irq, unsigned int vector, unsigned int cpu);
+void ioapic_print_info(void);
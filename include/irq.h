@@ -0,0 +1,71 @@
+#pragma once
+
+#include <types.h>
+#include <cpu.h>
+
+/*
+ * Interrupt priority classes. The LAPIC ranks a vector by its upper
+ * four bits, and holds an interrupt back unless its class is above
+ * both the TPR (CR8) and the class of the highest one in service. So a
+ * handler that enables interrupts can only be interrupted by a higher
+ * class, and a class never interrupts itself.
+ */
+#define IRQ_CLASS_MAINT		0x2		/* remote calls, nothing urgent */
+#define IRQ_CLASS_DEVICE	0x3		/* through the IOAPIC, from IRQ_VECTOR_BASE */
+#define IRQ_CLASS_TIMER		0x5		/* the LAPIC timer and the scheduler */
+#define IRQ_CLASS_IPI		0xE		/* TLB shootdowns and rescheduling */
+
+#define IRQ_CLASS(vector)	((vector) >> 4)
+
+#define IRQ_EXCEPTIONS		32			/* vectors below are CPU exceptions */
+#define IRQ_BENCH_VECTOR	0x3F		/* 'bench irq': a slow device handler */
+#define IRQ_SPURIOUS_VECTOR	0xFF		/* from the LAPIC SVR, takes no EOI */
+
+#define IRQ_STUB_SIZE		16			/* kernel_asm.S */
+
+/* What irq_entry in kernel_asm.S leaves on the stack for a handler */
+struct irq_frame {
+	uint64_t r11, r10, r9, r8, rsi, rdi, rdx, rcx, rax;
+	uint64_t vector;
+	uint64_t error;				/* 0 where the CPU pushes none */
+	uint64_t rip, cs, rflags, rsp, ss;
+};
+
+/* Hold off interrupts of class cls and below; returns the old mask */
+static inline uint64_t irq_class_raise(uint64_t cls)
+{
+	uint64_t old = read_cr8();
+
+	if (cls > old)
+		write_cr8(cls);
+	return old;
+}
+
+static inline void irq_class_restore(uint64_t old)
+{
+	write_cr8(old);
+}
+
+/*
+ * Device and maintenance handlers may let higher classes in, and have
+ * to shut them out again before they return: after the EOI the LAPIC
+ * delivers the same class again, onto the same IST stack.
+ */
+static inline void hardirq_nest(void)
+{
+	__asm__ __volatile__ ("sti" : : : "memory");
+}
+
+static inline void hardirq_unnest(void)
+{
+	__asm__ __volatile__ ("cli" : : : "memory");
+}
+
+int irq_register(unsigned int vector, const char *name,
+	void (*fn)(struct irq_frame *f));
+unsigned int irq_vector_ist(unsigned int vector);
+int in_interrupt(void);
+int hardirq_nested(void);
+void hardirq_defer_resched(void);
+void irq_print_info(void);
+void irq_bench(void);
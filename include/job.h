@@ -0,0 +1,24 @@
+#pragma once
+
+#include <types.h>
+
+/* A unit of work; lives wherever its spawner keeps it until job_join() */
+struct job {
+	void (*fn)(void *arg);
+	void *arg;
+	volatile int done;
+};
+
+static inline void job_init(struct job *job, void (*fn)(void *), void *arg)
+{
+	job->fn = fn;
+	job->arg = arg;
+	job->done = 0;
+}
+
+void jobs_init(void);
+void job_spawn(struct job *job);
+void job_join(struct job *job);
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain,
+		void (*fn)(uint64_t lo, uint64_t hi, void *arg), void *arg);
+void job_bench(void);
@@ -33,6 +33,9 @@ static inline void load_idt(idt_pointer_t *idtp)
 	);
 }
 
+/* Load the shared IDT on another CPU (also enables interrupts) */
+void idt_cpu_init(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <types.h>
+#include <ioapic.h>
+
+#define KEYBOARD_IRQ		1
+#define KEYBOARD_VECTOR		(IRQ_VECTOR_BASE + KEYBOARD_IRQ)
+
+void keyboard_init(void);
+char keyboard_getchar(void);
+void keyboard_print_info(void);
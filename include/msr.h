@@ -6,6 +6,12 @@
 #define MSR_STAR	0xC0000081
 #define MSR_LSTAR	0xC0000082
 #define MSR_SFMASK	0xC0000084
+#define MSR_GS_BASE	0xC0000101
+#define MSR_PAT		0x277
+#define MSR_MTRRCAP	0xFE
+#define MSR_MTRR_PHYSBASE(n)	(0x200 + 2 * (n))
+#define MSR_MTRR_PHYSMASK(n)	(0x201 + 2 * (n))
+#define MSR_TSC_DEADLINE	0x6E0
 
 /* GDT entries, do not re-arrange these! */
 #define GDT_KERNEL_CODE32	0x08
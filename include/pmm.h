@@ -0,0 +1,20 @@
+#pragma once
+
+#include <types.h>
+
+#define PMM_MAX_ORDER		10		/* largest block: 4 MiB */
+#define PMM_ORDER_2M		9
+
+void pmm_init(uintptr_t mb_addr);
+void pmm_cpu_init(void);
+void pmm_for_each_ram(void (*fn)(uint64_t start, uint64_t end));
+void *pmm_alloc(unsigned int order);
+void *pmm_alloc_node(unsigned int order, unsigned int node);
+void pmm_free(void *addr);
+void pmm_print_info(void);
+void pmm_print_nodes(void);
+
+static inline void *pmm_alloc_page(void)
+{
+	return pmm_alloc(0);
+}
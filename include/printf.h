@@ -13,6 +13,8 @@ size_t snprintf(char * buffer, size_t n, const char * fmt, ...);
 size_t sprintf(char * buffer, const char * fmt, ...);
 size_t vprintf(const char *fmt, va_list args);
 size_t printf(const char * fmt, ...);
+uint64_t console_lock_irqsave(void);
+void console_unlock_irqrestore(uint64_t irq);
 
 #ifdef __cplusplus
 }
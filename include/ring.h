@@ -0,0 +1,228 @@
+#pragma once
+
+#include <types.h>
+#include <spinlock.h>
+
+/*
+ * Lock-free queues for handing things between CPUs, or between an
+ * interrupt handler and a task. The indices each side writes are on
+ * lines of their own, so a producer and a consumer only share a line
+ * when one of them has to look at the other's progress.
+ */
+
+/*
+ * Single producer, single consumer ring of non-NULL pointers. Each
+ * side keeps a copy of the other's index and only rereads it when the
+ * ring looks full (or empty) by that copy. size is a power of two.
+ */
+struct spsc_ring {
+	void **slots;
+	uint64_t mask;
+	struct {
+		volatile uint64_t head;		/* next slot to fill */
+		uint64_t tail_seen;
+	} __attribute__((aligned(64))) prod;
+	struct {
+		volatile uint64_t tail;		/* next slot to empty */
+		uint64_t head_seen;
+	} __attribute__((aligned(64))) cons;
+};
+
+static inline void spsc_init(struct spsc_ring *r, void **slots, uint64_t size)
+{
+	r->slots = slots;
+	r->mask = size - 1;
+	r->prod.head = 0;
+	r->prod.tail_seen = 0;
+	r->cons.tail = 0;
+	r->cons.head_seen = 0;
+}
+
+/* Returns 0 if the ring is full */
+static inline int spsc_push(struct spsc_ring *r, void *p)
+{
+	uint64_t head = r->prod.head;
+
+	if (head - r->prod.tail_seen > r->mask) {
+		r->prod.tail_seen = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+		if (head - r->prod.tail_seen > r->mask)
+			return 0;
+	}
+	r->slots[head & r->mask] = p;
+	__atomic_store_n(&r->prod.head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Returns NULL if the ring is empty */
+static inline void *spsc_pop(struct spsc_ring *r)
+{
+	uint64_t tail = r->cons.tail;
+	void *p;
+
+	if (tail == r->cons.head_seen) {
+		r->cons.head_seen = __atomic_load_n(&r->prod.head, __ATOMIC_ACQUIRE);
+		if (tail == r->cons.head_seen)
+			return NULL;
+	}
+	p = r->slots[tail & r->mask];
+	__atomic_store_n(&r->cons.tail, tail + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+static inline uint64_t spsc_count(struct spsc_ring *r)
+{
+	return r->prod.head - r->cons.tail;
+}
+
+/*
+ * Multiple producer, single consumer queue (Vyukov): unbounded and
+ * intrusive, so pushing never fails or allocates. A push is one swap
+ * of head plus a store linking the previous node to the new one; the
+ * consumer walks from tail. Between those two stores the queue looks
+ * cut short, and mpsc_pop() spins until the link shows up, so keep
+ * interrupts disabled around mpsc_push(). A node may be pushed again
+ * once it was popped.
+ */
+struct mpsc_node {
+	struct mpsc_node *volatile next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *volatile head __attribute__((aligned(64)));	/* producers */
+	struct mpsc_node *tail __attribute__((aligned(64)));			/* consumer */
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *n)
+{
+	struct mpsc_node *prev;
+
+	n->next = NULL;
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/* The node after n, or NULL if n is the last one */
+static inline struct mpsc_node *mpsc_next(struct mpsc_queue *q, struct mpsc_node *n)
+{
+	struct mpsc_node *next;
+
+	while (!(next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE))) {
+		if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == n)
+			return NULL;
+		cpu_relax();		/* a producer is about to link it */
+	}
+	return next;
+}
+
+/* Returns NULL if the queue is empty */
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail, *next;
+
+	if (tail == &q->stub) {
+		if (!(next = mpsc_next(q, tail)))
+			return NULL;
+		q->tail = tail = next;
+	}
+	if ((next = mpsc_next(q, tail))) {
+		q->tail = next;
+		return tail;
+	}
+	/* tail is the last node; queue the stub behind it to take it out */
+	mpsc_push(q, &q->stub);
+	q->tail = mpsc_next(q, tail);
+	return tail;
+}
+
+/*
+ * Bounded multiple producer, multiple consumer ring (Vyukov). Every
+ * cell has a sequence number telling whose turn it is: pos when it may
+ * be filled for position pos, pos + 1 when it may be emptied. A side
+ * claims a position with a compare-exchange on its index and then
+ * hands the cell over by advancing the sequence number. size is a
+ * power of two.
+ */
+struct mpmc_cell {
+	volatile uint64_t seq;
+	void *data;
+};
+
+struct mpmc_ring {
+	struct mpmc_cell *cells;
+	uint64_t mask;
+	volatile uint64_t enq __attribute__((aligned(64)));
+	volatile uint64_t deq __attribute__((aligned(64)));
+};
+
+static inline void mpmc_init(struct mpmc_ring *r, struct mpmc_cell *cells, uint64_t size)
+{
+	r->cells = cells;
+	r->mask = size - 1;
+	for (uint64_t i = 0; i < size; i++)
+		cells[i].seq = i;
+	r->enq = 0;
+	r->deq = 0;
+}
+
+/* Returns 0 if the ring is full */
+static inline int mpmc_push(struct mpmc_ring *r, void *p)
+{
+	uint64_t pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+	struct mpmc_cell *c;
+
+	for (;;) {
+		int64_t diff;
+
+		c = &r->cells[pos & r->mask];
+		diff = (int64_t) (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->enq, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+		}
+	}
+	c->data = p;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Returns NULL if the ring is empty */
+static inline void *mpmc_pop(struct mpmc_ring *r)
+{
+	uint64_t pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+	struct mpmc_cell *c;
+	void *p;
+
+	for (;;) {
+		int64_t diff;
+
+		c = &r->cells[pos & r->mask];
+		diff = (int64_t) (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->deq, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+		}
+	}
+	p = c->data;
+	__atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+void ring_bench(void);
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <types.h>
+#include <smp.h>
+
+#define SCHED_VECTOR		0x51		/* int $SCHED_VECTOR enters the scheduler */
+
+#define SCHED_PRIOS			32			/* 0 is the highest priority */
+#define SCHED_PRIO_DEFAULT	16
+
+/* Saved by irq_entry/sched_trap in kernel_asm.S; keep the offsets in sync */
+typedef struct task_frame {
+	uint64_t rax;
+	uint64_t rdx;
+	uint64_t rbx;
+	uint64_t rcx;
+	uint64_t rsi;
+	uint64_t rdi;
+	uint64_t r8;
+	uint64_t r9;
+	uint64_t r10;
+	uint64_t r11;
+	uint64_t r12;
+	uint64_t r13;
+	uint64_t r14;
+	uint64_t r15;
+	uint64_t rbp;
+	uint64_t rip;
+	uint64_t rflags;
+	uint64_t rsp;
+	struct vm_space *space;		/* NULL: kernel address space only */
+} task_frame_t;
+
+enum task_state {
+	TASK_RUNNABLE,				/* on a run queue */
+	TASK_RUNNING,
+	TASK_BLOCKED,
+	TASK_DEAD,					/* waiting for sched_reap() */
+};
+
+struct task {
+	task_frame_t frame;			/* must be first, curr_task points here */
+	unsigned int id;
+	unsigned int prio;
+	unsigned int cpu;			/* whose run queue it belongs to */
+	enum task_state state;
+	const char *name;
+	struct kstack *stack;		/* NULL for the boot task */
+	void *fpu;					/* extended state, see fpu.c */
+	uint64_t blocked_at;		/* TSC when it last blocked */
+	void (*entry)(void *);
+	void *arg;
+	struct task *next;			/* run queue or zombie list */
+};
+
+void sched_init(void);
+void sched_ap_init(void);
+void sched_idle(void) __attribute__((noreturn));
+struct task *task_create(const char *name, void (*entry)(void *), void *arg,
+		unsigned int prio);
+struct task *task_create_on(unsigned int cpu, const char *name,
+		void (*entry)(void *), void *arg, unsigned int prio);
+void task_exit(void) __attribute__((noreturn));
+void task_block(void);
+void task_block_while(volatile int *flag);
+void task_wake(struct task *task);
+void sched_yield(void);
+void sched_yield_trap(void);
+void sched_tick(void);
+void sched_ipi(void);
+void sched_reap(void);
+void sched_print_info(void);
+void sched_bench(void);
+void sched_idle_bench(void);
+
+static inline struct task *task_current(void)
+{
+	return (struct task *) this_cpu()->curr_task;
+}
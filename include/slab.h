@@ -0,0 +1,22 @@
+#pragma once
+
+#include <types.h>
+
+struct kmem_cache;
+
+#define KMEM_NO_MAGAZINE	0x1U	/* bypass the per-CPU magazine layer */
+
+/* Largest request served from the power-of-two caches; above it, pages */
+#define KMALLOC_MAX_SLAB	1024
+
+void slab_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		unsigned int flags);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+void slab_print_info(void);
+void slab_bench(void);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <types.h>
+#include <ring.h>
+
+#define MAX_CPUS			16
+
+/* In the priority classes of include/irq.h */
+#define SMP_TLB_VECTOR		0xE2		/* flush the TLB, global pages included */
+#define SMP_RESCHED_VECTOR	0xE3		/* a task was queued for this CPU */
+#define SMP_CALL_VECTOR		0x24		/* run the calls in this CPU's mailbox */
+
+struct task_frame;
+
+/*
+ * Per-CPU data, found through the GS base of each CPU. kernel_asm.S
+ * reads curr_task at a fixed offset; keep it in sync.
+ */
+struct cpu_local {
+	struct cpu_local *self;
+	unsigned int id;
+	uint32_t apic_id;
+	volatile struct task_frame *curr_task;
+	int online;
+} __attribute__((aligned(64)));		/* no sharing of lines between CPUs */
+
+#define CPU_LOCAL_CURR_TASK	16
+
+/*
+ * A function call for another CPU. The caller owns it, and must keep
+ * it around until done is set, which happens right after fn returned.
+ */
+struct smp_call {
+	struct mpsc_node node;		/* must be first */
+	void (*fn)(void *arg);
+	void *arg;
+	volatile int done;
+};
+
+extern struct cpu_local cpu_locals[MAX_CPUS];
+extern unsigned int smp_num_cpus;		/* CPUs that are online */
+
+static inline struct cpu_local *this_cpu(void)
+{
+	struct cpu_local *cpu;
+
+	__asm__ __volatile__ ("movq %%gs:0, %0" : "=r" (cpu));
+	return cpu;
+}
+
+/* Index of the executing CPU, 0 for the BSP */
+static inline unsigned int smp_cpu_id(void)
+{
+	unsigned int id;
+
+	__asm__ __volatile__ ("movl %%gs:8, %0" : "=r" (id));
+	return id;
+}
+
+void smp_boot_cpu_init(void);
+void smp_init(void);
+void smp_send_ipi(unsigned int cpu, unsigned int vector);
+void smp_tlb_shootdown(void);
+void smp_cache_shootdown(void);
+int smp_call_async(unsigned int cpu, struct smp_call *call);
+int smp_call(unsigned int cpu, void (*fn)(void *), void *arg);
+void smp_print_info(void);
+void smp_bench(void);
+void smp_call_bench(void);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <types.h>
+#include <ring.h>
+
+/* Raised from an interrupt handler, run soon after in softirqd */
+enum softirq {
+	SOFTIRQ_TIMER,				/* expired timers, timer.c */
+	NR_SOFTIRQS,
+};
+
+/*
+ * Work for a task context. fn runs in the worker task of the CPU it
+ * was queued on, with interrupts enabled, and may block. Queueing it
+ * again before it ran does nothing; pending is cleared right before fn
+ * is called, so fn may queue it again.
+ */
+struct work {
+	struct mpsc_node node;		/* must be first */
+	void (*fn)(void *arg);
+	void *arg;
+	volatile int pending;
+};
+
+#define WORK_INIT(f, a)		{ { NULL }, (f), (a), 0 }
+
+void softirq_init(void);
+void raise_softirq(enum softirq nr);
+void work_init(struct work *w, void (*fn)(void *), void *arg);
+int queue_work_on(unsigned int cpu, struct work *w);
+int queue_work(struct work *w);
+void softirq_print_info(void);
+void softirq_bench(void);
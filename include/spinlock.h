@@ -0,0 +1,144 @@
+#pragma once
+
+#include <types.h>
+#include <cpu.h>
+
+/*
+ * A ticket lock: lockers take the next ticket with one atomic add and
+ * spin until owner reaches it, so the lock is granted in FIFO order.
+ * Take the irqsave variant for anything an interrupt handler on the
+ * same CPU may also lock.
+ */
+typedef struct {
+	union {
+		volatile uint32_t val;
+		struct {
+			volatile uint16_t owner;	/* the ticket being served */
+			volatile uint16_t next;		/* the next ticket to hand out */
+		};
+	};
+} spinlock_t;
+
+#define SPINLOCK_INIT		{ { 0 } }
+#define TICKET_ONE			(1U << 16)		/* one ticket, in val */
+
+static inline void cpu_relax(void)
+{
+	__asm__ __volatile__ ("pause" : : : "memory");
+}
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+	lock->val = 0;
+}
+
+static inline int spin_trylock(spinlock_t *lock)
+{
+	uint32_t val = lock->val;
+
+	if ((uint16_t) val != (uint16_t) (val >> 16))
+		return 0;
+	return __atomic_compare_exchange_n(&lock->val, &val, val + TICKET_ONE, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+	uint16_t ticket = __atomic_fetch_add(&lock->val, TICKET_ONE,
+		__ATOMIC_ACQUIRE) >> 16;
+
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+		cpu_relax();
+}
+
+/* Only the holder writes owner, so a plain increment is enough */
+static inline void spin_unlock(spinlock_t *lock)
+{
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline int spin_is_locked(spinlock_t *lock)
+{
+	uint32_t val = lock->val;
+
+	return (uint16_t) val != (uint16_t) (val >> 16);
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock)
+{
+	uint64_t flags = irq_save();
+
+	spin_lock(lock);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+	spin_unlock(lock);
+	irq_restore(flags);
+}
+
+/*
+ * An MCS lock (Mellor-Crummey & Scott): each locker brings a node,
+ * usually on its stack, and spins on a flag in it, so a release only
+ * touches the cache line of the next waiter instead of all of them.
+ * The node has to stay put until the matching unlock.
+ */
+struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile int locked;
+};
+
+typedef struct {
+	struct mcs_node *volatile tail;
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT		{ NULL }
+
+static inline void mcs_lock(mcs_lock_t *lock, struct mcs_node *node)
+{
+	struct mcs_node *prev;
+
+	node->next = NULL;
+	node->locked = 1;
+	prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (!prev)
+		return;
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static inline void mcs_unlock(mcs_lock_t *lock, struct mcs_node *node)
+{
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (!next) {
+		struct mcs_node *expected = node;
+
+		/* Nobody behind us, unless one is just linking itself in */
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			cpu_relax();
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t mcs_lock_irqsave(mcs_lock_t *lock, struct mcs_node *node)
+{
+	uint64_t flags = irq_save();
+
+	mcs_lock(lock, node);
+	return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, struct mcs_node *node,
+		uint64_t flags)
+{
+	mcs_unlock(lock, node);
+	irq_restore(flags);
+}
+
+void lock_bench(void);
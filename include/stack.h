@@ -0,0 +1,39 @@
+#pragma once
+
+#include <types.h>
+
+#define STACK_DEFAULT_SIZE	(16ULL << 10)
+#define STACK_POISON		0x57ac57ac57ac57acULL
+
+/* IST slots; interrupts have one per class, which cannot nest in itself */
+#define IST_DOUBLE_FAULT	1
+#define IST_NMI				2
+#define IST_MACHINE_CHECK	3
+#define IST_TIMER			4
+#define IST_IPI				5
+#define IST_DEVICE			6
+#define IST_MAINT			7
+#define IST_STACKS			7
+
+/* A kernel stack: [base, base + size), with an unmapped guard page below */
+struct kstack {
+	uintptr_t base;
+	size_t size;
+	unsigned int class;
+	int live;
+	struct kstack *next;		/* on its class's free list */
+	struct kstack *all;			/* every stack ever created */
+};
+
+void stack_init(void);
+void stack_cpu_init(void);
+struct kstack *stack_alloc(size_t size);
+void stack_free(struct kstack *stack);
+size_t stack_high_water(const struct kstack *stack);
+struct kstack *stack_find_guard(uintptr_t addr);
+void stack_print_info(void);
+
+static inline void *stack_top(const struct kstack *stack)
+{
+	return (void *) (stack->base + stack->size);
+}
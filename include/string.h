@@ -9,3 +9,16 @@ static inline size_t strlen(const char *str)
 		cur++;
 	return (size_t) (cur - str);
 }
+
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+void *memset(void *dst, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+
+/* Always bypass the caches, e.g., for write-only targets */
+void *memcpy_nt(void *dst, const void *src, size_t n);
+void *memset_nt(void *dst, int c, size_t n);
+
+void string_init(void);
+void string_cpu_init(void);
+void string_bench(void);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <types.h>
+
+/*
+ * A one-shot timer. expires is an absolute TSC value, like the
+ * deadlines of clockevent_set(). fn runs in softirqd (softirq.c) of the
+ * CPU the timer was last armed on; it may re-arm the timer, but must
+ * not block.
+ */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;		/* NULL while not pending */
+	uint64_t expires;
+	void (*fn)(void *arg);
+	void *arg;
+	unsigned int cpu;			/* whose wheel it is on */
+	uint8_t level;
+	uint8_t slot;
+};
+
+void timer_init(struct timer *t, void (*fn)(void *), void *arg);
+void add_timer(struct timer *t, uint64_t expires);
+int mod_timer(struct timer *t, uint64_t expires);
+int del_timer(struct timer *t);
+void sleep_ns(uint64_t ns);
+void timer_interrupt(void);
+void timer_softirq(void);
+void timer_print_info(void);
+void timer_bench(void);
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <types.h>
+#include <smp.h>
+
+#define PAGE_SIZE			4096ULL
+#define PAGE_SIZE_2M		0x200000ULL
+#define PAGE_SIZE_1G		0x40000000ULL
+
+/* Page table entry bits */
+#define PTE_P				(1ULL << 0)
+#define PTE_W				(1ULL << 1)
+#define PTE_PWT				(1ULL << 3)
+#define PTE_PCD				(1ULL << 4)
+#define PTE_A				(1ULL << 5)
+#define PTE_D				(1ULL << 6)
+#define PTE_PS				(1ULL << 7)		/* 2 MiB / 1 GiB leaf */
+#define PTE_G				(1ULL << 8)
+#define PTE_ADDR_MASK		0x000FFFFFFFFFF000ULL
+
+/* Kernel mappings are shared by every address space, hence global */
+#define PTE_KERNEL			(PTE_P | PTE_W | PTE_G)
+#define PTE_PRIVATE			(PTE_P | PTE_W)
+
+/*
+ * Memory types, as PWT/PCD selections of the PAT programmed by
+ * vm_cpu_init(): 0 = WB, 1 = WC, 2 = UC-, 3 = UC
+ */
+#define VM_CACHE_WB			0
+#define VM_CACHE_WC			PTE_PWT
+#define VM_CACHE_UC			(PTE_PWT | PTE_PCD)
+
+/* Page fault error code bits */
+#define PF_PRESENT			(1ULL << 0)
+#define PF_WRITE			(1ULL << 1)
+
+/* Demand-paged kernel virtual memory, above the identity map */
+#define VMALLOC_BASE		0x0000100000000000ULL
+#define VMALLOC_SIZE		(64ULL << 30)
+
+/* Kernel stacks with unmapped guard pages (stack.c) */
+#define STACK_REGION_BASE	0x0000180000000000ULL
+#define STACK_REGION_SIZE	(64ULL << 30)
+
+/* Per-address-space mappings, never present in the kernel PML4 */
+#define VM_PRIVATE_BASE		0x0000200000000000ULL
+
+#define CR3_NOFLUSH			(1ULL << 63)
+
+struct vm_stats {
+	uint64_t table_pages;	/* page-table pages in use */
+	uint64_t pages_4k;		/* leaf entries by size */
+	uint64_t pages_2m;
+	uint64_t pages_1g;
+	uint64_t build_cycles;	/* TSC cycles spent building the identity map */
+};
+
+struct vm_fault_stats {
+	uint64_t faults;		/* all #PF exceptions */
+	uint64_t demand_zero;	/* resolved by mapping a zeroed frame */
+	uint64_t bad;			/* outside any vmalloc area, or protection */
+	uint64_t resident;		/* vmalloc pages currently backed */
+	uint64_t cycles;		/* TSC cycles spent resolving faults */
+};
+
+/* An address space: private mappings on top of the shared kernel ones */
+struct vm_space {
+	uint64_t *pml4;
+	uint16_t pcid[MAX_CPUS];	/* per-CPU PCID, valid while gen matches */
+	uint32_t gen[MAX_CPUS];
+};
+
+extern struct vm_stats vm_stats;
+extern struct vm_fault_stats vm_fault_stats;
+extern uint64_t *vm_kernel_pml4;
+
+uint64_t vm_identity_init(void);
+int vm_map_range(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t size,
+		uint64_t flags);
+uint64_t vm_unmap_page(uint64_t *pml4, uint64_t va);
+void vm_print_stats(void);
+void vm_cpu_init(void);
+void vm_flush_all(void);
+int vm_set_cache(uint64_t va, uint64_t size, uint64_t cache);
+int vm_share_slot(uint64_t va);
+
+struct vm_space *vm_space_create(void);
+void vm_space_destroy(struct vm_space *space);
+void vm_space_switch(struct vm_space *space);
+void vm_space_bench(void);
+
+void vmalloc_init(void);
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+int vm_fault(uint64_t addr, uint64_t err);
+void vmalloc_bench(void);
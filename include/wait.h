@@ -0,0 +1,75 @@
+#pragma once
+
+#include <types.h>
+#include <spinlock.h>
+
+struct task;
+
+/* Lives on the waiter's stack while it is queued */
+struct wait_entry {
+	struct task *task;
+	struct wait_entry *next;
+	volatile int waiting;		/* cleared by the waker */
+};
+
+struct wait_queue {
+	spinlock_t lock;
+	struct wait_entry *head;	/* FIFO */
+	struct wait_entry *tail;
+};
+
+#define WAIT_QUEUE_INIT		{ SPINLOCK_INIT, NULL, NULL }
+
+void wait_queue_init(struct wait_queue *wq);
+void wait_prepare(struct wait_queue *wq, struct wait_entry *w);
+void wait_cancel(struct wait_queue *wq, struct wait_entry *w);
+void wait_block(struct wait_queue *wq, struct wait_entry *w);
+void wake_up_one(struct wait_queue *wq);
+void wake_up_all(struct wait_queue *wq);
+
+/*
+ * Sleep until cond holds. cond is evaluated again after the task is
+ * queued, so a wake_up_*() that follows making it true is never lost.
+ * It may have side effects (a trylock), as long as it only has them
+ * when it is true.
+ */
+#define wait_event(wq, cond) do {				\
+	struct wait_entry __w;						\
+												\
+	while (!(cond)) {							\
+		wait_prepare((wq), &__w);				\
+		if (cond) {								\
+			wait_cancel((wq), &__w);			\
+			break;								\
+		}										\
+		wait_block((wq), &__w);					\
+	}											\
+} while (0)
+
+/* Sleeping lock; never take it with interrupts disabled */
+struct mutex {
+	volatile uint32_t locked;
+	struct task *owner;
+	struct wait_queue wq;
+};
+
+#define MUTEX_INIT			{ 0, NULL, WAIT_QUEUE_INIT }
+
+void mutex_init(struct mutex *m);
+int mutex_trylock(struct mutex *m);
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+struct semaphore {
+	volatile int64_t count;
+	struct wait_queue wq;
+};
+
+#define SEMAPHORE_INIT(n)	{ (n), WAIT_QUEUE_INIT }
+
+void sem_init(struct semaphore *s, int64_t count);
+int sem_trydown(struct semaphore *s);
+void sem_down(struct semaphore *s);
+void sem_up(struct semaphore *s);
+
+void wait_bench(void);
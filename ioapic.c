@@ -0,0 +1,150 @@
+/*
+ * ioapic.c - IOAPIC interrupt routing (CSE 597)
+ *
+ * The IOAPICs come from the MADT (acpi.c). Each pin is a GSI; an ISA
+ * IRQ is the GSI of the same number unless an interrupt source
+ * override says otherwise, and the override also gives its polarity
+ * and trigger mode. The legacy 8259 PICs are masked, so that devices
+ * only interrupt through pins routed here. All pins start masked.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <acpi.h>
+#include <vm.h>
+#include <ioapic.h>
+
+#define IOAPIC_REGSEL		0x00		/* in 32-bit words from the base */
+#define IOAPIC_WIN			0x04
+
+#define IOAPIC_REG_VER		0x01
+#define IOAPIC_REG_REDIR	0x10		/* two registers per pin */
+
+#define IOAPIC_ACTIVE_LOW	(1U << 13)
+#define IOAPIC_LEVEL		(1U << 15)
+#define IOAPIC_MASKED		(1U << 16)
+
+/* MPS INTI flags in an interrupt source override; 0 is the ISA default */
+#define INTI_POLARITY_MASK	0x3
+#define INTI_ACTIVE_LOW		0x3
+#define INTI_TRIGGER_MASK	0xC
+#define INTI_LEVEL			0xC
+
+#define PIC1_DATA			0x21
+#define PIC2_DATA			0xA1
+
+struct ioapic {
+	volatile uint32_t *base;
+	uint32_t id;
+	uint32_t gsi_base;
+	unsigned int pins;
+};
+
+static struct ioapic ioapics[ACPI_MAX_IOAPICS];
+static unsigned int num_ioapics;
+static spinlock_t ioapic_lock;		/* the select/window pair */
+
+static uint32_t ioapic_read(struct ioapic *io, uint32_t reg)
+{
+	io->base[IOAPIC_REGSEL] = reg;
+	return io->base[IOAPIC_WIN];
+}
+
+static void ioapic_write(struct ioapic *io, uint32_t reg, uint32_t val)
+{
+	io->base[IOAPIC_REGSEL] = reg;
+	io->base[IOAPIC_WIN] = val;
+}
+
+static struct ioapic *gsi_ioapic(uint32_t gsi)
+{
+	for (unsigned int i = 0; i < num_ioapics; i++) {
+		struct ioapic *io = &ioapics[i];
+
+		if (gsi >= io->gsi_base && gsi < io->gsi_base + io->pins)
+			return io;
+	}
+	return NULL;
+}
+
+void ioapic_init(void)
+{
+	outb(PIC1_DATA, 0xFF);
+	outb(PIC2_DATA, 0xFF);
+
+	for (unsigned int i = 0; i < acpi.num_ioapics; i++) {
+		struct ioapic *io = &ioapics[num_ioapics];
+
+		if (vm_set_cache(acpi.ioapics[i].addr, PAGE_SIZE, VM_CACHE_UC) != 0)
+			continue;
+		io->base = (volatile uint32_t *) (uintptr_t) acpi.ioapics[i].addr;
+		io->id = acpi.ioapics[i].id;
+		io->gsi_base = acpi.ioapics[i].gsi_base;
+		io->pins = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+		for (unsigned int pin = 0; pin < io->pins; pin++)
+			ioapic_write(io, IOAPIC_REG_REDIR + 2 * pin, IOAPIC_MASKED);
+		printf("IOAPIC %u: %u pins from GSI %u\n", io->id, io->pins, io->gsi_base);
+		num_ioapics++;
+	}
+	if (!num_ioapics)
+		printf("ioapic: none found, device interrupts stay off\n");
+}
+
+/*
+ * Deliver ISA IRQ irq to vector on the given CPU, and unmask it.
+ * Returns the GSI, or -1 if no IOAPIC has it. Physical destination
+ * mode only reaches APIC IDs below 256.
+ */
+int ioapic_route(unsigned int irq, unsigned int vector, unsigned int cpu)
+{
+	uint32_t gsi = irq, low = vector;
+	uint16_t flags = 0;
+	struct ioapic *io;
+	uint64_t irqf;
+
+	for (unsigned int i = 0; i < acpi.num_overrides; i++) {
+		if (acpi.overrides[i].irq == irq) {
+			gsi = acpi.overrides[i].gsi;
+			flags = acpi.overrides[i].flags;
+		}
+	}
+	if (!(io = gsi_ioapic(gsi)) || cpu >= MAX_CPUS)
+		return -1;
+	if ((flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW)
+		low |= IOAPIC_ACTIVE_LOW;
+	if ((flags & INTI_TRIGGER_MASK) == INTI_LEVEL)
+		low |= IOAPIC_LEVEL;
+
+	irqf = spin_lock_irqsave(&ioapic_lock);
+	ioapic_write(io, IOAPIC_REG_REDIR + 2 * (gsi - io->gsi_base) + 1,
+		cpu_locals[cpu].apic_id << 24);
+	ioapic_write(io, IOAPIC_REG_REDIR + 2 * (gsi - io->gsi_base), low);
+	spin_unlock_irqrestore(&ioapic_lock, irqf);
+	return gsi;
+}
+
+/* The pins that are not masked */
+void ioapic_print_info(void)
+{
+	uint64_t irq = spin_lock_irqsave(&ioapic_lock);
+
+	for (unsigned int i = 0; i < num_ioapics; i++) {
+		struct ioapic *io = &ioapics[i];
+
+		for (unsigned int pin = 0; pin < io->pins; pin++) {
+			uint32_t low = ioapic_read(io, IOAPIC_REG_REDIR + 2 * pin);
+			uint32_t high = ioapic_read(io, IOAPIC_REG_REDIR + 2 * pin + 1);
+
+			if (low & IOAPIC_MASKED)
+				continue;
+			printf("  GSI %u: vector %x, APIC ID %u, %s, active %s\n",
+				io->gsi_base + pin, low & 0xFF, high >> 24,
+				(low & IOAPIC_LEVEL) ? "level" : "edge",
+				(low & IOAPIC_ACTIVE_LOW) ? "low" : "high");
+		}
+	}
+	spin_unlock_irqrestore(&ioapic_lock, irq);
+}
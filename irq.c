@@ -0,0 +1,374 @@
+/*
+ * irq.c - interrupt dispatch, nesting and accounting (CSE 597)
+ *
+ * Every vector enters through a generated stub (kernel_asm.S) that
+ * pushes its number and jumps to one common entry, which saves only
+ * what a C call clobbers and calls irq_dispatch(). That looks up the
+ * handler given to irq_register(), sends the EOI for interrupts, and
+ * counts the vector, with a histogram of its cycles per call. An
+ * exception without a handler halts with its vector and error code.
+ *
+ * Vectors come in priority classes (include/irq.h), and every class
+ * has an IST stack of its own on each CPU (stack.c), so an interrupt
+ * never adds to the stack of whatever it interrupted. Device and
+ * maintenance handlers run with interrupts enabled, which lets the
+ * timer and IPIs in while they work instead of after they are done.
+ *
+ * A timer interrupt that comes in on top of another handler must not
+ * switch tasks: that handler's frame is on its class's IST stack, and
+ * the next task could take an interrupt of the same class onto it. So
+ * the nested timer only notes that the scheduler has to run, and the
+ * outermost handler, on its way out, arms the timer to fire again as
+ * soon as it has returned.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <apic.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <stack.h>
+#include <clocksource.h>
+#include <clockevent.h>
+#include <irq.h>
+
+/*
+ * Handlers run on top of the SIMD registers of whatever task was
+ * interrupted, and nothing saves them first (fpu.c); after the #NM
+ * handler loaded a task's state, any C code here would clobber it.
+ */
+#ifdef __SSE__
+#error "the kernel has to be built with -mgeneral-regs-only"
+#endif
+
+#define IRQ_VECTORS			256
+#define IRQ_SLOTS			16			/* vectors with stats; slot 0 is the rest */
+#define IRQ_HIST_BUCKETS	12
+#define IRQ_HIST_SHIFT		7			/* bucket 0: under 128 cycles */
+
+struct irq_desc {
+	void (*fn)(struct irq_frame *f);
+	const char *name;
+	unsigned int slot;
+};
+
+/* Bucket b counts calls of [2^(b + 6), 2^(b + 7)) cycles, 0 and the last open-ended */
+struct irq_stats {
+	uint64_t count;
+	uint64_t cycles;			/* nested handlers count for both */
+	uint32_t hist[IRQ_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct irq_cpu {
+	unsigned int depth;			/* handlers running on this CPU */
+	unsigned int exceptions;	/* exception handlers running on it */
+	int resched;				/* a nested timer left sched_tick() to us */
+	uint64_t hardirqs;
+	uint64_t nested;			/* of which interrupted another handler */
+	uint64_t max;
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct irq_frame) == 16 * 8,
+	"irq_entry in kernel_asm.S pushes 9 registers, a vector and an error code");
+
+static const char *exception_names[IRQ_EXCEPTIONS] = {
+	"#DE", "#DB", "NMI", "#BP", "#OF", "#BR", "#UD", "#NM",
+	"#DF", NULL, "#TS", "#NP", "#SS", "#GP", "#PF", NULL,
+	"#MF", "#AC", "#MC", "#XM", "#VE", "#CP",
+};
+
+static struct irq_desc irq_descs[IRQ_VECTORS];
+static struct irq_stats irq_stats[MAX_CPUS][IRQ_SLOTS];
+static struct irq_cpu irq_cpus[MAX_CPUS];
+static unsigned int irq_slot_vectors[IRQ_SLOTS];
+static unsigned int irq_nr_slots = 1;
+static spinlock_t irq_lock;
+
+static inline struct irq_cpu *this_irq(void)
+{
+	return &irq_cpus[smp_cpu_id()];
+}
+
+/* The IST slot for a vector's gate (stack.c), 0 for the current stack */
+unsigned int irq_vector_ist(unsigned int vector)
+{
+	switch (vector) {
+	case 2:
+		return IST_NMI;
+	case 8:
+		return IST_DOUBLE_FAULT;
+	case 18:
+		return IST_MACHINE_CHECK;
+	}
+	if (vector < IRQ_EXCEPTIONS)
+		return 0;
+	switch (IRQ_CLASS(vector)) {
+	case IRQ_CLASS_MAINT:
+		return IST_MAINT;
+	case IRQ_CLASS_DEVICE:
+		return IST_DEVICE;
+	case IRQ_CLASS_TIMER:
+		return IST_TIMER;
+	case IRQ_CLASS_IPI:
+		return IST_IPI;
+	}
+	return 0;
+}
+
+/*
+ * Have fn handle vector; returns -1 if it already has another handler.
+ * Handlers of interrupts return with interrupts disabled, and leave
+ * the EOI to irq_dispatch().
+ */
+int irq_register(unsigned int vector, const char *name,
+		void (*fn)(struct irq_frame *f))
+{
+	struct irq_desc *d;
+	uint64_t irq;
+	int ret = 0;
+
+	if (vector >= IRQ_VECTORS)
+		return -1;
+	d = &irq_descs[vector];
+	irq = spin_lock_irqsave(&irq_lock);
+	if (d->fn && d->fn != fn) {
+		ret = -1;
+	} else if (!d->fn) {
+		d->name = name;
+		if (irq_nr_slots < IRQ_SLOTS) {
+			d->slot = irq_nr_slots++;
+			irq_slot_vectors[d->slot] = vector;
+		}
+		__atomic_store_n(&d->fn, fn, __ATOMIC_RELEASE);
+	}
+	spin_unlock_irqrestore(&irq_lock, irq);
+	return ret;
+}
+
+static void irq_account(unsigned int slot, uint64_t cycles)
+{
+	struct irq_stats *st = &irq_stats[smp_cpu_id()][slot];
+	unsigned int b = 63 - __builtin_clzll(cycles | 1);
+
+	b = b < IRQ_HIST_SHIFT ? 0 : b - IRQ_HIST_SHIFT + 1;
+	if (b >= IRQ_HIST_BUCKETS)
+		b = IRQ_HIST_BUCKETS - 1;
+	st->count++;
+	st->cycles += cycles;
+	st->hist[b]++;
+}
+
+static void irq_fatal(struct irq_frame *f)
+{
+	const char *name = exception_names[f->vector];
+
+	printf("\nException %llu (%s) at rip %p, error %llx. Halted.\n", f->vector,
+		name ? name : "reserved", (void *) f->rip, f->error);
+	for (;;)
+		__asm__ __volatile__ ("cli; hlt");
+}
+
+/* Called from irq_entry in kernel_asm.S, with interrupts disabled */
+void irq_dispatch(struct irq_frame *f)
+{
+	struct irq_desc *d = &irq_descs[f->vector];
+	struct irq_cpu *ic;
+	uint64_t start = rdtsc(), cycles;
+
+	if (f->vector < IRQ_EXCEPTIONS) {
+		if (!d->fn)
+			irq_fatal(f);
+		ic = this_irq();
+		ic->exceptions++;
+		d->fn(f);
+		ic->exceptions--;
+		irq_account(d->slot, rdtsc() - start);
+		return;
+	}
+
+	ic = this_irq();
+	if (ic->depth++)
+		ic->nested++;
+	if (d->fn)
+		d->fn(f);
+	if (f->vector != IRQ_SPURIOUS_VECTOR)
+		x86_lapic_eoi();
+
+	cycles = rdtsc() - start;
+	irq_account(d->slot, cycles);
+	ic->hardirqs++;
+	if (cycles > ic->max)
+		ic->max = cycles;
+	if (--ic->depth == 0 && ic->resched) {
+		ic->resched = 0;
+		clockevent_set(rdtsc());
+	}
+}
+
+/* An interrupt or exception handler runs on this CPU */
+int in_interrupt(void)
+{
+	struct irq_cpu *ic = this_irq();
+
+	return ic->depth || ic->exceptions;
+}
+
+/* The running handler interrupted another one */
+int hardirq_nested(void)
+{
+	return this_irq()->depth > 1;
+}
+
+/* From a nested timer interrupt: run the scheduler once all handlers are done */
+void hardirq_defer_resched(void)
+{
+	this_irq()->resched = 1;
+}
+
+/* Per CPU, then per vector over all CPUs with its histogram */
+void irq_print_info(void)
+{
+	printf("cpu  hard irqs    nested  worst ns\n");
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct irq_cpu *ic = &irq_cpus[cpu];
+
+		if (!cpu_locals[cpu].online)
+			continue;
+		printf("%3u %10llu %9llu %9llu\n", cpu, ic->hardirqs, ic->nested,
+			cycles_to_ns(ic->max));
+	}
+
+	printf("vec  name         calls   ns each  cycles: <128 <256 ... >=128k\n");
+	for (unsigned int slot = 0; slot < irq_nr_slots; slot++) {
+		uint64_t count = 0, cycles = 0, hist[IRQ_HIST_BUCKETS] = { 0 };
+		unsigned int vec = irq_slot_vectors[slot];
+
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			struct irq_stats *st = &irq_stats[cpu][slot];
+
+			count += st->count;
+			cycles += st->cycles;
+			for (unsigned int b = 0; b < IRQ_HIST_BUCKETS; b++)
+				hist[b] += st->hist[b];
+		}
+		if (!count)
+			continue;
+		if (slot)
+			printf("%3x  %-8s", vec, irq_descs[vec].name);
+		else
+			printf("     %-8s", "other");
+		printf(" %9llu %9llu ", count, cycles_to_ns(cycles / count));
+		for (unsigned int b = 0; b < IRQ_HIST_BUCKETS; b++)
+			printf(" %llu", hist[b]);
+		printf("\n");
+	}
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_ROUNDS		200
+#define BENCH_BUSY_NS		(200 * NSEC_PER_USEC)	/* in the device handler */
+#define BENCH_DUE_NS		(50 * NSEC_PER_USEC)	/* the timer, after it started */
+#define BENCH_IPIS			10000ULL
+#define BENCH_EOIS			100000ULL
+
+static uint64_t bench_busy;
+static volatile int bench_nest;
+static volatile int bench_done;
+
+/* IRQ_BENCH_VECTOR: a device handler that takes its time */
+static void bench_handler(struct irq_frame *f)
+{
+	uint64_t start = rdtsc();
+
+	if (bench_nest)
+		hardirq_nest();
+	while (rdtsc() - start < bench_busy)
+		cpu_relax();
+	hardirq_unnest();
+	bench_done = 1;
+}
+
+/*
+ * The timer is armed to fire while a self-IPI on a device vector is
+ * being handled, and clockevent.c tells how late it came.
+ */
+static void bench_one(int nest)
+{
+	uint64_t due = ns_to_cycles(BENCH_DUE_NS), worst, mean, nested, irq;
+
+	bench_nest = nest;
+	nested = this_irq()->nested;
+	clockevent_latency(&worst, &mean);
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		irq = irq_save();
+		bench_done = 0;
+		clockevent_set(rdtsc() + due);
+		smp_send_ipi(smp_cpu_id(), IRQ_BENCH_VECTOR);
+		irq_restore(irq);
+		while (!bench_done)
+			cpu_relax();
+	}
+	clockevent_latency(&worst, &mean);
+	printf("  device handler %s: timer worst %llu ns, mean %llu ns late,"
+		" %llu nested interrupts\n", nest ? "nested" : "not nested",
+		cycles_to_ns(worst), cycles_to_ns(mean), this_irq()->nested - nested);
+}
+
+/* The whole way of an interrupt: self-IPI, entry, dispatch, EOI, return */
+static void bench_ipis(void)
+{
+	uint64_t start, cycles;
+
+	bench_busy = 0;
+	bench_nest = 0;
+	start = bench_now();
+	for (uint64_t i = 0; i < BENCH_IPIS; i++) {
+		bench_done = 0;
+		smp_send_ipi(smp_cpu_id(), IRQ_BENCH_VECTOR);
+		while (!bench_done)
+			cpu_relax();
+	}
+	cycles = bench_now() - start;
+	bench_report("self-IPI round trips", BENCH_IPIS, cycles);
+}
+
+/* Nothing is in service, so these EOIs do nothing but cost their time */
+static void bench_eoi(void)
+{
+	uint64_t start, cycles, irq;
+
+	irq = irq_save();
+	start = bench_now();
+	for (uint64_t i = 0; i < BENCH_EOIS; i++)
+		x86_lapic_write(X86_LAPIC_EOI, 0);
+	cycles = bench_now() - start;
+	bench_report("EOI through x86_lapic_write", BENCH_EOIS, cycles);
+
+	start = bench_now();
+	for (uint64_t i = 0; i < BENCH_EOIS; i++)
+		x86_lapic_eoi();
+	cycles = bench_now() - start;
+	irq_restore(irq);
+	bench_report("EOI through x86_lapic_eoi", BENCH_EOIS, cycles);
+}
+
+void irq_bench(void)
+{
+	if (irq_register(IRQ_BENCH_VECTOR, "bench", bench_handler) < 0) {
+		printf("irq_bench: vector %x is taken\n", IRQ_BENCH_VECTOR);
+		return;
+	}
+	bench_ipis();
+	bench_eoi();
+
+	bench_busy = ns_to_cycles(BENCH_BUSY_NS);
+	printf("  timer due %llu us into a %llu us device handler, %u times\n",
+		BENCH_DUE_NS / NSEC_PER_USEC, BENCH_BUSY_NS / NSEC_PER_USEC, BENCH_ROUNDS);
+	bench_one(0);
+	bench_one(1);
+}
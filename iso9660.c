@@ -1,5 +1,6 @@
 #include <types.h>
 #include <printf.h>
+#include <slab.h>
 #include "iso9660.h"
 
 #define SECTOR_SIZE 2048
@@ -335,7 +336,10 @@ static iso_dir_record_t *iso9660_find_path(const char *path)
     uint32_t curr_lba  = root->extent_lba_le;
     uint32_t curr_size = root->data_length_le;
 
-    char tokens[ISO_MAX_DEPTH][ISO_MAX_NAME];
+    /* ~1 KiB: too large for the kernel stack */
+    char (*tokens)[ISO_MAX_NAME] = kmalloc(ISO_MAX_DEPTH * ISO_MAX_NAME);
+    if (!tokens)
+        return NULL;
     int depth = split_path(path, tokens);
 
     iso_dir_record_t *rec = NULL;
@@ -354,17 +358,20 @@ static iso_dir_record_t *iso9660_find_path(const char *path)
         }
 
         if (!rec)
-            return NULL;
+            break;
 
         if (i < depth - 1) {
-            if (!(rec->flags & ISO_FLAG_DIRECTORY))
-                return NULL;
+            if (!(rec->flags & ISO_FLAG_DIRECTORY)) {
+                rec = NULL;
+                break;
+            }
 
             curr_lba  = rec->extent_lba_le;
             curr_size = rec->data_length_le;
         }
     }
 
+    kfree(tokens);
     return rec;
 }
 
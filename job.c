@@ -0,0 +1,363 @@
+/*
+ * job.c - work-stealing fork/join jobs (CSE 597)
+ *
+ * Every CPU has a worker task and a Chase-Lev deque of jobs ("Dynamic
+ * Circular Work-Stealing Deque", with the C11 orderings of Le et al.).
+ * Whatever runs on a CPU pushes and pops at the bottom of that CPU's
+ * deque; idle workers steal from the top of the others. Pushes and
+ * pops happen with interrupts off, so the tasks sharing a CPU take
+ * turns as its single owner. A worker with nothing to do blocks, and
+ * job_spawn() wakes one parked worker per job pushed.
+ *
+ * job_join() only pops its own deque while it waits: anything above
+ * the joined job was spawned after it, so the helping stays bounded
+ * by the caller's own recursion depth.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <vm.h>
+#include <string.h>
+#include <sched.h>
+#include <job.h>
+
+#define JOB_DEQUE_SIZE		256			/* a power of two */
+
+struct job_deque {
+	volatile int64_t top __attribute__((aligned(64)));	/* thieves */
+	volatile int64_t bottom __attribute__((aligned(64)));	/* owner */
+	struct job *buf[JOB_DEQUE_SIZE];
+};
+
+struct job_cpu {
+	struct job_deque deque;
+	struct task *worker;
+	volatile int parked;		/* the worker is (about to be) blocked */
+	uint32_t seed;				/* for picking steal victims */
+	uint64_t runs;
+	uint64_t steals;
+} __attribute__((aligned(64)));
+
+static struct job_cpu job_cpus[MAX_CPUS];
+static unsigned int job_ncpus;	/* CPUs 0..job_ncpus-1 take part */
+
+/* Owner side; false if the deque is full */
+static int deque_push(struct job_deque *d, struct job *job)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= JOB_DEQUE_SIZE)
+		return 0;
+	d->buf[b & (JOB_DEQUE_SIZE - 1)] = job;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* Owner side: the most recently pushed job, racing thieves for the last one */
+static struct job *deque_pop(struct job_deque *d)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t t;
+	struct job *job;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	job = d->buf[b & (JOB_DEQUE_SIZE - 1)];
+	if (t == b) {
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			job = NULL;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return job;
+}
+
+/* Thief side: the oldest job, or NULL if empty or another thief won */
+static struct job *deque_steal(struct job_deque *d)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	struct job *job;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	job = d->buf[t & (JOB_DEQUE_SIZE - 1)];
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return job;
+}
+
+static int deque_empty(struct job_deque *d)
+{
+	return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE)
+		>= __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void job_run(struct job_cpu *jc, struct job *job)
+{
+	job->fn(job->arg);
+	jc->runs++;
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+}
+
+/* Wake one parked worker other than ours, if any is parked */
+static void job_wake_one(unsigned int self)
+{
+	for (unsigned int i = 1; i < job_ncpus; i++) {
+		struct job_cpu *jc = &job_cpus[(self + i) % job_ncpus];
+
+		if (jc->parked && __atomic_exchange_n(&jc->parked, 0, __ATOMIC_SEQ_CST)) {
+			task_wake(jc->worker);
+			return;
+		}
+	}
+}
+
+void job_spawn(struct job *job)
+{
+	unsigned int cpu;
+	int pushed;
+	uint64_t irq = irq_save();
+
+	cpu = smp_cpu_id();
+	pushed = deque_push(&job_cpus[cpu].deque, job);
+	irq_restore(irq);
+	if (!pushed) {
+		job_run(&job_cpus[cpu], job);
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	job_wake_one(cpu);
+}
+
+static struct job *job_pop_local(void)
+{
+	uint64_t irq = irq_save();
+	struct job *job = deque_pop(&job_cpus[smp_cpu_id()].deque);
+
+	irq_restore(irq);
+	return job;
+}
+
+void job_join(struct job *job)
+{
+	struct job *next;
+
+	while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+		if ((next = job_pop_local()))
+			job_run(&job_cpus[smp_cpu_id()], next);
+		else
+			cpu_relax();
+	}
+}
+
+/* Try the other participating CPUs, starting at a random one */
+static struct job *job_steal(struct job_cpu *jc, unsigned int self)
+{
+	unsigned int start;
+	struct job *job;
+
+	if (job_ncpus < 2)
+		return NULL;
+	jc->seed ^= jc->seed << 13;
+	jc->seed ^= jc->seed >> 17;
+	jc->seed ^= jc->seed << 5;
+	start = jc->seed % job_ncpus;
+	for (unsigned int i = 0; i < job_ncpus; i++) {
+		unsigned int victim = (start + i) % job_ncpus;
+		struct job_deque *d = &job_cpus[victim].deque;
+
+		if (victim == self || !(job = deque_steal(d)))
+			continue;
+		jc->steals++;
+		if (!deque_empty(d))
+			job_wake_one(self);
+		return job;
+	}
+	return NULL;
+}
+
+static int job_any_queued(void)
+{
+	for (unsigned int cpu = 0; cpu < job_ncpus; cpu++) {
+		if (!deque_empty(&job_cpus[cpu].deque))
+			return 1;
+	}
+	return 0;
+}
+
+static void job_worker(void *arg)
+{
+	unsigned int self = smp_cpu_id();
+	struct job_cpu *jc = &job_cpus[self];
+	struct job *job;
+
+	for (;;) {
+		if (self < job_ncpus && ((job = job_pop_local())
+				|| (job = job_steal(jc, self)))) {
+			job_run(jc, job);
+			continue;
+		}
+		/* Announce, then look again: job_spawn() does the reverse */
+		__atomic_store_n(&jc->parked, 1, __ATOMIC_SEQ_CST);
+		if (self < job_ncpus && job_any_queued()) {
+			jc->parked = 0;
+			continue;
+		}
+		task_block_while(&jc->parked);
+	}
+}
+
+/* One worker per online CPU; call after smp_init() */
+void jobs_init(void)
+{
+	for (unsigned int cpu = 0; cpu < smp_num_cpus; cpu++) {
+		job_cpus[cpu].seed = 2463534242U + cpu;
+		job_cpus[cpu].worker = task_create_on(cpu, "worker", job_worker,
+			NULL, SCHED_PRIO_DEFAULT);
+		if (!job_cpus[cpu].worker) {
+			printf("jobs: no worker for CPU %u\n", cpu);
+			break;
+		}
+		job_ncpus = cpu + 1;
+	}
+	printf("jobs: %u workers\n", job_ncpus);
+}
+
+struct pfor {
+	struct job job;
+	uint64_t lo, hi, grain;
+	void (*fn)(uint64_t lo, uint64_t hi, void *arg);
+	void *arg;
+};
+
+/* Split in halves down to the grain, spawning the right half each time */
+static void pfor_run(void *p)
+{
+	struct pfor *pf = p;
+	struct pfor left, right;
+	uint64_t mid;
+
+	if (pf->hi - pf->lo <= pf->grain) {
+		pf->fn(pf->lo, pf->hi, pf->arg);
+		return;
+	}
+	mid = pf->lo + (pf->hi - pf->lo) / 2;
+	left = right = *pf;
+	left.hi = mid;
+	right.lo = mid;
+	job_init(&right.job, pfor_run, &right);
+	job_spawn(&right.job);
+	pfor_run(&left);
+	job_join(&right.job);
+}
+
+/* Call fn on pieces of [begin, end) of at most grain, in parallel */
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain,
+		void (*fn)(uint64_t lo, uint64_t hi, void *arg), void *arg)
+{
+	struct pfor pf = { .lo = begin, .hi = end, .grain = grain ? grain : 1,
+		.fn = fn, .arg = arg };
+
+	if (begin < end)
+		pfor_run(&pf);
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_BYTES			(32ULL << 20)
+#define BENCH_CHUNK			(64ULL << 10)
+#define BENCH_CHUNKS		(BENCH_BYTES / BENCH_CHUNK)
+
+struct hash_work {
+	const uint8_t *buf;
+	uint64_t *hashes;
+};
+
+/* FNV-1a of each chunk in [lo, hi) */
+static void hash_chunks(uint64_t lo, uint64_t hi, void *arg)
+{
+	struct hash_work *w = arg;
+
+	for (uint64_t c = lo; c < hi; c++) {
+		const uint8_t *p = w->buf + c * BENCH_CHUNK;
+		uint64_t h = 14695981039346656037ULL;
+
+		for (uint64_t i = 0; i < BENCH_CHUNK; i++)
+			h = (h ^ p[i]) * 1099511628211ULL;
+		w->hashes[c] = h;
+	}
+}
+
+/* Hash 32 MiB in 64 KiB chunks with 1, 2, 4, ... and all CPUs taking part */
+void job_bench(void)
+{
+	unsigned int all = job_ncpus, ncpus = 1;
+	uint64_t base_cycles = 0, base_sum = 0;
+	struct hash_work w;
+	char what[32];
+
+	w.buf = vmalloc(BENCH_BYTES);
+	w.hashes = vmalloc(BENCH_CHUNKS * sizeof(uint64_t));
+	if (!w.buf || !w.hashes || !all) {
+		printf("job_bench: no memory or no workers\n");
+		goto out;
+	}
+	memset((void *) w.buf, 0x5a, BENCH_BYTES);
+	memset(w.hashes, 0, BENCH_CHUNKS * sizeof(uint64_t));
+
+	for (;;) {
+		uint64_t start, cycles, sum = 0, runs = 0, steals = 0;
+
+		job_ncpus = ncpus;
+		for (unsigned int cpu = 0; cpu < all; cpu++) {
+			runs -= job_cpus[cpu].runs;
+			steals -= job_cpus[cpu].steals;
+		}
+		start = bench_now();
+		parallel_for(0, BENCH_CHUNKS, 1, hash_chunks, &w);
+		cycles = bench_now() - start;
+		for (unsigned int cpu = 0; cpu < all; cpu++) {
+			runs += job_cpus[cpu].runs;
+			steals += job_cpus[cpu].steals;
+		}
+		for (uint64_t c = 0; c < BENCH_CHUNKS; c++)
+			sum += w.hashes[c];
+		if (ncpus == 1) {
+			base_cycles = cycles;
+			base_sum = sum;
+		}
+
+		snprintf(what, sizeof(what), "%u CPUs, bytes", ncpus);
+		bench_report(what, BENCH_BYTES, cycles);
+		printf("    speedup %llu.%02llu, %llu jobs, %llu stolen%s\n",
+			base_cycles / cycles, base_cycles * 100 / cycles % 100,
+			runs, steals, sum == base_sum ? "" : ", WRONG HASHES");
+		if (ncpus == all)
+			break;
+		ncpus = ncpus * 2 < all ? ncpus * 2 : all;
+	}
+	job_ncpus = all;
+
+out:
+	if (w.buf)
+		vfree((void *) w.buf);
+	if (w.hashes)
+		vfree(w.hashes);
+}
@@ -9,65 +9,34 @@
 #include <apic.h>
 #include <printf.h>
 #include <kernel.h>
+#include <cpu.h>
+#include <vm.h>
+#include <pmm.h>
+#include <slab.h>
+#include <acpi.h>
+#include <bench.h>
+#include <string.h>
+#include <stack.h>
+#include <smp.h>
+#include <sched.h>
+#include <job.h>
+#include <fpu.h>
+#include <timer.h>
+#include <ioapic.h>
+#include <keyboard.h>
+#include <softirq.h>
+#include <irq.h>
+#include <clocksource.h>
+#include <clockevent.h>
 #include "iso9660.h"
-#define PG_BYTES          4096ULL
-#define PT_ENTRIES        512ULL
-#define PT_RW_PRESENT     0x3ULL   
+
 unsigned int APIC_TIMER_VECTOR = 0x50;
 
 extern void task_init(void *tcb, void *entry, void *stack_top);
 extern void task_start(void *tcb);
 
-void timer_apic_handler(void);
-
 #define SHELL_MAX_LINE 128
 
-/* ================= Keyboard Input ================= */
-
-static inline uint8_t inb(uint16_t port)
-{
-    uint8_t ret;
-    __asm__ __volatile__ ("inb %1, %0"
-                          : "=a"(ret)
-                          : "Nd"(port));
-    return ret;
-}
-
-/* Minimal US QWERTY scancode map */
-static const char scancode_map[128] = {
-    0,  27, '1','2','3','4','5','6','7','8','9','0','-','=', '\b',
-    '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
-    0,  'a','s','d','f','g','h','j','k','l',';','\'','`',
-    0, '\\','z','x','c','v','b','n','m',',','.','/',
-    0, '*',0, ' '
-};
-
-static char keyboard_getchar(void)
-{
-    static uint8_t last_scancode = 0;
-    uint8_t scancode;
-
-    while (1) {
-        scancode = inb(0x60);
-
-        /* Ignore key releases */
-        if (scancode & 0x80) {
-            last_scancode = 0;
-            continue;
-        }
-
-        /* Ignore repeats */
-        if (scancode == last_scancode)
-            continue;
-
-        last_scancode = scancode;
-
-        char c = scancode_map[scancode];
-        if (c)
-            return c;
-    }
-}
-
 /* ================= String Utilities ================= */
 
 static int strcmp(const char *a, const char *b)
@@ -142,10 +111,94 @@ static void execute_command(int argc, char *argv[])
         return;
     }
 
+    if (!strcmp(argv[0], "meminfo")) {
+        pmm_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "slabinfo")) {
+        slab_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "vminfo")) {
+        vm_print_stats();
+        return;
+    }
+
+    if (!strcmp(argv[0], "uptime")) {
+        uint64_t ms = ktime_get_ns() / NSEC_PER_MSEC;
+        printf("up %llu.%03llu s\n", ms / 1000, ms % 1000);
+        clocksource_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "sleep")) {
+        if (argc < 2) {
+            printf("usage: sleep <ms>\n");
+            return;
+        }
+        uint64_t ms = 0;
+        for (const char *p = argv[1]; *p >= '0' && *p <= '9'; p++)
+            ms = ms * 10 + (*p - '0');
+        sleep_ns(ms * NSEC_PER_MSEC);
+        return;
+    }
+
+    if (!strcmp(argv[0], "sched")) {
+        sched_print_info();
+        clockevent_print_info();
+        fpu_print_info();
+        timer_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "irqs")) {
+        ioapic_print_info();
+        keyboard_print_info();
+        irq_print_info();
+        softirq_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "cpus")) {
+        smp_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "stacks")) {
+        stack_print_info();
+        return;
+    }
+
+    if (!strcmp(argv[0], "topology")) {
+        acpi_print_topology();
+        pmm_print_nodes();
+        return;
+    }
+
+    if (!strcmp(argv[0], "bench")) {
+        if (argc < 2)
+            printf("usage: bench <name>, one of:\n");
+        bench_run(argc < 2 ? NULL : argv[1]);
+        return;
+    }
+
     if (!strcmp(argv[0], "help")) {
         printf("Commands:\n");
         printf("  ls [dir]\n");
         printf("  cat <file>\n");
+        printf("  meminfo\n");
+        printf("  slabinfo\n");
+        printf("  vminfo\n");
+        printf("  uptime\n");
+        printf("  sleep <ms>\n");
+        printf("  sched\n");
+        printf("  irqs\n");
+        printf("  cpus\n");
+        printf("  stacks\n");
+        printf("  topology\n");
+        printf("  bench [name]\n");
         printf("  help\n");
         printf("  exit\n");
         return;
@@ -153,7 +206,7 @@ static void execute_command(int argc, char *argv[])
 
     if (!strcmp(argv[0], "exit")) {
         printf("Shell exited.\n");
-        while (1);
+        task_exit();
     }
 
     printf("Unknown command: %s\n", argv[0]);
@@ -201,59 +254,6 @@ static void find_iso_module(uint32_t mb_addr, uint32_t *mod_start, uint32_t *mod
 }
 
 
-static inline void *page_align(void *base)
-{
-	return (void *) (((uint64_t) base + 4095) & (~4095ULL));
-}
-
-static inline void write_cr3(uint64_t cr3_value)
-{
-	asm volatile ("mov %0, %%cr3"
-	:
-	: "r" (cr3_value)
-	: "memory");
-}
-
-static uint64_t build_identity_4g_tables(void **freemem)
-{
-	const uint64_t total_pte   = 1024ULL * 1024ULL;  
-	const uint64_t num_pt_pg   = 2048ULL;            
-	const uint64_t num_pd_pg   = 4ULL;               
-	const uint64_t pages_total = num_pt_pg + num_pd_pg + 1 + 1;
-
-	uintptr_t base = (uintptr_t) page_align(*freemem);
-
-	uint64_t *pt_all   = (uint64_t *) base;                                         
-	uint64_t *pd_all   = (uint64_t *) (base + num_pt_pg * PG_BYTES);                
-	uint64_t *pdp_page = (uint64_t *) (base + (num_pt_pg + num_pd_pg) * PG_BYTES);  
-	uint64_t *pml4     = (uint64_t *) (base + (num_pt_pg + num_pd_pg + 1) * PG_BYTES);
-
-	const uint64_t qwords = (pages_total * PG_BYTES) / sizeof(uint64_t);
-	for (uint64_t i = 0; i < qwords; ++i)
-		((uint64_t *) base)[i] = 0;
-
-	
-	for (uint64_t i = 0; i < total_pte; ++i) {
-		uint64_t page_byte_address = i * PG_BYTES;      
-		pt_all[i] = page_byte_address | PT_RW_PRESENT;
-	}
-	
-	for (uint64_t j = 0; j < num_pt_pg; ++j) {
-		uint64_t pt_phys = (uint64_t)(uintptr_t)(pt_all + j * PT_ENTRIES);
-		pd_all[j] = pt_phys | PT_RW_PRESENT;
-	}
-
-	for (uint64_t k = 0; k < 4; ++k) {
-		uint64_t pd_phys = (uint64_t)(uintptr_t)(pd_all + k * PT_ENTRIES);
-		pdp_page[k] = pd_phys | PT_RW_PRESENT;
-	}
-
-	pml4[0] = ((uint64_t)(uintptr_t)pdp_page) | PT_RW_PRESENT;
-
-	*freemem = (void *)(base + pages_total * PG_BYTES);
-	return (uint64_t)(uintptr_t)pml4;
-}
-
 struct idt_gate {
     unsigned long off_lo:16;   
     unsigned long sel:16;      
@@ -271,7 +271,9 @@ struct idt_gate {
 static struct idt_gate idt[256] __attribute__((aligned(16)));
 static idt_pointer_t idtp;   
 
-extern void default_trap(void);  
+extern char irq_stubs[];
+extern void run_on_stack(void *stack_top, void (*fn)(void));
+extern void sched_trap(void);
 
 
 static void idt_set_gate(int vec, void *fn, int ist)
@@ -290,86 +292,77 @@ static void idt_set_gate(int vec, void *fn, int ist)
     g->_r1 = g->_r2 = g->_r3 = 0;
 }
 
-extern void timer_apic(void);     
-static volatile uint64_t tick_counter = 0ULL;
-
-typedef struct task_frame {
-    uint64_t rax;
-    uint64_t rdx;
-    uint64_t rbx;
-    uint64_t rcx;
-    uint64_t rsi;
-    uint64_t rdi;
-    uint64_t r8;
-    uint64_t r9;
-    uint64_t r10;
-    uint64_t r11;
-    uint64_t r12;
-    uint64_t r13;
-    uint64_t r14;
-    uint64_t r15;
-    uint64_t rbp;
-    uint64_t rip;
-    uint64_t rflags;
-    uint64_t rsp;
-} task_frame_t;
-
-volatile task_frame_t *curr_task = NULL;
-
-static task_frame_t *g_tasks[2] = { NULL, NULL };
-static unsigned      g_curr_idx  = 0;
-
-static inline void *alloc_page(void **freep) {
-    uintptr_t p = ((uintptr_t)(*freep) + 4095ULL) & ~4095ULL;
-    *freep = (void *)(p + 4096ULL);
-    return (void *)p;
-}
-
-static inline void setup_timer_gate(void)
-{
-    idt_set_gate(APIC_TIMER_VECTOR, timer_apic, 0);
-}
+static void page_fault_handler(struct irq_frame *f);
+static void double_fault_handler(struct irq_frame *f);
+static void timer_apic_handler(struct irq_frame *f);
 
+/* Every vector through its stub in irq_stubs, dispatched by irq.c */
 static void idt_init(void)
 {
-    for(int i = 0; i < 256; ++i) {
-        idt_set_gate(i, default_trap, 0);
-	}
-	setup_timer_gate();
+	for (int i = 0; i < 256; ++i)
+		idt_set_gate(i, irq_stubs + i * IRQ_STUB_SIZE, 0);
+	idt_set_gate(SCHED_VECTOR, sched_trap, 0);
+	irq_register(8, "#DF", double_fault_handler);
+	irq_register(14, "#PF", page_fault_handler);
+	irq_register(APIC_TIMER_VECTOR, "timer", timer_apic_handler);
 
     idtp.limit = (unsigned short)(sizeof(idt) - 1);
     idtp.base  = (unsigned long long)(uintptr_t)idt;
     load_idt(&idtp);
 }
 
-void default_trap_c(void)
+/* The IST stacks need the TSS from stack_cpu_init(); the IDT is shared */
+static void idt_ist_init(void)
 {
-    printf("\nError occurred. Halted.\n");
-    for (;;) { __asm__ __volatile__("cli; hlt"); }
+	for (int i = 0; i < 256; ++i) {
+		if (irq_vector_ist(i) && i != SCHED_VECTOR)
+			idt_set_gate(i, irq_stubs + i * IRQ_STUB_SIZE, irq_vector_ist(i));
+	}
 }
 
-void apic_timer(void)
+void idt_cpu_init(void)
 {
-    tick_counter++;
-    if ((tick_counter & 0x1FULL) == 0ULL) {
-        printf("Timer!\n");
-    }
-    x86_lapic_write(X86_LAPIC_EOI, 0);
+    load_idt(&idtp);
 }
 
-void timer_apic_handler(void)
+static void page_fault_handler(struct irq_frame *f)
 {
-    if (curr_task == NULL) {
-        x86_lapic_write(X86_LAPIC_EOI, 0);
-        return;
-    }
+    uint64_t addr = read_cr2();
 
-	if (g_curr_idx == 0) g_curr_idx = 1;
-	else g_curr_idx = 0;
+    if (vm_fault(addr, f->error) == 0)
+        return;
+    printf("\nPage fault at %p (rip %p, error %llx). Halted.\n",
+           (void *)addr, (void *)f->rip, (unsigned long long)f->error);
+    for (;;) { __asm__ __volatile__("cli; hlt"); }
+}
 
-	curr_task = g_tasks[g_curr_idx];
+/* Runs on the IST1 stack, so it works even when %rsp hit a guard page */
+static void double_fault_handler(struct irq_frame *f)
+{
+    uint64_t addr = read_cr2();
+    struct kstack *stack = stack_find_guard(addr);
+
+    if (stack)
+        printf("\nKernel stack overflow: %llu KiB stack at %p hit its guard page"
+               " (rip %p). Halted.\n", (uint64_t)stack->size >> 10,
+               (void *)stack->base, (void *)f->rip);
+    else
+        printf("\nDouble fault (rip %p, cr2 %p). Halted.\n",
+               (void *)f->rip, (void *)addr);
+    for (;;) { __asm__ __volatile__("cli; hlt"); }
+}
 
-    x86_lapic_write(X86_LAPIC_EOI, 0);
+static void timer_apic_handler(struct irq_frame *f)
+{
+    clockevent_interrupt();
+    timer_interrupt();
+    /* On top of another handler, switch tasks once that one is done */
+    if (task_current() != NULL) {
+        if (hardirq_nested())
+            hardirq_defer_resched();
+        else
+            sched_tick();
+    }
 }
 
 
@@ -402,16 +395,6 @@ void *find_fb(struct multiboot_info *info)
 	return NULL;
 }
 
-void init_apic_timer(void)
-{
-    x86_lapic_enable();
-    x86_lapic_write(X86_LAPIC_TIMER_DIVIDE, 0x0A);
-	x86_lapic_write(X86_LAPIC_TIMER, (1u << 17) | (uint32_t)(APIC_TIMER_VECTOR));
-	x86_lapic_write(X86_LAPIC_TIMER_INIT, 200000U);
-   printf("APIC timer is set up using vector %u.\n", (unsigned)(APIC_TIMER_VECTOR & 0xFFu));
-
-}
-
 // static void demo_shell()
 // {
 //     printf("\nMiniOS> ls\n");
@@ -431,9 +414,39 @@ void init_apic_timer(void)
 // }
 
 
-void kernel_start(struct multiboot_info *info, void *free_mem_base)
+void kernel_start(struct multiboot_info *info)
 {
-	fb_init(find_fb(info), 800, 600);
+	void *fb = find_fb(info);
+
+	smp_boot_cpu_init();
+	fb_init(fb, 800, 600);
+	string_init();
+
+	idt_init();
+	acpi_init((uintptr_t)info);
+	pmm_init((uintptr_t)info);
+	pmm_cpu_init();
+	slab_init();
+	uint64_t pml4_phys = vm_identity_init();
+	write_cr3(pml4_phys);
+	vm_cpu_init();
+	vm_set_cache((uintptr_t)fb, 800 * 600 * 4, VM_CACHE_WC);
+
+	printf("Paging on. PML4 is at address %llu.\n", (unsigned long long)pml4_phys);
+	clocksource_init();
+	vm_print_stats();
+	vmalloc_init();
+	stack_init();
+	stack_cpu_init();
+	idt_ist_init();
+	fpu_init();
+	sched_init();
+	clockevent_init();
+	ioapic_init();		/* sets its page UC, like the LAPIC's, before the APs run */
+	smp_init();
+	softirq_init();
+	jobs_init();
+	keyboard_init();
 
     uint32_t iso_start = 0;
     uint32_t iso_size  = 0;
@@ -445,16 +458,12 @@ void kernel_start(struct multiboot_info *info, void *free_mem_base)
 
     // iso9660_read_file("HELLO.TXT");
     // demo_shell();
-    shell_loop();
-
-
-	idt_init();
-    void *freemem = free_mem_base;               
-	uint64_t pml4_phys = build_identity_4g_tables(&freemem);
-	write_cr3(pml4_phys);
-
-	printf("Paging on. PML4 is at address %llu.\n", (unsigned long long)pml4_phys);
 
+    /* Leave the 4 KiB boot stack for a pooled one with a guard page */
+    struct kstack *shell_stack = stack_alloc(STACK_DEFAULT_SIZE);
+    if (shell_stack)
+        run_on_stack(stack_top(shell_stack), shell_loop);
+    shell_loop();
 
-	while (1) {} /* Never return! */
+	task_exit(); /* Never return! */
 }
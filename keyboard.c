@@ -0,0 +1,133 @@
+/*
+ * keyboard.c - interrupt-driven PS/2 keyboard (CSE 597)
+ *
+ * IRQ 1 comes in through the IOAPIC. The handler reads the scancode
+ * and pushes it into an SPSC ring, together with the TSC at the
+ * interrupt; it is the only producer and the shell the only consumer.
+ * Keys typed while the shell is busy wait in the ring instead of being
+ * overwritten in the controller, and the shell sleeps on a wait queue
+ * while the ring is empty. A key that finds the ring full is dropped
+ * and counted. The latency is from the interrupt to keyboard_getchar()
+ * returning the character.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <ring.h>
+#include <apic.h>
+#include <printf.h>
+#include <wait.h>
+#include <clocksource.h>
+#include <irq.h>
+#include <ioapic.h>
+#include <keyboard.h>
+
+#define KBD_DATA			0x60
+#define KBD_STATUS			0x64
+#define KBD_STATUS_OBF		0x01		/* a byte waits in KBD_DATA */
+
+#define KBD_RING_SIZE		256
+#define KBD_EXTENDED		0xE0		/* prefix of the keys we ignore */
+#define KBD_RELEASE			0x80
+
+/* Minimal US QWERTY scancode map */
+static const char scancode_map[128] = {
+	0,  27, '1','2','3','4','5','6','7','8','9','0','-','=', '\b',
+	'\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
+	0,  'a','s','d','f','g','h','j','k','l',';','\'','`',
+	0, '\\','z','x','c','v','b','n','m',',','.','/',
+	0, '*',0, ' '
+};
+
+/* Entries are (TSC << 8) | scancode, never NULL */
+static void *kbd_slots[KBD_RING_SIZE];
+static struct spsc_ring kbd_ring;
+static struct wait_queue kbd_wq = WAIT_QUEUE_INIT;
+static int kbd_gsi = -1;
+
+static uint64_t kbd_received;
+static uint64_t kbd_dropped;
+static uint64_t kbd_keys;			/* returned to the shell */
+static uint64_t kbd_latency;		/* cycles, over kbd_keys */
+static uint64_t kbd_latency_max;
+
+static void keyboard_irq_handler(struct irq_frame *f)
+{
+	int queued = 0;
+
+	hardirq_nest();
+	while (inb(KBD_STATUS) & KBD_STATUS_OBF) {
+		uint8_t code = inb(KBD_DATA);
+
+		if (spsc_push(&kbd_ring, (void *) (uintptr_t) ((rdtsc() << 8) | code))) {
+			kbd_received++;
+			queued = 1;
+		} else {
+			kbd_dropped++;
+		}
+	}
+	if (queued)
+		wake_up_one(&kbd_wq);
+	hardirq_unnest();
+}
+
+void keyboard_init(void)
+{
+	uint64_t irq;
+
+	spsc_init(&kbd_ring, kbd_slots, KBD_RING_SIZE);
+	irq_register(KEYBOARD_VECTOR, "keyboard", keyboard_irq_handler);
+	irq = irq_save();
+	kbd_gsi = ioapic_route(KEYBOARD_IRQ, KEYBOARD_VECTOR, smp_cpu_id());
+	/* An edge was lost if a byte is already waiting; take it out */
+	while (inb(KBD_STATUS) & KBD_STATUS_OBF)
+		inb(KBD_DATA);
+	irq_restore(irq);
+	if (kbd_gsi < 0)
+		printf("keyboard: IRQ %u cannot be routed, no input\n", KEYBOARD_IRQ);
+}
+
+/* Sleep until a key with a character is pressed */
+char keyboard_getchar(void)
+{
+	static int extended;
+
+	for (;;) {
+		uintptr_t e;
+		uint8_t code;
+		char c;
+
+		wait_event(&kbd_wq, (e = (uintptr_t) spsc_pop(&kbd_ring)) != 0);
+		code = e & 0xFF;
+		if (code == KBD_EXTENDED) {
+			extended = 1;
+			continue;
+		}
+		if (extended || (code & KBD_RELEASE)) {
+			extended = 0;
+			continue;
+		}
+		if (!(c = scancode_map[code]))
+			continue;
+
+		e = rdtsc() - (e >> 8);
+		kbd_keys++;
+		kbd_latency += e;
+		if (e > kbd_latency_max)
+			kbd_latency_max = e;
+		return c;
+	}
+}
+
+void keyboard_print_info(void)
+{
+	printf("Keyboard: IRQ %u, GSI %d, vector %x\n", KEYBOARD_IRQ, kbd_gsi,
+		KEYBOARD_VECTOR);
+	printf("  %llu scancodes, %llu dropped, %llu waiting\n", kbd_received,
+		kbd_dropped, spsc_count(&kbd_ring));
+	if (kbd_keys)
+		printf("  %llu keys, latency to the shell %llu us on average, %llu us worst\n",
+			kbd_keys, cycles_to_ns(kbd_latency / kbd_keys) / NSEC_PER_USEC,
+			cycles_to_ns(kbd_latency_max) / NSEC_PER_USEC);
+}
@@ -0,0 +1,477 @@
+/*
+ * pmm.c - a buddy allocator for physical frames (CSE 597)
+ *
+ * Usable memory comes from the multiboot2 memory map (or the EFI map if
+ * the former is missing). Only the identity-mapped 0-4 GiB range is
+ * managed. Free blocks are kept on per-order doubly-linked lists stored
+ * in the free frames themselves, and a byte per frame records whether
+ * it heads a free or an allocated block of a given order, so both
+ * allocation and freeing take at most PMM_MAX_ORDER steps.
+ *
+ * Each NUMA node from the SRAT has its own free lists; blocks never
+ * straddle or coalesce across nodes. pmm_alloc() serves the calling
+ * CPU's node first and falls back to the others by SLIT distance.
+ */
+
+#include <types.h>
+#include <multiboot2.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <acpi.h>
+#include <vm.h>
+#include <pmm.h>
+#include <string.h>
+
+#define PMM_LOW_LIMIT		0x100000ULL		/* leave real-mode memory alone */
+#define PMM_HIGH_LIMIT		(4ULL << 30)	/* end of the identity map */
+#define PMM_MAX_RESERVED	32
+
+#define FRAME_FREE			0x80U	/* heads a free block of (state & 0x1F) */
+#define FRAME_ALLOC			0x40U	/* heads an allocated block */
+#define FRAME_ORDER(s)		((s) & 0x1FU)
+
+/* EFI memory types that are ours once boot services have exited */
+#define EFI_LOADER_CODE			1
+#define EFI_LOADER_DATA			2
+#define EFI_BOOT_SERVICES_CODE	3
+#define EFI_BOOT_SERVICES_DATA	4
+#define EFI_CONVENTIONAL_MEMORY	7
+
+struct efi_mmap_desc {
+	uint32_t type;
+	uint32_t pad;
+	uint64_t phys_start;
+	uint64_t virt_start;
+	uint64_t num_pages;
+	uint64_t attribute;
+};
+
+struct pmm_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct free_block {
+	struct free_block *next;
+	struct free_block *prev;
+};
+
+extern char __kernel_start[], __kernel_end[];
+
+static struct pmm_range reserved[PMM_MAX_RESERVED];
+static unsigned int num_reserved;
+
+static uint8_t *frame_state;
+static uint64_t max_pfn;
+static uintptr_t boot_info;		/* the multiboot info pmm_init() was given */
+
+struct pmm_node {
+	struct free_block *free_lists[PMM_MAX_ORDER + 1];
+	uint64_t free_blocks[PMM_MAX_ORDER + 1];
+	uint64_t total_frames;
+	uint64_t free_frames;
+	uint64_t local_allocs;		/* served for a CPU of this node */
+	uint64_t remote_allocs;		/* served as another node's fallback */
+	unsigned int fallback[ACPI_MAX_NODES];	/* all nodes, nearest first */
+};
+
+static struct pmm_node nodes[ACPI_MAX_NODES];
+static unsigned int cpu_node[MAX_CPUS];
+static uint32_t cpu_seen;		/* CPUs that ran pmm_cpu_init() */
+static mcs_lock_t pmm_lock;	/* every CPU's slab refills end up here */
+static uint64_t total_frames, free_frames;
+
+typedef void (*region_fn_t) (uint64_t start, uint64_t end);
+
+static inline uint64_t align_up(uint64_t val, uint64_t align)
+{
+	return (val + align - 1) & ~(align - 1);
+}
+
+static inline uint64_t align_down(uint64_t val, uint64_t align)
+{
+	return val & ~(align - 1);
+}
+
+/* Call fn for every usable region in the boot memory map */
+static void for_each_region(uintptr_t mb_addr, region_fn_t fn)
+{
+	struct multiboot_tag *tag = (struct multiboot_tag *) (mb_addr + 8);
+	struct multiboot_tag_efi_mmap *efi = NULL;
+
+	while (tag->type != MULTIBOOT_TAG_TYPE_END) {
+		if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
+			struct multiboot_tag_mmap *mmap = (struct multiboot_tag_mmap *) tag;
+			uint8_t *cur = (uint8_t *) mmap->entries;
+			uint8_t *end = (uint8_t *) tag + tag->size;
+
+			for (; cur < end; cur += mmap->entry_size) {
+				multiboot_memory_map_t *e = (multiboot_memory_map_t *) cur;
+				if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+					fn(e->addr, e->addr + e->len);
+			}
+			return;
+		}
+		if (tag->type == MULTIBOOT_TAG_TYPE_EFI_MMAP)
+			efi = (struct multiboot_tag_efi_mmap *) tag;
+		tag = (struct multiboot_tag *) (((uintptr_t) tag + tag->size + 7) & ~7ULL);
+	}
+
+	if (efi) {
+		uint8_t *cur = efi->efi_mmap;
+		uint8_t *end = (uint8_t *) efi + efi->size;
+
+		for (; cur < end; cur += efi->descr_size) {
+			struct efi_mmap_desc *d = (struct efi_mmap_desc *) cur;
+			switch (d->type) {
+			case EFI_LOADER_CODE:
+			case EFI_LOADER_DATA:
+			case EFI_BOOT_SERVICES_CODE:
+			case EFI_BOOT_SERVICES_DATA:
+			case EFI_CONVENTIONAL_MEMORY:
+				fn(d->phys_start, d->phys_start + d->num_pages * PAGE_SIZE);
+				break;
+			}
+		}
+	}
+}
+
+static void reserve(uint64_t start, uint64_t end)
+{
+	if (num_reserved == PMM_MAX_RESERVED) {
+		printf("pmm: too many reserved ranges\n");
+		return;
+	}
+	reserved[num_reserved].start = align_down(start, PAGE_SIZE);
+	reserved[num_reserved].end = align_up(end, PAGE_SIZE);
+	num_reserved++;
+}
+
+static void reserve_boot_info(uintptr_t mb_addr)
+{
+	struct multiboot_tag *tag = (struct multiboot_tag *) (mb_addr + 8);
+
+	reserve((uintptr_t) __kernel_start, (uintptr_t) __kernel_end);
+	reserve(mb_addr, mb_addr + *(uint32_t *) mb_addr);
+
+	while (tag->type != MULTIBOOT_TAG_TYPE_END) {
+		if (tag->type == MULTIBOOT_TAG_TYPE_MODULE) {
+			struct multiboot_tag_module *m = (struct multiboot_tag_module *) tag;
+			reserve(m->mod_start, m->mod_end);
+		}
+		tag = (struct multiboot_tag *) (((uintptr_t) tag + tag->size + 7) & ~7ULL);
+	}
+}
+
+static void find_max_pfn(uint64_t start, uint64_t end)
+{
+	if (end > PMM_HIGH_LIMIT)
+		end = PMM_HIGH_LIMIT;
+	if (start < end && end / PAGE_SIZE > max_pfn)
+		max_pfn = end / PAGE_SIZE;
+}
+
+/* First usable, unreserved spot large enough for the frame state array */
+static void place_frame_state(uint64_t start, uint64_t end)
+{
+	uint64_t size = align_up(max_pfn, PAGE_SIZE);
+	unsigned int i;
+
+	if (frame_state)
+		return;
+	start = align_up(start < PMM_LOW_LIMIT ? PMM_LOW_LIMIT : start, PAGE_SIZE);
+	end = align_down(end > PMM_HIGH_LIMIT ? PMM_HIGH_LIMIT : end, PAGE_SIZE);
+
+	for (i = 0; i < num_reserved && start + size <= end; i++) {
+		if (start < reserved[i].end && reserved[i].start < start + size) {
+			start = reserved[i].end;
+			i = -1U;	/* recheck all ranges from the new start */
+		}
+	}
+	if (start + size <= end)
+		frame_state = (uint8_t *) (uintptr_t) start;
+}
+
+static inline uint64_t block_pfn(struct free_block *b)
+{
+	return (uintptr_t) b / PAGE_SIZE;
+}
+
+static inline struct free_block *pfn_block(uint64_t pfn)
+{
+	return (struct free_block *) (uintptr_t) (pfn * PAGE_SIZE);
+}
+
+static inline unsigned int pfn_node(uint64_t pfn)
+{
+	return acpi_addr_node(pfn * PAGE_SIZE);
+}
+
+static void list_add(struct pmm_node *n, unsigned int order, uint64_t pfn)
+{
+	struct free_block *b = pfn_block(pfn);
+
+	b->prev = NULL;
+	b->next = n->free_lists[order];
+	if (b->next)
+		b->next->prev = b;
+	n->free_lists[order] = b;
+	n->free_blocks[order]++;
+	frame_state[pfn] = FRAME_FREE | order;
+}
+
+static void list_del(struct pmm_node *n, unsigned int order, uint64_t pfn)
+{
+	struct free_block *b = pfn_block(pfn);
+
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		n->free_lists[order] = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	n->free_blocks[order]--;
+	frame_state[pfn] = 0;
+}
+
+/*
+ * Return a block to its node's free lists, coalescing with free buddies.
+ * Its own head loses FRAME_ALLOC first: if it merges into a lower buddy,
+ * nothing else would clear it, and a second free would pass the check.
+ */
+static void free_block(unsigned int node, uint64_t pfn, unsigned int order)
+{
+	struct pmm_node *n = &nodes[node];
+
+	frame_state[pfn] = 0;
+	free_frames += 1ULL << order;
+	n->free_frames += 1ULL << order;
+	while (order < PMM_MAX_ORDER) {
+		uint64_t buddy = pfn ^ (1ULL << order);
+		if (buddy + (1ULL << order) > max_pfn
+				|| frame_state[buddy] != (FRAME_FREE | order)
+				|| pfn_node(buddy) != node)
+			break;
+		list_del(n, order, buddy);
+		pfn &= ~(1ULL << order);
+		order++;
+	}
+	list_add(n, order, pfn);
+}
+
+static void add_free_range(uint64_t start, uint64_t end, unsigned int first,
+		unsigned int node)
+{
+	unsigned int i;
+
+	for (i = first; i < num_reserved; i++) {
+		if (start < reserved[i].end && reserved[i].start < end) {
+			if (start < reserved[i].start)
+				add_free_range(start, reserved[i].start, i + 1, node);
+			if (reserved[i].end < end)
+				add_free_range(reserved[i].end, end, i + 1, node);
+			return;
+		}
+	}
+
+	for (uint64_t pfn = start / PAGE_SIZE; pfn < end / PAGE_SIZE; ) {
+		unsigned int order = PMM_MAX_ORDER;
+		while ((pfn & ((1ULL << order) - 1))
+				|| pfn + (1ULL << order) > end / PAGE_SIZE)
+			order--;
+		total_frames += 1ULL << order;
+		nodes[node].total_frames += 1ULL << order;
+		free_block(node, pfn, order);
+		pfn += 1ULL << order;
+	}
+}
+
+static void add_region(uint64_t start, uint64_t end)
+{
+	start = align_up(start < PMM_LOW_LIMIT ? PMM_LOW_LIMIT : start, PAGE_SIZE);
+	end = align_down(end > PMM_HIGH_LIMIT ? PMM_HIGH_LIMIT : end, PAGE_SIZE);
+	if (start >= end)
+		return;
+	if (!acpi.num_mem_ranges) {
+		add_free_range(start, end, 0, 0);
+		return;
+	}
+	/* Split along SRAT memory ranges; memory outside all of them is unused */
+	for (unsigned int i = 0; i < acpi.num_mem_ranges; i++) {
+		uint64_t s = align_up(acpi.mem_ranges[i].start, PAGE_SIZE);
+		uint64_t e = align_down(acpi.mem_ranges[i].end, PAGE_SIZE);
+		if (s < start)
+			s = start;
+		if (e > end)
+			e = end;
+		if (s < e)
+			add_free_range(s, e, 0, acpi.mem_ranges[i].node);
+	}
+}
+
+/* Order every node's fallback list by SLIT distance */
+static void build_fallbacks(void)
+{
+	for (unsigned int n = 0; n < acpi.num_nodes; n++) {
+		unsigned int *fb = nodes[n].fallback;
+
+		for (unsigned int i = 0; i < acpi.num_nodes; i++)
+			fb[i] = i;
+		for (unsigned int i = 0; i < acpi.num_nodes; i++) {
+			unsigned int best = i;
+			for (unsigned int j = i + 1; j < acpi.num_nodes; j++) {
+				if (acpi.distance[n][fb[j]] < acpi.distance[n][fb[best]])
+					best = j;
+			}
+			unsigned int tmp = fb[i];
+			fb[i] = fb[best];
+			fb[best] = tmp;
+		}
+	}
+}
+
+void pmm_init(uintptr_t mb_addr)
+{
+	boot_info = mb_addr;
+	reserve_boot_info(mb_addr);
+	for_each_region(mb_addr, find_max_pfn);
+	for_each_region(mb_addr, place_frame_state);
+	if (!frame_state) {
+		printf("pmm: no room for frame state (%llu frames)\n", max_pfn);
+		return;
+	}
+	memset(frame_state, 0, max_pfn);
+	reserve((uintptr_t) frame_state, (uintptr_t) frame_state + max_pfn);
+
+	for_each_region(mb_addr, add_region);
+	build_fallbacks();
+	printf("pmm: %llu MiB usable, %llu frames free\n",
+		(total_frames * PAGE_SIZE) >> 20, free_frames);
+}
+
+/* Call fn for every usable region of the boot memory map, which stays reserved */
+void pmm_for_each_ram(void (*fn)(uint64_t start, uint64_t end))
+{
+	if (boot_info)
+		for_each_region(boot_info, fn);
+}
+
+/* Record the NUMA node of the calling CPU */
+void pmm_cpu_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	cpu_node[smp_cpu_id()] = acpi_apic_node(ebx >> 24);
+	__atomic_or_fetch(&cpu_seen, 1U << smp_cpu_id(), __ATOMIC_RELAXED);
+}
+
+static void *alloc_from(unsigned int node, unsigned int order)
+{
+	struct pmm_node *n = &nodes[node];
+	unsigned int cur = order;
+	uint64_t pfn;
+
+	while (cur <= PMM_MAX_ORDER && !n->free_lists[cur])
+		cur++;
+	if (cur > PMM_MAX_ORDER)
+		return NULL;
+
+	pfn = block_pfn(n->free_lists[cur]);
+	list_del(n, cur, pfn);
+	while (cur > order) {	/* hand the upper halves back */
+		cur--;
+		list_add(n, cur, pfn + (1ULL << cur));
+	}
+	frame_state[pfn] = FRAME_ALLOC | order;
+	free_frames -= 1ULL << order;
+	n->free_frames -= 1ULL << order;
+	return pfn_block(pfn);
+}
+
+/* Allocate 2^order frames, preferring the given node */
+void *pmm_alloc_node(unsigned int order, unsigned int node)
+{
+	struct mcs_node lock_node;
+	uint64_t irq = mcs_lock_irqsave(&pmm_lock, &lock_node);
+	void *ptr = NULL;
+
+	for (unsigned int i = 0; i < acpi.num_nodes && !ptr; i++) {
+		unsigned int n = nodes[node].fallback[i];
+		if ((ptr = alloc_from(n, order))) {
+			if (n == node)
+				nodes[n].local_allocs++;
+			else
+				nodes[n].remote_allocs++;
+		}
+	}
+	mcs_unlock_irqrestore(&pmm_lock, &lock_node, irq);
+	return ptr;
+}
+
+void *pmm_alloc(unsigned int order)
+{
+	return pmm_alloc_node(order, cpu_node[smp_cpu_id()]);
+}
+
+void pmm_free(void *addr)
+{
+	uint64_t pfn = (uintptr_t) addr / PAGE_SIZE;
+	struct mcs_node lock_node;
+	uint64_t irq;
+	uint8_t state = 0;
+
+	if (!((uintptr_t) addr & (PAGE_SIZE - 1)) && pfn < max_pfn) {
+		/* Under the lock, so that two frees of one block cannot both pass */
+		irq = mcs_lock_irqsave(&pmm_lock, &lock_node);
+		state = frame_state[pfn];
+		if (state & FRAME_ALLOC)
+			free_block(pfn_node(pfn), pfn, FRAME_ORDER(state));
+		mcs_unlock_irqrestore(&pmm_lock, &lock_node, irq);
+	}
+	if (!(state & FRAME_ALLOC))
+		printf("pmm: bad free of %p\n", addr);
+}
+
+void pmm_print_info(void)
+{
+	uint64_t large = 0, blocks;
+	int largest = -1;
+
+	printf("Frames: %llu total, %llu free, %llu used (4 KiB each)\n",
+		total_frames, free_frames, total_frames - free_frames);
+	printf("Free blocks by order:");
+	for (unsigned int i = 0; i <= PMM_MAX_ORDER; i++) {
+		blocks = 0;
+		for (unsigned int n = 0; n < acpi.num_nodes; n++)
+			blocks += nodes[n].free_blocks[i];
+		printf(" %llu", blocks);
+		if (blocks)
+			largest = i;
+		if (i >= PMM_ORDER_2M)
+			large += blocks << i;
+	}
+	printf("\n");
+	if (largest >= 0)
+		printf("Largest free block: %llu KiB\n", (PAGE_SIZE << largest) / 1024);
+	/* Share of free memory that cannot back a 2 MiB frame */
+	if (free_frames)
+		printf("Fragmentation: %llu%%\n",
+			100 - large * 100 / free_frames);
+}
+
+void pmm_print_nodes(void)
+{
+	for (unsigned int n = 0; n < acpi.num_nodes; n++) {
+		printf("Node %u: %llu MiB, %llu frames free, "
+			"%llu local / %llu fallback allocations\n", n,
+			(nodes[n].total_frames * PAGE_SIZE) >> 20, nodes[n].free_frames,
+			nodes[n].local_allocs, nodes[n].remote_allocs);
+	}
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (cpu_seen & (1U << cpu))
+			printf("CPU %u allocates from node %u\n", cpu, cpu_node[cpu]);
+	}
+}
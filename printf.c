@@ -117,6 +117,8 @@
 #include <printf.h>
 #include <string.h>
 #include <fb.h>
+#include <spinlock.h>
+#include <smp.h>
 
 /* display pointers in upper-case hex (A-F) instead of lower-case (a-f) */
 #define	PRINTF_UCP	1
@@ -488,6 +490,14 @@ size_t sprintf(char *buf, const char *fmt, ...)
 	return rv;
 }
 
+/*
+ * Keeps lines from different CPUs from interleaving on the screen. A
+ * CPU that faults in the middle of a printf() still gets its report
+ * out, without the lock it already holds.
+ */
+static spinlock_t console_lock;
+static volatile int console_cpu = -1;
+
 static void vprintf_output(char ch, void * _state)
 {
 	fb_output(ch);
@@ -495,7 +505,41 @@ static void vprintf_output(char ch, void * _state)
 
 size_t vprintf(const char *fmt, va_list args)
 {
-	return do_vprintf(fmt, vprintf_output, NULL, args);
+	uint64_t irq = irq_save();
+	int nested = console_cpu == (int) smp_cpu_id();
+	size_t rv;
+
+	if (!nested) {
+		spin_lock(&console_lock);
+		console_cpu = smp_cpu_id();
+	}
+	rv = do_vprintf(fmt, vprintf_output, NULL, args);
+	if (!nested) {
+		console_cpu = -1;
+		spin_unlock(&console_lock);
+	}
+	irq_restore(irq);
+	return rv;
+}
+
+/*
+ * Keep printf() off the screen while the caller draws on it directly.
+ * A printf() on this CPU in between nests as above; elsewhere it waits.
+ */
+uint64_t console_lock_irqsave(void)
+{
+	uint64_t irq = irq_save();
+
+	spin_lock(&console_lock);
+	console_cpu = smp_cpu_id();
+	return irq;
+}
+
+void console_unlock_irqrestore(uint64_t irq)
+{
+	console_cpu = -1;
+	spin_unlock(&console_lock);
+	irq_restore(irq);
 }
 
 size_t printf(const char *fmt, ...)
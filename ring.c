@@ -0,0 +1,196 @@
+/*
+ * ring.c - lock-free queue benchmark (CSE 597)
+ *
+ * The queues are inline in include/ring.h. Here one task per CPU pushes
+ * or pops a fixed number of messages through each kind, with producers
+ * and consumers on different CPUs, and we report messages per second.
+ * Every message carries a number and the consumers add them up, so a
+ * lost or duplicated message shows up as a wrong sum.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <ring.h>
+#include <printf.h>
+#include <bench.h>
+#include <sched.h>
+
+#define BENCH_MSGS			(1ULL << 20)	/* per run, over all producers */
+#define BENCH_RING_SIZE		1024
+#define BENCH_POOL			256			/* MPSC messages per producer */
+
+struct bench_msg {
+	struct mpsc_node node;		/* must be first */
+	volatile int busy;			/* queued, not popped yet */
+	uint64_t val;
+};
+
+static void *spsc_slots[BENCH_RING_SIZE];
+static struct mpmc_cell mpmc_cells[BENCH_RING_SIZE];
+static struct spsc_ring bench_spsc;
+static struct mpsc_queue bench_mpsc;
+static struct mpmc_ring bench_mpmc;
+static struct bench_msg bench_pool[MAX_CPUS][BENCH_POOL];
+
+static struct {
+	uint64_t sum;
+	uint64_t count;				/* messages to send or receive */
+} __attribute__((aligned(64))) bench_tasks[MAX_CPUS];
+
+static void spsc_producer(void *arg)
+{
+	uint64_t n = bench_tasks[smp_cpu_id()].count;
+
+	for (uint64_t i = 1; i <= n; i++) {
+		while (!spsc_push(&bench_spsc, (void *) (uintptr_t) i))
+			cpu_relax();
+	}
+	bench_task_done();
+}
+
+static void spsc_consumer(void *arg)
+{
+	unsigned int cpu = smp_cpu_id();
+	uint64_t sum = 0;
+	void *p;
+
+	for (uint64_t i = 0; i < bench_tasks[cpu].count; i++) {
+		while (!(p = spsc_pop(&bench_spsc)))
+			cpu_relax();
+		sum += (uintptr_t) p;
+	}
+	bench_tasks[cpu].sum = sum;
+	bench_task_done();
+}
+
+/* Messages come from a small pool, reused once the consumer is done */
+static void mpsc_producer(void *arg)
+{
+	unsigned int cpu = smp_cpu_id();
+	uint64_t n = bench_tasks[cpu].count, irq;
+
+	for (uint64_t i = 1; i <= n; i++) {
+		struct bench_msg *m = &bench_pool[cpu][i % BENCH_POOL];
+
+		while (__atomic_load_n(&m->busy, __ATOMIC_ACQUIRE))
+			cpu_relax();
+		m->busy = 1;
+		m->val = i;
+		irq = irq_save();
+		mpsc_push(&bench_mpsc, &m->node);
+		irq_restore(irq);
+	}
+	bench_task_done();
+}
+
+static void mpsc_consumer(void *arg)
+{
+	unsigned int cpu = smp_cpu_id();
+	uint64_t sum = 0;
+	struct mpsc_node *n;
+
+	for (uint64_t i = 0; i < bench_tasks[cpu].count; i++) {
+		struct bench_msg *m;
+
+		while (!(n = mpsc_pop(&bench_mpsc)))
+			cpu_relax();
+		m = (struct bench_msg *) n;
+		sum += m->val;
+		__atomic_store_n(&m->busy, 0, __ATOMIC_RELEASE);
+	}
+	bench_tasks[cpu].sum = sum;
+	bench_task_done();
+}
+
+static void mpmc_producer(void *arg)
+{
+	uint64_t n = bench_tasks[smp_cpu_id()].count;
+
+	for (uint64_t i = 1; i <= n; i++) {
+		while (!mpmc_push(&bench_mpmc, (void *) (uintptr_t) i))
+			cpu_relax();
+	}
+	bench_task_done();
+}
+
+static void mpmc_consumer(void *arg)
+{
+	unsigned int cpu = smp_cpu_id();
+	uint64_t sum = 0;
+	void *p;
+
+	for (uint64_t i = 0; i < bench_tasks[cpu].count; i++) {
+		while (!(p = mpmc_pop(&bench_mpmc)))
+			cpu_relax();
+		sum += (uintptr_t) p;
+	}
+	bench_tasks[cpu].sum = sum;
+	bench_task_done();
+}
+
+/*
+ * Producers on CPUs [0, nprod), consumers on [nprod, nprod + ncons).
+ * The messages are split evenly, and each producer numbers its own
+ * from 1, which tells what the consumers' sums have to add up to.
+ */
+static void bench_queue(const char *what, unsigned int nprod, void (*prod)(void *),
+		unsigned int ncons, void (*cons)(void *))
+{
+	uint64_t per_prod = BENCH_MSGS / nprod, total = per_prod * nprod;
+	uint64_t start, cycles, sum = 0, irq;
+	char buf[48];
+
+	for (unsigned int i = 0; i < nprod; i++)
+		bench_tasks[i].count = per_prod;
+	for (unsigned int i = 0; i < ncons; i++) {
+		bench_tasks[nprod + i].count = total / ncons + (i < total % ncons);
+		bench_tasks[nprod + i].sum = 0;
+	}
+
+	irq = irq_save();
+	start = bench_now();
+	for (unsigned int cpu = 0; cpu < nprod + ncons; cpu++) {
+		if (bench_task_start(cpu, "ring-bench", cpu < nprod ? prod : cons,
+				NULL) != 0) {
+			irq_restore(irq);
+			return;		/* the others wait for it forever */
+		}
+	}
+	irq_restore(irq);
+	cycles = bench_tasks_wait(start);
+
+	for (unsigned int i = 0; i < ncons; i++)
+		sum += bench_tasks[nprod + i].sum;
+	snprintf(buf, sizeof(buf), "%s, %u to %u CPUs, messages", what, nprod, ncons);
+	bench_report(buf, total, cycles);
+	if (sum != nprod * (per_prod * (per_prod + 1) / 2))
+		printf("    wrong sum: %llu, expected %llu\n", sum,
+			nprod * (per_prod * (per_prod + 1) / 2));
+}
+
+void ring_bench(void)
+{
+	unsigned int n = smp_num_cpus;
+
+	if (n < 2) {
+		printf("ring_bench: needs two CPUs\n");
+		return;
+	}
+	spsc_init(&bench_spsc, spsc_slots, BENCH_RING_SIZE);
+	bench_queue("SPSC", 1, spsc_producer, 1, spsc_consumer);
+
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		for (unsigned int i = 0; i < BENCH_POOL; i++)
+			bench_pool[cpu][i].busy = 0;
+	}
+	mpsc_init(&bench_mpsc);
+	bench_queue("MPSC", n - 1, mpsc_producer, 1, mpsc_consumer);
+
+	mpmc_init(&bench_mpmc, mpmc_cells, BENCH_RING_SIZE);
+	bench_queue("MPMC", 1, mpmc_producer, 1, mpmc_consumer);
+	if (n >= 4) {
+		mpmc_init(&bench_mpmc, mpmc_cells, BENCH_RING_SIZE);
+		bench_queue("MPMC", n / 2, mpmc_producer, n - n / 2, mpmc_consumer);
+	}
+}
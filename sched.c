@@ -0,0 +1,715 @@
+/*
+ * sched.c - priority run queues (CSE 597)
+ *
+ * Each CPU has a FIFO list per priority and a bitmap of the non-empty
+ * lists, so picking the next task is a find-first-set regardless of
+ * how many tasks exist. Tasks run round-robin within a priority; when
+ * a time slice ends the running task moves to the tail of its list.
+ * The timer is only armed while another task of the same or higher
+ * priority is waiting, so a task that has the CPU to itself is not
+ * interrupted. When no task is runnable, the CPU's idle task runs; it
+ * is never queued. It sleeps in MWAIT on the line holding the run
+ * queue bitmap if the CPU has it, so queueing a task there wakes it
+ * without an IPI, and in HLT otherwise. schedule() keeps track of how
+ * long each CPU was idle.
+ *
+ * Blocked tasks use no CPU at all; each CPU counts the cycles its tasks
+ * spent blocked, which a spinning wait would have burnt instead.
+ *
+ * A task stays on the CPU it was created for. Other CPUs may queue
+ * tasks on a run queue (task_create_on(), task_wake()), so each one
+ * has a lock, and they send an IPI if the new task should preempt.
+ *
+ * Preemption happens on the way out of the timer interrupt: when this
+ * picked a new curr_task, irq_entry (kernel_asm.S) saves the interrupted
+ * registers into the old one and restores from the new one. A task that gives
+ * up the CPU itself goes through sched_yield() and switch_to() instead,
+ * which only save what a function call has to preserve. Either kind of
+ * saved task can be resumed by either path. Everything below runs with
+ * interrupts disabled.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <vm.h>
+#include <slab.h>
+#include <stack.h>
+#include <fpu.h>
+#include <sched.h>
+#include <clocksource.h>
+#include <clockevent.h>
+
+#define RFLAGS_IF			(1ULL << 9)
+#define RFLAGS_DEFAULT		(RFLAGS_IF | 0x2ULL)
+
+#define TASK_STACK_SIZE		(8ULL << 10)
+#define SCHED_SLICE_NS		(4 * NSEC_PER_MSEC)
+
+struct runqueue {
+	spinlock_t lock;
+	uint32_t bitmap;			/* bit p set: heads[p] is non-empty */
+	struct task *heads[SCHED_PRIOS];
+	struct task *tails[SCHED_PRIOS];
+	struct task *curr;
+	struct task *idle;
+	struct task *zombies;		/* exited here, only this CPU reaps them */
+	uint64_t nr_runnable;
+	uint64_t switches;
+	uint64_t exited;			/* tasks that ran to completion here */
+	uint64_t wakeups;			/* of blocked tasks */
+	uint64_t reclaimed;			/* cycles they spent blocked, not spinning */
+	uint64_t slice_end;			/* TSC deadline of the current slice, or 0 */
+	int polling;				/* idle in MWAIT on bitmap, no IPI needed */
+	uint64_t ipis_saved;		/* because of that */
+	uint64_t sleeps;			/* HLT or MWAIT executed */
+	uint64_t idle_cycles;		/* in the idle task, up to idle_since */
+	uint64_t idle_since;		/* TSC when the idle task last ran */
+	uint64_t online_since;		/* TSC when this CPU started scheduling */
+} __attribute__((aligned(64)));
+
+/* kernel_asm.S */
+extern void task_init(void *tcb, void *entry, void *stack_top);
+extern void switch_to(task_frame_t *prev, task_frame_t *next);
+
+static struct runqueue runqueues[MAX_CPUS];
+static struct kmem_cache *task_cache;
+static unsigned int next_id;
+static uint64_t nr_tasks;
+static uint64_t slice_cycles;
+static int idle_mwait;			/* MONITOR/MWAIT is there, and we use it */
+
+static inline struct runqueue *this_rq(void)
+{
+	return &runqueues[smp_cpu_id()];
+}
+
+static void rq_enqueue(struct runqueue *rq, struct task *t)
+{
+	t->next = NULL;
+	t->state = TASK_RUNNABLE;
+	if (rq->tails[t->prio])
+		rq->tails[t->prio]->next = t;
+	else
+		rq->heads[t->prio] = t;
+	rq->tails[t->prio] = t;
+	rq->bitmap |= 1U << t->prio;
+	rq->nr_runnable++;
+}
+
+/* Dequeue the first task of the highest non-empty priority, or idle */
+static struct task *rq_pick(struct runqueue *rq)
+{
+	struct task *t;
+	unsigned int prio;
+
+	if (!rq->bitmap)
+		return rq->idle;
+	prio = __builtin_ctz(rq->bitmap);
+	t = rq->heads[prio];
+	if (!(rq->heads[prio] = t->next)) {
+		rq->tails[prio] = NULL;
+		rq->bitmap &= ~(1U << prio);
+	}
+	rq->nr_runnable--;
+	return t;
+}
+
+/* Requeue the current task if it can still run, then switch to the next */
+static void schedule(void)
+{
+	struct runqueue *rq = this_rq();
+	struct task *prev = rq->curr, *next;
+
+	spin_lock(&rq->lock);
+	if (prev->state == TASK_RUNNING && prev != rq->idle)
+		rq_enqueue(rq, prev);
+	next = rq_pick(rq);
+	next->state = TASK_RUNNING;
+	rq->curr = next;
+
+	/* Only slice the CPU if someone at our priority or above is waiting */
+	if (next != rq->idle && (rq->bitmap & ((2U << next->prio) - 1)))
+		rq->slice_end = rdtsc() + slice_cycles;
+	else
+		rq->slice_end = 0;
+	spin_unlock(&rq->lock);
+
+	fpu_switch(next->fpu);
+	if (next != prev) {
+		rq->switches++;
+		if (prev == rq->idle)
+			rq->idle_cycles += rdtsc() - rq->idle_since;
+		else if (next == rq->idle)
+			rq->idle_since = rdtsc();
+		if (next->frame.space != prev->frame.space)
+			vm_space_switch(next->frame.space);
+	}
+	this_cpu()->curr_task = &next->frame;
+	clockevent_set(rq->slice_end);
+}
+
+/*
+ * A task of priority prio was made runnable on this CPU: preempt a
+ * lower-priority one right away, or start slicing if it has to share
+ * the CPU with the running task. The idle task notices new work by
+ * itself. Called with rq->lock held.
+ */
+static void rq_kick(struct runqueue *rq, unsigned int prio)
+{
+	struct task *curr = rq->curr;
+
+	if (curr == rq->idle)
+		return;
+	if (prio < curr->prio) {
+		rq->slice_end = rdtsc();
+		clockevent_set(rq->slice_end);
+	} else if (prio == curr->prio && !rq->slice_end) {
+		rq->slice_end = rdtsc() + slice_cycles;
+		clockevent_set(rq->slice_end);
+	}
+}
+
+/*
+ * Queue t on rq (locked) and make sure its CPU notices. Returns 1 if
+ * that is another CPU which has to be sent SMP_RESCHED_VECTOR: it is
+ * idle in HLT, or t may preempt or share with its running task.
+ */
+static int rq_add(struct runqueue *rq, struct task *t)
+{
+	rq_enqueue(rq, t);
+	if (rq == this_rq()) {
+		rq_kick(rq, t->prio);
+		return 0;
+	}
+	if (rq->curr == rq->idle) {
+		if (rq->polling) {
+			rq->ipis_saved++;
+			return 0;
+		}
+		return 1;
+	}
+	return t->prio <= rq->curr->prio;
+}
+
+void sched_tick(void)
+{
+	schedule();
+}
+
+void sched_trap_handler(void)
+{
+	schedule();
+}
+
+/* SMP_RESCHED_VECTOR: another CPU queued a task here */
+void sched_ipi(void)
+{
+	struct runqueue *rq = this_rq();
+
+	spin_lock(&rq->lock);
+	if (rq->bitmap)
+		rq_kick(rq, __builtin_ctz(rq->bitmap));
+	spin_unlock(&rq->lock);
+}
+
+/* Give up the CPU; returns right away if nothing else can run here */
+void sched_yield(void)
+{
+	uint64_t irq = irq_save();
+	struct task *prev = task_current(), *next;
+
+	schedule();
+	next = task_current();
+	if (next != prev)
+		switch_to(&prev->frame, &next->frame);
+	irq_restore(irq);
+}
+
+/* The same through int $SCHED_VECTOR, which saves every register */
+void sched_yield_trap(void)
+{
+	__asm__ __volatile__ ("int %0" : : "i" (SCHED_VECTOR) : "memory");
+}
+
+/* Entered through the frame built by task_create() */
+static void task_trampoline(void)
+{
+	struct task *t = task_current();
+
+	t->entry(t->arg);
+	task_exit();
+}
+
+static struct task *task_alloc(const char *name, unsigned int prio)
+{
+	struct task *t = kmem_cache_alloc(task_cache);
+
+	if (!t)
+		return NULL;
+	t->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+	t->prio = prio < SCHED_PRIOS ? prio : SCHED_PRIOS - 1;
+	t->cpu = smp_cpu_id();
+	t->name = name;
+	t->stack = NULL;
+	t->next = NULL;
+	t->frame.space = NULL;
+	if (!(t->fpu = fpu_alloc())) {
+		kmem_cache_free(task_cache, t);
+		return NULL;
+	}
+	return t;
+}
+
+static void task_free(struct task *t)
+{
+	if (t->stack)
+		stack_free(t->stack);
+	fpu_free(t->fpu);
+	kmem_cache_free(task_cache, t);
+}
+
+/* Create a task on the given CPU's run queue, or ours if it is offline */
+struct task *task_create_on(unsigned int cpu, const char *name,
+		void (*entry)(void *), void *arg, unsigned int prio)
+{
+	struct runqueue *rq;
+	struct task *t;
+	uint64_t *sp;
+	uint64_t irq;
+	int ipi;
+
+	sched_reap();
+	if (!(t = task_alloc(name, prio)))
+		return NULL;
+	if (!(t->stack = stack_alloc(TASK_STACK_SIZE))) {
+		task_free(t);
+		return NULL;
+	}
+	if (cpu < MAX_CPUS && cpu_locals[cpu].online)
+		t->cpu = cpu;
+	t->entry = entry;
+	t->arg = arg;
+
+	/* As if task_trampoline() had been called: %rsp + 8 is 16-byte aligned */
+	sp = (uint64_t *) stack_top(t->stack) - 1;
+	*sp = 0;
+	task_init(&t->frame, task_trampoline, sp);
+	t->frame.rflags = RFLAGS_DEFAULT;
+
+	__atomic_add_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+	rq = &runqueues[t->cpu];
+	irq = spin_lock_irqsave(&rq->lock);
+	ipi = rq_add(rq, t);
+	spin_unlock_irqrestore(&rq->lock, irq);
+	if (ipi)
+		smp_send_ipi(t->cpu, SMP_RESCHED_VECTOR);
+	return t;
+}
+
+struct task *task_create(const char *name, void (*entry)(void *), void *arg,
+		unsigned int prio)
+{
+	return task_create_on(smp_cpu_id(), name, entry, arg, prio);
+}
+
+/* The stack of a dead task is still in use until we switch away from it */
+void task_exit(void)
+{
+	struct task *t = task_current();
+	struct runqueue *rq;
+
+	(void) irq_save();
+	rq = this_rq();
+	t->state = TASK_DEAD;
+	t->next = rq->zombies;
+	rq->zombies = t;
+	rq->exited++;
+	sched_yield();
+	for (;;)
+		;
+}
+
+/* Free the tasks that exited on this CPU; nobody else touches the list */
+void sched_reap(void)
+{
+	struct runqueue *rq = this_rq();
+	struct task *t;
+	uint64_t irq = irq_save();
+
+	while ((t = rq->zombies)) {
+		rq->zombies = t->next;
+		irq_restore(irq);
+		__atomic_sub_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+		task_free(t);
+		irq = irq_save();
+	}
+	irq_restore(irq);
+}
+
+/* Sleep until task_wake(); the caller rechecks its condition afterwards */
+void task_block(void)
+{
+	struct runqueue *rq = this_rq();
+	uint64_t irq = spin_lock_irqsave(&rq->lock);
+	struct task *t = task_current();
+
+	t->state = TASK_BLOCKED;
+	t->blocked_at = rdtsc();
+	spin_unlock(&rq->lock);
+	sched_yield();
+	irq_restore(irq);
+}
+
+/*
+ * Block unless *flag is already clear. The flag is checked after the
+ * task is marked blocked, so a waker that clears it and then calls
+ * task_wake() cannot slip in between and be missed.
+ */
+void task_block_while(volatile int *flag)
+{
+	struct runqueue *rq = this_rq();
+	uint64_t irq = spin_lock_irqsave(&rq->lock);
+	struct task *t = task_current();
+
+	t->state = TASK_BLOCKED;
+	t->blocked_at = rdtsc();
+	if (!*flag)
+		t->state = TASK_RUNNING;
+	spin_unlock(&rq->lock);
+	if (t->state != TASK_RUNNING)
+		sched_yield();
+	irq_restore(irq);
+}
+
+void task_wake(struct task *task)
+{
+	struct runqueue *rq = &runqueues[task->cpu];
+	uint64_t irq = spin_lock_irqsave(&rq->lock);
+	int ipi = 0;
+
+	if (task->state == TASK_BLOCKED) {
+		rq->wakeups++;
+		rq->reclaimed += rdtsc() - task->blocked_at;
+		ipi = rq_add(rq, task);
+	}
+	spin_unlock_irqrestore(&rq->lock, irq);
+	if (ipi)
+		smp_send_ipi(task->cpu, SMP_RESCHED_VECTOR);
+}
+
+/*
+ * Called with interrupts disabled and nothing to run. polling is only
+ * changed and read under the run queue lock, and the bitmap is checked
+ * once more after MONITOR: a CPU that saw polling set and skipped the
+ * IPI has either queued its task before that check or stores to the
+ * monitored line after it, which ends the MWAIT. STI holds interrupts
+ * off for one more instruction, so none can slip in before the MWAIT
+ * (or HLT) either.
+ */
+static void idle_sleep(struct runqueue *rq)
+{
+	if (!idle_mwait) {
+		rq->sleeps++;
+		__asm__ __volatile__ ("sti; hlt" : : : "memory");
+		return;
+	}
+
+	spin_lock(&rq->lock);
+	rq->polling = 1;
+	spin_unlock(&rq->lock);
+	__asm__ __volatile__ ("monitor" : : "a" (&rq->bitmap), "c" (0), "d" (0));
+	if (!rq->bitmap) {
+		rq->sleeps++;
+		/* Hint 0: C1, the state with the quickest way back */
+		__asm__ __volatile__ ("sti; mwait" : : "a" (0), "c" (0) : "memory");
+		__asm__ __volatile__ ("cli" : : : "memory");
+	}
+	spin_lock(&rq->lock);
+	rq->polling = 0;
+	spin_unlock(&rq->lock);
+	__asm__ __volatile__ ("sti" : : : "memory");
+}
+
+/* Sleep until a task is runnable; no tick wakes us up */
+void sched_idle(void)
+{
+	struct runqueue *rq = this_rq();
+
+	for (;;) {
+		sched_reap();
+		__asm__ __volatile__ ("cli" : : : "memory");
+		if (rq->bitmap) {
+			__asm__ __volatile__ ("sti" : : : "memory");
+			sched_yield();
+		} else {
+			idle_sleep(rq);
+		}
+	}
+}
+
+/* Whether the CPU can wait for a store to the run queue */
+static int idle_mwait_supported(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	return !!(ecx & (1U << 3));
+}
+
+static void idle_loop(void *arg)
+{
+	sched_idle();
+}
+
+/*
+ * Turn the running boot context into a task, so that the timer tick
+ * has somewhere to save it, and create this CPU's idle task.
+ */
+void sched_init(void)
+{
+	struct runqueue *rq = this_rq();
+	struct task *boot, *idle;
+
+	task_cache = kmem_cache_create("task", sizeof(struct task), 0);
+	slice_cycles = ns_to_cycles(SCHED_SLICE_NS);
+	idle_mwait = idle_mwait_supported();
+	boot = task_alloc("main", SCHED_PRIO_DEFAULT);
+	idle = task_alloc("idle", SCHED_PRIOS - 1);
+	if (!boot || !idle || !(idle->stack = stack_alloc(TASK_STACK_SIZE))) {
+		printf("sched: cannot create the boot and idle tasks\n");
+		return;
+	}
+	idle->entry = idle_loop;
+	task_init(&idle->frame, task_trampoline,
+		(uint64_t *) stack_top(idle->stack) - 1);
+	idle->frame.rflags = RFLAGS_DEFAULT;
+	idle->state = TASK_RUNNABLE;
+
+	nr_tasks = 2;
+	rq->online_since = rdtsc();
+	rq->idle = idle;
+	rq->curr = boot;
+	boot->state = TASK_RUNNING;
+	this_cpu()->curr_task = &boot->frame;
+	fpu_own(boot->fpu);
+}
+
+/*
+ * An AP has nothing else to run at first, so its boot context becomes
+ * its idle task directly; the caller then enters sched_idle().
+ */
+void sched_ap_init(void)
+{
+	struct runqueue *rq = this_rq();
+	struct task *idle = task_alloc("idle", SCHED_PRIOS - 1);
+
+	if (!idle) {
+		printf("sched: cannot create an idle task for CPU %u\n", smp_cpu_id());
+		return;
+	}
+	idle->state = TASK_RUNNING;
+	__atomic_add_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+	rq->online_since = rdtsc();
+	rq->idle_since = rq->online_since;
+	rq->idle = idle;
+	rq->curr = idle;
+	this_cpu()->curr_task = &idle->frame;
+	fpu_own(idle->fpu);
+}
+
+void sched_print_info(void)
+{
+	uint64_t irq, now, idle, ipis_saved = 0;
+
+	printf("%llu tasks on %u CPUs, idle in %s\n", nr_tasks, smp_num_cpus,
+		idle_mwait ? "MWAIT" : "HLT");
+	printf("cpu  running           prio  runnable  switches  exited"
+		"  wakeups  blocked ms  idle %%    sleeps\n");
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct runqueue *rq = &runqueues[cpu];
+
+		if (!cpu_locals[cpu].online)
+			continue;
+		irq = spin_lock_irqsave(&rq->lock);
+		now = rdtsc();
+		idle = rq->idle_cycles;
+		if (rq->curr == rq->idle)
+			idle += now - rq->idle_since;
+		printf("%3u  %-16s %5u %9llu %9llu %7llu %8llu %11llu %7llu %9llu\n",
+			cpu, rq->curr->name, rq->curr->prio, rq->nr_runnable,
+			rq->switches, rq->exited, rq->wakeups,
+			cycles_to_ns(rq->reclaimed) / NSEC_PER_MSEC,
+			now > rq->online_since ? idle * 100 / (now - rq->online_since) : 0,
+			rq->sleeps);
+		ipis_saved += rq->ipis_saved;
+		spin_unlock_irqrestore(&rq->lock, irq);
+	}
+	if (idle_mwait)
+		printf("%llu wakeups of idle CPUs needed no IPI\n", ipis_saved);
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_SWITCHES		200000ULL
+
+static volatile int64_t bench_left;
+
+static void bench_task(void *arg)
+{
+	while (__atomic_sub_fetch(&bench_left, 1, __ATOMIC_RELAXED) > 0)
+		sched_yield();
+	bench_task_done();
+}
+
+static volatile int64_t pingpong_left;
+
+static void pingpong_task(void *arg)
+{
+	void (*yield)(void) = arg;
+
+	while (__atomic_sub_fetch(&pingpong_left, 1, __ATOMIC_RELAXED) > 0)
+		yield();
+	bench_task_done();
+}
+
+/* Two tasks hand the CPU back and forth through the given yield */
+static void sched_pingpong(const char *what, void (*yield)(void))
+{
+	struct runqueue *rq = this_rq();
+	uint64_t start, cycles, switches, irq;
+
+	irq = irq_save();
+	pingpong_left = BENCH_SWITCHES;
+	for (int i = 0; i < 2; i++) {
+		if (bench_task_start(smp_cpu_id(), "pingpong", pingpong_task,
+				(void *) yield) != 0)
+			break;
+	}
+
+	switches = rq->switches;
+	start = bench_now();
+	sched_yield();
+	cycles = bench_now() - start;
+	switches = rq->switches - switches;
+	irq_restore(irq);
+	bench_tasks_wait(0);
+
+	bench_report(what, switches, cycles);
+}
+
+/*
+ * Yield round-robin among n tasks at a priority above ours, so we only
+ * run again when all of them have exited. The cost per switch should
+ * not depend on n. Then compare switch_to() with int $SCHED_VECTOR.
+ */
+void sched_bench(void)
+{
+	static const unsigned int counts[] = { 2, 10, 100, 1000 };
+	struct runqueue *rq = this_rq();
+	uint64_t start, cycles, switches, irq;
+	char what[32];
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		unsigned int n = counts[c], created = 0;
+
+		/* No tick may start them before we do */
+		irq = irq_save();
+		bench_left = BENCH_SWITCHES;
+		for (; created < n; created++) {
+			if (bench_task_start(smp_cpu_id(), "bench", bench_task, NULL) != 0)
+				break;
+		}
+		if (created < n)
+			printf("sched_bench: only %u of %u tasks created\n", created, n);
+
+		switches = rq->switches;
+		start = bench_now();
+		sched_yield();
+		cycles = bench_now() - start;
+		switches = rq->switches - switches;
+		irq_restore(irq);
+		bench_tasks_wait(0);
+
+		snprintf(what, sizeof(what), "%u tasks, switches", created);
+		bench_report(what, switches, cycles);
+	}
+	sched_pingpong("ping-pong, switch_to", sched_yield);
+	sched_pingpong("ping-pong, int $0x51", sched_yield_trap);
+}
+
+#define BENCH_WAKEUPS		1000ULL
+#define BENCH_SETTLE_NS		(50 * NSEC_PER_USEC)
+
+static volatile int wakee_asleep;
+static volatile int wakee_done;
+static volatile uint64_t wakee_stamp;
+static uint64_t wakee_cycles;
+
+/* Measures from the waker's TSC stamp to running again on its own CPU */
+static void wakee_task(void *arg)
+{
+	for (uint64_t i = 0; i < BENCH_WAKEUPS; i++) {
+		while (wakee_asleep)
+			task_block_while(&wakee_asleep);
+		wakee_cycles += rdtsc() - wakee_stamp;
+		wakee_asleep = 1;
+		wakee_done = 1;
+	}
+}
+
+/* Wake a task on CPU 1 after its CPU has gone back to sleep, each time */
+static void idle_wakeups(const char *what)
+{
+	struct runqueue *rq = &runqueues[1];
+	struct task *t;
+	uint64_t settle = ns_to_cycles(BENCH_SETTLE_NS), until;
+
+	wakee_asleep = 1;
+	wakee_cycles = 0;
+	if (!(t = task_create_on(1, "wakee", wakee_task, NULL, BENCH_PRIO))) {
+		printf("sched_idle_bench: cannot create the task\n");
+		return;
+	}
+	for (uint64_t i = 0; i < BENCH_WAKEUPS; i++) {
+		while (*(volatile enum task_state *) &t->state != TASK_BLOCKED ||
+				*(struct task *volatile *) &rq->curr != rq->idle)
+			cpu_relax();
+		until = rdtsc() + settle;
+		while (rdtsc() < until)
+			cpu_relax();
+
+		wakee_done = 0;
+		wakee_stamp = rdtsc();
+		wakee_asleep = 0;
+		task_wake(t);
+		while (!wakee_done)
+			cpu_relax();
+	}
+	bench_report(what, BENCH_WAKEUPS, wakee_cycles);
+}
+
+/* Wakeup latency of an idle CPU in HLT (IPI) and in MWAIT (a store) */
+void sched_idle_bench(void)
+{
+	int mwait = idle_mwait;
+
+	if (smp_num_cpus < 2 || !cpu_locals[1].online) {
+		printf("sched_idle_bench: needs a second CPU\n");
+		return;
+	}
+	idle_mwait = 0;
+	idle_wakeups("HLT + IPI, wakeups");
+	if (idle_mwait_supported()) {
+		idle_mwait = 1;
+		idle_wakeups("MWAIT, wakeups");
+	} else {
+		printf("  no MONITOR/MWAIT on this CPU\n");
+	}
+	idle_mwait = mwait;
+}
@@ -0,0 +1,473 @@
+/*
+ * slab.c - slab allocator and kmalloc (CSE 597)
+ *
+ * Every cache carves 4 KiB frames into equally sized objects; a slab
+ * header sits at the start of each frame, so the owning slab of an
+ * object is found by masking its address. In front of the slab layer,
+ * each CPU keeps a loaded and a previous magazine of cached objects
+ * (Bonwick & Adams, "Magazines and Vmem"); alloc/free only fall through
+ * to the shared depot and slab lists when both are empty/full. Only
+ * that shared part takes the cache's lock; a magazine is private to its
+ * CPU and needs nothing more than interrupts off.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <vm.h>
+#include <pmm.h>
+#include <slab.h>
+
+#define SLAB_ALIGN			16
+#define SLAB_HDR_SIZE		64
+#define SLAB_MAX_OBJ		((PAGE_SIZE - SLAB_HDR_SIZE) / 2)
+#define MAG_ROUNDS			14
+
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_MAX_SHIFT	10
+#define KMALLOC_CACHES		(KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+struct slab {
+	struct kmem_cache *cache;
+	struct slab *next;			/* on the cache's partial list */
+	struct slab *prev;
+	void *free;					/* free objects, linked through their first word */
+	unsigned int inuse;
+};
+
+struct magazine {
+	struct magazine *next;		/* in the depot */
+	unsigned int rounds;
+	void *objs[MAG_ROUNDS];
+};
+
+/* A line each, or the alloc/free fast path of one CPU bounces another's */
+struct mag_cpu {
+	struct magazine *loaded;
+	struct magazine *previous;
+} __attribute__((aligned(64)));
+
+struct kmem_cache {
+	const char *name;
+	size_t size;
+	unsigned int per_slab;
+	unsigned int flags;
+	struct slab *partial;
+	struct magazine *depot_full;
+	struct magazine *depot_empty;
+	uint64_t slabs;
+	uint64_t objs_inuse;
+	struct kmem_cache *next;
+	spinlock_t lock;			/* slabs and depot */
+	struct mag_cpu cpu[MAX_CPUS];
+};
+
+static struct kmem_cache cache_cache;
+static struct kmem_cache *mag_cache;
+static struct kmem_cache *kmalloc_caches[KMALLOC_CACHES];
+static struct kmem_cache *cache_list;
+
+static const char *kmalloc_names[KMALLOC_CACHES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static inline struct slab *obj_slab(void *obj)
+{
+	return (struct slab *) ((uintptr_t) obj & ~(PAGE_SIZE - 1));
+}
+
+static void partial_add(struct kmem_cache *c, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = c->partial;
+	if (s->next)
+		s->next->prev = s;
+	c->partial = s;
+}
+
+static void partial_del(struct kmem_cache *c, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		c->partial = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+static struct slab *slab_grow(struct kmem_cache *c)
+{
+	struct slab *s = pmm_alloc_page();
+	char *obj;
+
+	if (!s)
+		return NULL;
+	s->cache = c;
+	s->inuse = 0;
+	s->free = NULL;
+	obj = (char *) s + SLAB_HDR_SIZE + (c->per_slab - 1) * c->size;
+	for (unsigned int i = 0; i < c->per_slab; i++, obj -= c->size) {
+		*(void **) obj = s->free;
+		s->free = obj;
+	}
+	partial_add(c, s);
+	c->slabs++;
+	return s;
+}
+
+static void *slab_alloc_obj(struct kmem_cache *c)
+{
+	struct slab *s = c->partial;
+	void *obj;
+
+	if (!s && !(s = slab_grow(c)))
+		return NULL;
+	obj = s->free;
+	s->free = *(void **) obj;
+	s->inuse++;
+	c->objs_inuse++;
+	if (!s->free)
+		partial_del(c, s);
+	return obj;
+}
+
+static void slab_free_obj(struct kmem_cache *c, void *obj)
+{
+	struct slab *s = obj_slab(obj);
+
+	if (!s->free)
+		partial_add(c, s);
+	*(void **) obj = s->free;
+	s->free = obj;
+	s->inuse--;
+	c->objs_inuse--;
+	/* Keep one empty slab around to avoid thrashing the frame allocator */
+	if (s->inuse == 0 && (s->prev || s->next)) {
+		partial_del(c, s);
+		c->slabs--;
+		pmm_free(s);
+	}
+}
+
+static void cache_setup(struct kmem_cache *c, const char *name, size_t size,
+		unsigned int flags)
+{
+	c->name = name;
+	c->size = (size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+	c->per_slab = (PAGE_SIZE - SLAB_HDR_SIZE) / c->size;
+	c->flags = flags;
+	c->partial = NULL;
+	c->depot_full = NULL;
+	c->depot_empty = NULL;
+	c->slabs = 0;
+	c->objs_inuse = 0;
+	spin_lock_init(&c->lock);
+	for (unsigned int i = 0; i < MAX_CPUS; i++) {
+		c->cpu[i].loaded = NULL;
+		c->cpu[i].previous = NULL;
+	}
+	c->next = cache_list;
+	cache_list = c;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		unsigned int flags)
+{
+	struct kmem_cache *c;
+	uint64_t irq;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	if (size > SLAB_MAX_OBJ)
+		return NULL;
+
+	irq = spin_lock_irqsave(&cache_cache.lock);
+	c = slab_alloc_obj(&cache_cache);
+	if (c)
+		cache_setup(c, name, size, flags);
+	spin_unlock_irqrestore(&cache_cache.lock, irq);
+	return c;
+}
+
+/* Swap an empty loaded magazine for a full one from the depot */
+static int mag_reload_full(struct kmem_cache *c, struct mag_cpu *mc)
+{
+	struct magazine *m;
+
+	spin_lock(&c->lock);
+	if (!(m = c->depot_full)) {
+		spin_unlock(&c->lock);
+		return 0;
+	}
+	c->depot_full = m->next;
+	if (mc->previous) {
+		mc->previous->next = c->depot_empty;
+		c->depot_empty = mc->previous;
+	}
+	spin_unlock(&c->lock);
+	mc->previous = mc->loaded;
+	mc->loaded = m;
+	return 1;
+}
+
+/* Swap a full loaded magazine for an empty one, allocating if needed */
+static int mag_reload_empty(struct kmem_cache *c, struct mag_cpu *mc)
+{
+	struct magazine *m;
+
+	spin_lock(&c->lock);
+	if ((m = c->depot_empty)) {
+		c->depot_empty = m->next;
+	} else {
+		spin_lock(&mag_cache->lock);
+		m = slab_alloc_obj(mag_cache);
+		spin_unlock(&mag_cache->lock);
+		if (!m) {
+			spin_unlock(&c->lock);
+			return 0;
+		}
+		m->rounds = 0;
+	}
+	if (mc->previous) {
+		mc->previous->next = c->depot_full;
+		c->depot_full = mc->previous;
+	}
+	spin_unlock(&c->lock);
+	mc->previous = mc->loaded;
+	mc->loaded = m;
+	return 1;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+	uint64_t irq = irq_save();
+	struct mag_cpu *mc = &c->cpu[smp_cpu_id()];
+	struct magazine *tmp;
+	void *obj;
+
+	if (c->flags & KMEM_NO_MAGAZINE)
+		goto slow;
+
+	if (mc->loaded && mc->loaded->rounds) {
+		obj = mc->loaded->objs[--mc->loaded->rounds];
+		irq_restore(irq);
+		return obj;
+	}
+	if (mc->previous && mc->previous->rounds) {
+		tmp = mc->loaded;
+		mc->loaded = mc->previous;
+		mc->previous = tmp;
+		obj = mc->loaded->objs[--mc->loaded->rounds];
+		irq_restore(irq);
+		return obj;
+	}
+	if (mag_reload_full(c, mc)) {
+		obj = mc->loaded->objs[--mc->loaded->rounds];
+		irq_restore(irq);
+		return obj;
+	}
+
+slow:
+	spin_lock(&c->lock);
+	obj = slab_alloc_obj(c);
+	spin_unlock(&c->lock);
+	irq_restore(irq);
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	uint64_t irq = irq_save();
+	struct mag_cpu *mc = &c->cpu[smp_cpu_id()];
+	struct magazine *tmp;
+
+	if (c->flags & KMEM_NO_MAGAZINE)
+		goto slow;
+
+	if (mc->loaded && mc->loaded->rounds < MAG_ROUNDS) {
+		mc->loaded->objs[mc->loaded->rounds++] = obj;
+		irq_restore(irq);
+		return;
+	}
+	if (mc->previous && mc->previous->rounds < MAG_ROUNDS) {
+		tmp = mc->loaded;
+		mc->loaded = mc->previous;
+		mc->previous = tmp;
+		mc->loaded->objs[mc->loaded->rounds++] = obj;
+		irq_restore(irq);
+		return;
+	}
+	if (mag_reload_empty(c, mc)) {
+		mc->loaded->objs[mc->loaded->rounds++] = obj;
+		irq_restore(irq);
+		return;
+	}
+
+slow:
+	spin_lock(&c->lock);
+	slab_free_obj(c, obj);
+	spin_unlock(&c->lock);
+	irq_restore(irq);
+}
+
+static inline unsigned int size_order(size_t size, unsigned int min_shift)
+{
+	unsigned int shift = min_shift;
+
+	while ((1ULL << shift) < size)
+		shift++;
+	return shift;
+}
+
+void *kmalloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+	if (size <= KMALLOC_MAX_SLAB)
+		return kmem_cache_alloc(kmalloc_caches[
+			size_order(size, KMALLOC_MIN_SHIFT) - KMALLOC_MIN_SHIFT]);
+	/* Large requests take whole frames; they are the only page-aligned
+	   pointers kmalloc hands out, which is how kfree tells them apart */
+	return pmm_alloc(size_order(size, 12) - 12);
+}
+
+void kfree(void *ptr)
+{
+	if (!ptr)
+		return;
+	if (((uintptr_t) ptr & (PAGE_SIZE - 1)) == 0) {
+		pmm_free(ptr);
+		return;
+	}
+	kmem_cache_free(obj_slab(ptr)->cache, ptr);
+}
+
+void slab_init(void)
+{
+	cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache),
+		KMEM_NO_MAGAZINE);
+	mag_cache = kmem_cache_create("magazine", sizeof(struct magazine),
+		KMEM_NO_MAGAZINE);
+	for (unsigned int i = 0; i < KMALLOC_CACHES; i++)
+		kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+			1ULL << (i + KMALLOC_MIN_SHIFT), 0);
+}
+
+void slab_print_info(void)
+{
+	struct kmem_cache *c;
+
+	printf("cache            size  objs/slab  slabs  in use\n");
+	for (c = cache_list; c; c = c->next) {
+		printf("%-16s %4llu  %9u  %5llu  %6llu\n", c->name,
+			(uint64_t) c->size, c->per_slab, c->slabs, c->objs_inuse);
+	}
+}
+
+/*
+ * Baseline for the benchmark: a single first-fit list of variable-sized
+ * blocks with a size header, split on allocation and coalesced with the
+ * following block on free.
+ */
+struct ff_block {
+	size_t size;				/* including this header */
+	int free;
+	struct ff_block *next;
+};
+
+static struct ff_block *ff_head;
+
+static void ff_init(void *arena, size_t size)
+{
+	ff_head = arena;
+	ff_head->size = size;
+	ff_head->free = 1;
+	ff_head->next = NULL;
+}
+
+static void *ff_alloc(size_t size)
+{
+	struct ff_block *b;
+
+	size = (size + sizeof(struct ff_block) + SLAB_ALIGN - 1)
+		& ~(size_t) (SLAB_ALIGN - 1);
+	for (b = ff_head; b; b = b->next) {
+		if (!b->free || b->size < size)
+			continue;
+		if (b->size >= size + sizeof(struct ff_block) + SLAB_ALIGN) {
+			struct ff_block *rest = (struct ff_block *) ((char *) b + size);
+			rest->size = b->size - size;
+			rest->free = 1;
+			rest->next = b->next;
+			b->next = rest;
+			b->size = size;
+		}
+		b->free = 0;
+		return b + 1;
+	}
+	return NULL;
+}
+
+static void ff_free(void *ptr)
+{
+	struct ff_block *b = (struct ff_block *) ptr - 1;
+
+	b->free = 1;
+	if (b->next && b->next->free) {
+		b->size += b->next->size;
+		b->next = b->next->next;
+	}
+}
+
+#define BENCH_PAIRS		100000ULL
+#define BENCH_BATCH		64
+
+void slab_bench(void)
+{
+	void *arena = pmm_alloc(6);
+	void *objs[BENCH_BATCH];
+	uint64_t start, i, j;
+
+	if (!arena) {
+		printf("slab bench: out of memory\n");
+		return;
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PAIRS; i++)
+		kfree(kmalloc(64));
+	bench_report("kmalloc/kfree(64) pairs", BENCH_PAIRS, bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PAIRS / BENCH_BATCH; i++) {
+		for (j = 0; j < BENCH_BATCH; j++)
+			objs[j] = kmalloc(16 << (j & 5));
+		for (j = 0; j < BENCH_BATCH; j++)
+			kfree(objs[j]);
+	}
+	bench_report("kmalloc/kfree batched, mixed sizes",
+		BENCH_PAIRS / BENCH_BATCH * BENCH_BATCH, bench_now() - start);
+
+	ff_init(arena, PAGE_SIZE << 6);
+	start = bench_now();
+	for (i = 0; i < BENCH_PAIRS; i++)
+		ff_free(ff_alloc(64));
+	bench_report("first-fit (64) pairs", BENCH_PAIRS, bench_now() - start);
+
+	ff_init(arena, PAGE_SIZE << 6);
+	start = bench_now();
+	for (i = 0; i < BENCH_PAIRS / BENCH_BATCH; i++) {
+		for (j = 0; j < BENCH_BATCH; j++)
+			objs[j] = ff_alloc(16 << (j & 5));
+		for (j = 0; j < BENCH_BATCH; j++)
+			ff_free(objs[j]);
+	}
+	bench_report("first-fit batched, mixed sizes",
+		BENCH_PAIRS / BENCH_BATCH * BENCH_BATCH, bench_now() - start);
+
+	pmm_free(arena);
+}
@@ -0,0 +1,434 @@
+/*
+ * smp.c - application processor bring-up (CSE 597)
+ *
+ * The BSP starts every other CPU listed in the MADT with the usual
+ * INIT-SIPI-SIPI sequence, one at a time. An AP comes up in real mode
+ * in the trampoline (smp_asm.S), which takes it to long mode on the
+ * kernel page tables and a pooled stack. ap_start() then repeats the
+ * per-CPU part of kernel_start(): its own GDT, TSS and IST stack, the
+ * shared IDT, CPU features, the LAPIC timer and an idle task, after
+ * which the CPU runs whatever gets queued on its run queue.
+ *
+ * Each CPU finds its struct cpu_local through the GS base, so
+ * smp_cpu_id() and the current task are one load away.
+ *
+ * Each CPU also has a mailbox of function calls from the others, an
+ * MPSC queue drained by the SMP_CALL_VECTOR handler. Only the caller
+ * that finds the mailbox unkicked sends the IPI, so calls posted while
+ * one is on its way, or while the handler runs, share it.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <msr.h>
+#include <apic.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <kernel.h>
+#include <bench.h>
+#include <acpi.h>
+#include <vm.h>
+#include <pmm.h>
+#include <stack.h>
+#include <string.h>
+#include <sched.h>
+#include <wait.h>
+#include <fpu.h>
+#include <clocksource.h>
+#include <clockevent.h>
+#include <irq.h>
+
+#define SMP_TRAMPOLINE		0x8000		/* TRAMPOLINE_BASE in smp_asm.S */
+#define AP_STACK_SIZE		(16ULL << 10)
+#define AP_INIT_DELAY_US	10000
+#define AP_SIPI_DELAY_US	200
+#define AP_START_TIMEOUT_MS	200ULL
+
+/* At trampoline_args in smp_asm.S */
+struct trampoline_args {
+	uint64_t cr3;
+	uint64_t stack;
+	uint64_t entry;
+	uint64_t cpu;
+};
+
+extern char trampoline_start[], trampoline_end[], trampoline_args[];
+
+_Static_assert(__builtin_offsetof(struct cpu_local, curr_task) == CPU_LOCAL_CURR_TASK,
+	"kernel_asm.S expects curr_task at CPU_LOCAL_CURR_TASK");
+
+struct cpu_local cpu_locals[MAX_CPUS];
+unsigned int smp_num_cpus = 1;
+
+static spinlock_t tlb_lock;
+static volatile unsigned int tlb_pending;
+static volatile int tlb_wbinvd;		/* write back caches before the flush */
+
+static void smp_tlb_handler(struct irq_frame *f);
+static void smp_resched_handler(struct irq_frame *f);
+static void smp_call_handler(struct irq_frame *f);
+
+struct mailbox {
+	struct mpsc_queue queue;
+	volatile int kicked;		/* an IPI is on its way or being handled */
+	uint64_t calls;				/* run by the handler */
+	uint64_t ipis;				/* sent to run them */
+} __attribute__((aligned(64)));
+
+static struct mailbox mailboxes[MAX_CPUS];
+
+static void cpu_local_init(unsigned int cpu)
+{
+	struct cpu_local *c = &cpu_locals[cpu];
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	c->self = c;
+	c->id = cpu;
+	c->apic_id = ebx >> 24;
+	c->curr_task = NULL;
+	mpsc_init(&mailboxes[cpu].queue);
+	wrmsr(MSR_GS_BASE, (uintptr_t) c);
+}
+
+/* Must run before anything calls smp_cpu_id() */
+void smp_boot_cpu_init(void)
+{
+	cpu_local_init(0);
+	cpu_locals[0].online = 1;
+}
+
+static void delay_us(uint64_t us)
+{
+	uint64_t end = ktime_get_ns() + us * NSEC_PER_USEC;
+
+	while (ktime_get_ns() < end)
+		cpu_relax();
+}
+
+/* The first C code on an AP, on the stack smp_start_ap() gave it */
+static void ap_start(unsigned int cpu)
+{
+	cpu_local_init(cpu);
+	idt_cpu_init();
+	vm_cpu_init();
+	string_cpu_init();
+	fpu_cpu_init();
+	pmm_cpu_init();
+	stack_cpu_init();
+	clockevent_cpu_init();
+	sched_ap_init();
+	__atomic_store_n(&cpu_locals[cpu].online, 1, __ATOMIC_RELEASE);
+	sched_idle();
+}
+
+static int smp_start_ap(unsigned int cpu, uint32_t apic_id)
+{
+	struct trampoline_args *args = (struct trampoline_args *) (uintptr_t)
+		(SMP_TRAMPOLINE + (trampoline_args - trampoline_start));
+	struct kstack *stack = stack_alloc(AP_STACK_SIZE);
+	uint64_t deadline;
+
+	if (!stack)
+		return -1;
+	args->cr3 = (uintptr_t) vm_kernel_pml4;
+	args->stack = (uintptr_t) stack_top(stack);
+	args->entry = (uintptr_t) ap_start;
+	args->cpu = cpu;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* A second SIPI is ignored if the first one already got through */
+	x86_lapic_send_ipi(apic_id, X86_LAPIC_ICR_INIT | X86_LAPIC_ICR_ASSERT);
+	delay_us(AP_INIT_DELAY_US);
+	for (int i = 0; i < 2; i++) {
+		x86_lapic_send_ipi(apic_id, X86_LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+		delay_us(AP_SIPI_DELAY_US);
+	}
+
+	deadline = ktime_get_ns() + AP_START_TIMEOUT_MS * NSEC_PER_MSEC;
+	while (!__atomic_load_n(&cpu_locals[cpu].online, __ATOMIC_ACQUIRE)) {
+		if (ktime_get_ns() > deadline) {
+			/*
+			 * Put it back to waiting for a SIPI: running late, it
+			 * would be a CPU nobody counts, on a stack freed here.
+			 */
+			x86_lapic_send_ipi(apic_id, X86_LAPIC_ICR_INIT | X86_LAPIC_ICR_ASSERT);
+			delay_us(AP_INIT_DELAY_US);
+			stack_free(stack);
+			printf("smp: CPU with APIC ID %u did not start\n", apic_id);
+			return -1;
+		}
+		cpu_relax();
+	}
+	return 0;
+}
+
+/* Start the APs; needs the LAPIC, the clocksource and the scheduler */
+void smp_init(void)
+{
+	uint32_t bsp = cpu_locals[0].apic_id;
+
+	irq_register(SMP_TLB_VECTOR, "tlb", smp_tlb_handler);
+	irq_register(SMP_RESCHED_VECTOR, "resched", smp_resched_handler);
+	irq_register(SMP_CALL_VECTOR, "call", smp_call_handler);
+	memcpy((void *) SMP_TRAMPOLINE, trampoline_start,
+		trampoline_end - trampoline_start);
+	for (unsigned int i = 0; i < acpi.num_cpus && smp_num_cpus < MAX_CPUS; i++) {
+		if (acpi.cpus[i].apic_id == bsp)
+			continue;
+		/* Stop at the first CPU that fails; it is parked, not counted */
+		if (smp_start_ap(smp_num_cpus, acpi.cpus[i].apic_id) != 0)
+			break;
+		smp_num_cpus++;
+	}
+	printf("SMP: %u of %u CPUs online\n", smp_num_cpus,
+		acpi.num_cpus ? acpi.num_cpus : 1);
+}
+
+void smp_send_ipi(unsigned int cpu, unsigned int vector)
+{
+	x86_lapic_send_ipi(cpu_locals[cpu].apic_id, X86_LAPIC_ICR_FIXED | vector);
+}
+
+/*
+ * Flush the TLB of every other CPU and wait until all of them have.
+ * Call with interrupts enabled and no locks held: a CPU that waits for
+ * tlb_lock has to keep acknowledging the shootdown in progress. Only
+ * the timer and below are held off, so IPIs still come through, but
+ * nothing switches us out while we hold the lock.
+ */
+static void tlb_shootdown(int wb)
+{
+	unsigned int self = smp_cpu_id();
+	uint64_t cls;
+
+	if (smp_num_cpus == 1)
+		return;
+	cls = irq_class_raise(IRQ_CLASS_TIMER);
+	spin_lock(&tlb_lock);
+	tlb_wbinvd = wb;
+	tlb_pending = smp_num_cpus - 1;
+	for (unsigned int cpu = 0; cpu < smp_num_cpus; cpu++) {
+		if (cpu != self)
+			smp_send_ipi(cpu, SMP_TLB_VECTOR);
+	}
+	while (tlb_pending)
+		cpu_relax();
+	spin_unlock(&tlb_lock);
+	irq_class_restore(cls);
+}
+
+void smp_tlb_shootdown(void)
+{
+	tlb_shootdown(0);
+}
+
+/*
+ * The same, with a wbinvd before each flush: after a memory type
+ * change, no CPU may keep lines or TLB entries of the old type.
+ */
+void smp_cache_shootdown(void)
+{
+	tlb_shootdown(1);
+}
+
+static void smp_tlb_handler(struct irq_frame *f)
+{
+	if (tlb_wbinvd)
+		wbinvd();
+	vm_flush_all();
+	__atomic_sub_fetch(&tlb_pending, 1, __ATOMIC_RELEASE);
+}
+
+static void smp_resched_handler(struct irq_frame *f)
+{
+	sched_ipi();
+}
+
+/*
+ * Post a call to cpu's mailbox; it runs there in interrupt context,
+ * where only higher classes of interrupts can come in. Returns -1 if cpu is not online. On this
+ * CPU the call runs right away.
+ */
+int smp_call_async(unsigned int cpu, struct smp_call *call)
+{
+	struct mailbox *mb;
+	uint64_t irq;
+
+	if (cpu >= MAX_CPUS || !cpu_locals[cpu].online)
+		return -1;
+	call->done = 0;
+	irq = irq_save();
+	if (cpu == smp_cpu_id()) {
+		call->fn(call->arg);
+		__atomic_store_n(&call->done, 1, __ATOMIC_RELEASE);
+		irq_restore(irq);
+		return 0;
+	}
+	mb = &mailboxes[cpu];
+	mpsc_push(&mb->queue, &call->node);
+	if (!__atomic_exchange_n(&mb->kicked, 1, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&mb->ipis, 1, __ATOMIC_RELAXED);
+		smp_send_ipi(cpu, SMP_CALL_VECTOR);
+	}
+	irq_restore(irq);
+	return 0;
+}
+
+/*
+ * Run fn(arg) on cpu and wait for it to return. Call with interrupts
+ * enabled, or two CPUs calling each other wait for each other forever.
+ */
+int smp_call(unsigned int cpu, void (*fn)(void *), void *arg)
+{
+	struct smp_call call = { .fn = fn, .arg = arg };
+
+	if (smp_call_async(cpu, &call) < 0)
+		return -1;
+	while (!__atomic_load_n(&call.done, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	return 0;
+}
+
+/*
+ * SMP_CALL_VECTOR. Unkick before draining: a call posted after that
+ * sends a new IPI, one posted before is drained now. The caller may
+ * free its call as soon as done is set.
+ */
+static void smp_call_handler(struct irq_frame *f)
+{
+	struct mailbox *mb = &mailboxes[smp_cpu_id()];
+	struct mpsc_node *n;
+
+	__atomic_exchange_n(&mb->kicked, 0, __ATOMIC_SEQ_CST);
+	hardirq_nest();
+	while ((n = mpsc_pop(&mb->queue))) {
+		struct smp_call *call = (struct smp_call *) n;
+
+		call->fn(call->arg);
+		__atomic_store_n(&call->done, 1, __ATOMIC_RELEASE);
+		mb->calls++;
+	}
+	hardirq_unnest();
+}
+
+void smp_print_info(void)
+{
+	printf("%u CPUs online\n", smp_num_cpus);
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct cpu_local *c = &cpu_locals[cpu];
+
+		if (c->online)
+			printf("  CPU %u: APIC ID %u, node %u, %llu calls in %llu IPIs%s\n",
+				cpu, c->apic_id, acpi_apic_node(c->apic_id), mailboxes[cpu].calls,
+				mailboxes[cpu].ipis, cpu == smp_cpu_id() ? " (this one)" : "");
+	}
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_WORK			(1ULL << 27)	/* loop iterations in total */
+#define BENCH_TASKS_PER_CPU	4
+
+static volatile uint64_t bench_sink;
+static uint64_t bench_tasks[MAX_CPUS];	/* tasks finished per CPU */
+
+static void bench_task(void *arg)
+{
+	uint64_t n = (uintptr_t) arg, x = n;
+
+	for (uint64_t i = 0; i < n; i++)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	bench_sink = x;
+	__atomic_add_fetch(&bench_tasks[smp_cpu_id()], 1, __ATOMIC_RELAXED);
+	bench_task_done();
+}
+
+static void bench_spread(unsigned int ncpus)
+{
+	unsigned int ntasks = ncpus * BENCH_TASKS_PER_CPU;
+	uint64_t per_task = BENCH_WORK / ntasks;
+	uint64_t cycles;
+	char what[32];
+
+	memset(bench_tasks, 0, sizeof(bench_tasks));
+	cycles = bench_tasks_run(ntasks, ncpus, "smp-bench", bench_task,
+		(void *) (uintptr_t) per_task);
+
+	snprintf(what, sizeof(what), "%u CPUs, iterations", ncpus);
+	bench_report(what, per_task * ntasks, cycles);
+	printf("    tasks per CPU:");
+	for (unsigned int cpu = 0; cpu < smp_num_cpus; cpu++)
+		printf(" %llu", bench_tasks[cpu]);
+	printf("\n");
+}
+
+/* A fixed amount of work spread over 1, 2, 4, ... and all CPUs */
+void smp_bench(void)
+{
+	unsigned int ncpus = 1;
+
+	for (;;) {
+		bench_spread(ncpus);
+		if (ncpus == smp_num_cpus)
+			break;
+		ncpus = ncpus * 2 < smp_num_cpus ? ncpus * 2 : smp_num_cpus;
+	}
+}
+
+#define BENCH_CALLS			100000ULL
+#define BENCH_BATCH			64
+
+static struct smp_call bench_calls[BENCH_BATCH];
+static volatile uint64_t bench_called;
+
+static void bench_call(void *arg)
+{
+	bench_called++;
+}
+
+/* Calls to CPU 1 one at a time, then posted in batches */
+void smp_call_bench(void)
+{
+	struct mailbox *mb = &mailboxes[1];
+	uint64_t start, cycles, ipis;
+	char what_batch[48];
+
+	if (smp_num_cpus < 2) {
+		printf("smp_call_bench: needs two CPUs\n");
+		return;
+	}
+
+	bench_called = 0;
+	ipis = mb->ipis;
+	start = bench_now();
+	for (uint64_t i = 0; i < BENCH_CALLS; i++)
+		smp_call(1, bench_call, NULL);
+	cycles = bench_now() - start;
+	bench_report("smp_call, one at a time, calls", BENCH_CALLS, cycles);
+	printf("    %llu IPIs\n", mb->ipis - ipis);
+
+	/* They run in order, so the last one done means all are */
+	ipis = mb->ipis;
+	start = bench_now();
+	for (uint64_t i = 0; i + BENCH_BATCH <= BENCH_CALLS; i += BENCH_BATCH) {
+		for (unsigned int j = 0; j < BENCH_BATCH; j++) {
+			bench_calls[j].fn = bench_call;
+			bench_calls[j].arg = NULL;
+			smp_call_async(1, &bench_calls[j]);
+		}
+		while (!__atomic_load_n(&bench_calls[BENCH_BATCH - 1].done, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+	cycles = bench_now() - start;
+	snprintf(what_batch, sizeof(what_batch), "smp_call_async, %u per batch, calls",
+		BENCH_BATCH);
+	bench_report(what_batch, BENCH_CALLS / BENCH_BATCH * BENCH_BATCH, cycles);
+	printf("    %llu IPIs\n", mb->ipis - ipis);
+	if (bench_called != BENCH_CALLS + BENCH_CALLS / BENCH_BATCH * BENCH_BATCH)
+		printf("    %llu calls ran, expected %llu\n", bench_called,
+			BENCH_CALLS + BENCH_CALLS / BENCH_BATCH * BENCH_BATCH);
+}
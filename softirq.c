@@ -0,0 +1,255 @@
+/*
+ * softirq.c - bottom halves: softirqs and work queues (CSE 597)
+ *
+ * Interrupt handlers hold off every interrupt of their class and below
+ * (irq.c), so whatever they do delays those on the CPU. They should
+ * only do what cannot wait, and leave the rest to a task:
+ *
+ * - A softirq is a bit in the CPU's pending mask. The handler sets it,
+ *   and the CPU's softirqd task, at the highest priority, runs the
+ *   matching function as soon as the interrupt returns, with
+ *   interrupts enabled. Softirq functions must not block.
+ * - A work item goes on a CPU's MPSC queue, from any CPU or interrupt,
+ *   and that CPU's worker task runs it at about the priority of other
+ *   tasks. Work may block.
+ *
+ * Each CPU counts the time spent in both kinds of deferred work; the
+ * interrupts themselves are counted in irq.c.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <ring.h>
+#include <printf.h>
+#include <bench.h>
+#include <sched.h>
+#include <clocksource.h>
+#include <timer.h>
+#include <softirq.h>
+
+#define SOFTIRQD_PRIO		0
+#define WORKER_PRIO			(SCHED_PRIO_DEFAULT - 1)
+
+/* A task that sleeps until it is given something to do */
+struct bh_thread {
+	struct task *task;
+	volatile int sleeping;
+};
+
+struct bh_cpu {
+	volatile uint32_t pending;	/* softirq bits */
+	struct bh_thread softirqd;
+	struct bh_thread worker;
+	struct mpsc_queue works;
+	uint64_t softirqs[NR_SOFTIRQS];
+	uint64_t softirq_cycles[NR_SOFTIRQS];
+	uint64_t works_run;
+	uint64_t work_cycles;
+} __attribute__((aligned(64)));
+
+static const char *softirq_names[NR_SOFTIRQS] = { "timer" };
+
+static void (*const softirq_fns[NR_SOFTIRQS])(void) = {
+	[SOFTIRQ_TIMER] = timer_softirq,
+};
+
+static struct bh_cpu bh_cpus[MAX_CPUS];
+
+static inline struct bh_cpu *this_bh(void)
+{
+	return &bh_cpus[smp_cpu_id()];
+}
+
+/*
+ * The waker clears sleeping after making the work visible, and the
+ * thread sets it before looking for work one last time, with a full
+ * barrier in between: one of the two sees the other.
+ */
+static void bh_wake(struct bh_thread *t)
+{
+	__atomic_store_n(&t->sleeping, 0, __ATOMIC_SEQ_CST);
+	if (t->task)
+		task_wake(t->task);
+}
+
+/* On this CPU, usually from an interrupt handler */
+void raise_softirq(enum softirq nr)
+{
+	struct bh_cpu *bc = this_bh();
+
+	__atomic_or_fetch(&bc->pending, 1U << nr, __ATOMIC_SEQ_CST);
+	bh_wake(&bc->softirqd);
+}
+
+static void softirqd(void *arg)
+{
+	struct bh_cpu *bc = this_bh();
+
+	for (;;) {
+		uint32_t pending;
+
+		__atomic_store_n(&bc->softirqd.sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!bc->pending) {
+			task_block_while(&bc->softirqd.sleeping);
+			continue;
+		}
+		bc->softirqd.sleeping = 0;
+
+		pending = __atomic_exchange_n(&bc->pending, 0, __ATOMIC_SEQ_CST);
+		while (pending) {
+			unsigned int nr = __builtin_ctz(pending);
+			uint64_t start = rdtsc();
+
+			pending &= pending - 1;
+			softirq_fns[nr]();
+			bc->softirqs[nr]++;
+			bc->softirq_cycles[nr] += rdtsc() - start;
+		}
+	}
+}
+
+void work_init(struct work *w, void (*fn)(void *), void *arg)
+{
+	w->node.next = NULL;
+	w->fn = fn;
+	w->arg = arg;
+	w->pending = 0;
+}
+
+/* Returns 0 if w was still queued; on this CPU if cpu is offline */
+int queue_work_on(unsigned int cpu, struct work *w)
+{
+	struct bh_cpu *bc;
+	uint64_t irq;
+
+	if (__atomic_exchange_n(&w->pending, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	irq = irq_save();
+	if (cpu >= MAX_CPUS || !cpu_locals[cpu].online)
+		cpu = smp_cpu_id();
+	bc = &bh_cpus[cpu];
+	mpsc_push(&bc->works, &w->node);
+	irq_restore(irq);
+	bh_wake(&bc->worker);
+	return 1;
+}
+
+int queue_work(struct work *w)
+{
+	return queue_work_on(smp_cpu_id(), w);
+}
+
+static void worker(void *arg)
+{
+	struct bh_cpu *bc = this_bh();
+
+	for (;;) {
+		struct mpsc_node *n = mpsc_pop(&bc->works);
+		struct work *w;
+		void (*fn)(void *);
+		void *fn_arg;
+		uint64_t start;
+
+		if (!n) {
+			__atomic_store_n(&bc->worker.sleeping, 1, __ATOMIC_SEQ_CST);
+			if (!(n = mpsc_pop(&bc->works))) {
+				task_block_while(&bc->worker.sleeping);
+				continue;
+			}
+			bc->worker.sleeping = 0;
+		}
+
+		w = (struct work *) n;
+		fn = w->fn;
+		fn_arg = w->arg;
+		__atomic_store_n(&w->pending, 0, __ATOMIC_RELEASE);
+		start = rdtsc();
+		fn(fn_arg);
+		bc->works_run++;
+		bc->work_cycles += rdtsc() - start;
+	}
+}
+
+/* After smp_init(): a softirqd and a worker on every CPU */
+void softirq_init(void)
+{
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct bh_cpu *bc = &bh_cpus[cpu];
+
+		mpsc_init(&bc->works);
+		if (!cpu_locals[cpu].online)
+			continue;
+		bc->softirqd.task = task_create_on(cpu, "softirqd", softirqd, NULL,
+			SOFTIRQD_PRIO);
+		bc->worker.task = task_create_on(cpu, "worker", worker, NULL, WORKER_PRIO);
+		if (!bc->softirqd.task || !bc->worker.task)
+			printf("softirq: cannot create the tasks for CPU %u\n", cpu);
+	}
+}
+
+static uint64_t per_op_ns(uint64_t cycles, uint64_t ops)
+{
+	return ops ? cycles_to_ns(cycles / ops) : 0;
+}
+
+void softirq_print_info(void)
+{
+	printf("cpu");
+	for (unsigned int nr = 0; nr < NR_SOFTIRQS; nr++)
+		printf("  %8s   ns each", softirq_names[nr]);
+	printf("     works   ns each\n");
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct bh_cpu *bc = &bh_cpus[cpu];
+
+		if (!cpu_locals[cpu].online)
+			continue;
+		printf("%3u", cpu);
+		for (unsigned int nr = 0; nr < NR_SOFTIRQS; nr++)
+			printf("  %8llu %9llu", bc->softirqs[nr],
+				per_op_ns(bc->softirq_cycles[nr], bc->softirqs[nr]));
+		printf("  %8llu %9llu\n", bc->works_run,
+			per_op_ns(bc->work_cycles, bc->works_run));
+	}
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_WORKS			10000ULL
+
+static volatile uint64_t bench_stamp;
+static volatile int bench_done;
+static uint64_t bench_latency;
+
+static void bench_work(void *arg)
+{
+	bench_latency += rdtsc() - bench_stamp;
+	bench_done = 1;
+}
+
+/* From queue_work_on() to the work running, one at a time */
+static void bench_queue(unsigned int cpu)
+{
+	struct work w = WORK_INIT(bench_work, NULL);
+	char what[40];
+
+	bench_latency = 0;
+	for (uint64_t i = 0; i < BENCH_WORKS; i++) {
+		bench_done = 0;
+		bench_stamp = rdtsc();
+		queue_work_on(cpu, &w);
+		while (!bench_done)
+			cpu_relax();
+	}
+	snprintf(what, sizeof(what), "work queued for CPU %u, latency", cpu);
+	bench_report(what, BENCH_WORKS, bench_latency);
+}
+
+void softirq_bench(void)
+{
+	bench_queue(smp_cpu_id());
+	if (smp_num_cpus > 1)
+		bench_queue(smp_cpu_id() == 0 ? 1 : 0);
+}
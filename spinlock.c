@@ -0,0 +1,157 @@
+/*
+ * spinlock.c - lock contention benchmark (CSE 597)
+ *
+ * The locks themselves are inline in include/spinlock.h. This pits
+ * them against the test-and-test-and-set lock they replaced: one task
+ * per CPU takes the same lock in a loop for a fixed time, and we count
+ * how many acquisitions each CPU got. TTAS lets whoever sees the
+ * release first win, so its share per CPU is uneven, and every release
+ * invalidates the line in all waiters. A ticket lock is fair but still
+ * has everyone spin on one line; MCS spins on a line per waiter.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <sched.h>
+#include <clocksource.h>
+
+#define BENCH_WINDOW_NS		(50 * NSEC_PER_MSEC)
+
+enum bench_lock {
+	BENCH_TTAS,
+	BENCH_TICKET,
+	BENCH_MCS,
+};
+
+static const char *bench_lock_names[] = { "TTAS", "ticket", "MCS" };
+
+/* Baseline: the lock spinlock_t used to be */
+static volatile uint32_t ttas_lock __attribute__((aligned(64)));
+
+static spinlock_t ticket_lock __attribute__((aligned(64)));
+static mcs_lock_t mcs_lock_var __attribute__((aligned(64)));
+static volatile uint64_t bench_shared __attribute__((aligned(64)));
+
+static struct {
+	uint64_t ops;
+} __attribute__((aligned(64))) bench_ops[MAX_CPUS];
+
+static enum bench_lock bench_type;
+static volatile unsigned int bench_ncpus;	/* lowered if not all start */
+static volatile unsigned int bench_ready;
+static uint64_t bench_window;
+
+static inline void ttas_acquire(void)
+{
+	while (__atomic_exchange_n(&ttas_lock, 1, __ATOMIC_ACQUIRE)) {
+		while (ttas_lock)
+			cpu_relax();
+	}
+}
+
+static inline void ttas_release(void)
+{
+	__atomic_store_n(&ttas_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* One critical section: a read-modify-write of a separate shared line */
+static void bench_task(void *arg)
+{
+	struct mcs_node node;
+	uint64_t irq, end, ops = 0;
+
+	/* Start together, and do not let the tick preempt a holder */
+	irq = irq_save();
+	__atomic_add_fetch(&bench_ready, 1, __ATOMIC_SEQ_CST);
+	while (bench_ready < bench_ncpus)
+		cpu_relax();
+	end = rdtsc() + bench_window;
+
+	while (rdtsc() < end) {
+		for (int i = 0; i < 16; i++) {
+			switch (bench_type) {
+			case BENCH_TTAS:
+				ttas_acquire();
+				bench_shared++;
+				ttas_release();
+				break;
+			case BENCH_TICKET:
+				spin_lock(&ticket_lock);
+				bench_shared++;
+				spin_unlock(&ticket_lock);
+				break;
+			case BENCH_MCS:
+				mcs_lock(&mcs_lock_var, &node);
+				bench_shared++;
+				mcs_unlock(&mcs_lock_var, &node);
+				break;
+			}
+		}
+		ops += 16;
+	}
+	bench_ops[smp_cpu_id()].ops = ops;
+	irq_restore(irq);
+	bench_task_done();
+}
+
+static void bench_one(enum bench_lock type, unsigned int ncpus)
+{
+	uint64_t total = 0, min = ~0ULL, max = 0, irq;
+	char what[40];
+
+	bench_type = type;
+	bench_ncpus = ncpus;
+	bench_ready = 0;
+	bench_shared = 0;
+
+	irq = irq_save();
+	for (unsigned int cpu = 0; cpu < ncpus; cpu++) {
+		bench_ops[cpu].ops = 0;
+		/* Those already started wait for the rest with interrupts off */
+		if (bench_task_start(cpu, "lock-bench", bench_task, NULL) != 0) {
+			bench_ncpus = ncpus = cpu;
+			break;
+		}
+	}
+	irq_restore(irq);
+	bench_tasks_wait(0);
+	if (!ncpus)
+		return;
+
+	for (unsigned int cpu = 0; cpu < ncpus; cpu++) {
+		uint64_t ops = bench_ops[cpu].ops;
+
+		total += ops;
+		if (ops < min)
+			min = ops;
+		if (ops > max)
+			max = ops;
+	}
+	if (bench_shared != total)
+		printf("    lost updates: %llu of %llu\n", total - bench_shared, total);
+	snprintf(what, sizeof(what), "%s, %u CPUs, acquisitions", bench_lock_names[type],
+		ncpus);
+	bench_report(what, total, bench_window);
+	printf("    per CPU: %llu to %llu (%llu%% of the mean at worst)\n",
+		min, max, total ? min * ncpus * 100 / total : 0);
+}
+
+/* Each lock on 1, 2, 4, ... and all CPUs */
+void lock_bench(void)
+{
+	bench_window = ns_to_cycles(BENCH_WINDOW_NS);
+	for (enum bench_lock type = BENCH_TTAS; type <= BENCH_MCS; type++) {
+		unsigned int ncpus = 1;
+
+		for (;;) {
+			bench_one(type, ncpus);
+			if (ncpus == smp_num_cpus)
+				break;
+			ncpus = ncpus * 2 < smp_num_cpus ? ncpus * 2 : smp_num_cpus;
+		}
+	}
+}
@@ -0,0 +1,256 @@
+/*
+ * stack.c - pooled kernel stacks with guard pages (CSE 597)
+ *
+ * Stacks come in a few power-of-two size classes and live in their
+ * own kernel virtual region, each with an unmapped page below it, so
+ * an overflow faults instead of silently corrupting its neighbour.
+ * The #PF frame cannot be pushed onto the overflowed stack, so the
+ * CPU raises #DF instead, which runs on an IST stack set up here.
+ *
+ * New stacks are filled with STACK_POISON; the deepest word that no
+ * longer holds it is the high-water mark. Freed stacks stay mapped on
+ * a per-class free list and only the part that was used is poisoned
+ * again, so recycling a stack costs no page-table work and no zeroing.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <vm.h>
+#include <pmm.h>
+#include <slab.h>
+#include <stack.h>
+#include <string.h>
+
+static const size_t stack_classes[] = {
+	4ULL << 10, 8ULL << 10, 16ULL << 10, 32ULL << 10, 64ULL << 10,
+};
+
+#define STACK_CLASSES (sizeof(stack_classes) / sizeof(stack_classes[0]))
+
+struct stack_class_stats {
+	uint64_t created;
+	uint64_t live;
+	uint64_t reused;
+	uint64_t high_water;		/* deepest use of any freed stack */
+};
+
+static struct kstack *free_stacks[STACK_CLASSES];
+static struct stack_class_stats class_stats[STACK_CLASSES];
+static struct kstack *all_stacks;
+static uintptr_t stack_next_va = STACK_REGION_BASE;
+static struct kmem_cache *kstack_cache;
+
+/* 64-bit TSS; only the IST slots are used since there is no ring 3 */
+struct tss {
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t iomap_base;
+} __attribute__((packed));
+
+#define GDT_BOOT_ENTRIES	4			/* null, code32, code64, data */
+#define GDT_TSS_INDEX		4
+#define GDT_TSS_SEL			(GDT_TSS_INDEX * 8)
+#define GDT_ENTRIES			6
+#define STACK_IST_SIZE		(8ULL << 10)
+
+struct gdt_pointer {
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed));
+
+extern uint64_t gdt[];			/* kernel_entry.S */
+
+/* ltr marks a TSS descriptor busy, so every CPU needs its own GDT */
+static uint64_t cpu_gdt[MAX_CPUS][GDT_ENTRIES] __attribute__((aligned(64)));
+static struct tss cpu_tss[MAX_CPUS];
+static spinlock_t stack_lock;
+
+static void poison(uintptr_t from, uintptr_t to)
+{
+	for (uint64_t *p = (uint64_t *) from; p < (uint64_t *) to; p++)
+		*p = STACK_POISON;
+}
+
+size_t stack_high_water(const struct kstack *stack)
+{
+	const uint64_t *p = (const uint64_t *) stack->base;
+	const uint64_t *end = stack_top(stack);
+
+	while (p < end && *p == STACK_POISON)
+		p++;
+	return (uintptr_t) end - (uintptr_t) p;
+}
+
+static struct kstack *stack_create(unsigned int class)
+{
+	size_t size = stack_classes[class];
+	unsigned int order = 0;
+	struct kstack *stack;
+	uintptr_t va;
+	void *frames;
+
+	while ((PAGE_SIZE << order) < size)
+		order++;
+	va = stack_next_va + PAGE_SIZE;		/* leave the guard page unmapped */
+	if (va + size > STACK_REGION_BASE + STACK_REGION_SIZE)
+		return NULL;
+	if (!(stack = kmem_cache_alloc(kstack_cache)))
+		return NULL;
+	if (!(frames = pmm_alloc(order))) {
+		kmem_cache_free(kstack_cache, stack);
+		return NULL;
+	}
+	if (vm_map_range(vm_kernel_pml4, va, (uintptr_t) frames, size,
+			PTE_KERNEL) != 0) {
+		pmm_free(frames);
+		kmem_cache_free(kstack_cache, stack);
+		return NULL;
+	}
+	stack_next_va = va + size;
+
+	stack->base = va;
+	stack->size = size;
+	stack->class = class;
+	stack->all = all_stacks;
+	all_stacks = stack;
+	poison(va, va + size);
+	class_stats[class].created++;
+	return stack;
+}
+
+/* A stack of at least size bytes, rounded up to the next size class */
+struct kstack *stack_alloc(size_t size)
+{
+	struct kstack *stack;
+	unsigned int class;
+	uint64_t irq;
+
+	for (class = 0; class < STACK_CLASSES; class++) {
+		if (stack_classes[class] >= size)
+			break;
+	}
+	if (class == STACK_CLASSES)
+		return NULL;
+
+	irq = spin_lock_irqsave(&stack_lock);
+	if ((stack = free_stacks[class])) {
+		free_stacks[class] = stack->next;
+		class_stats[class].reused++;
+	} else {
+		stack = stack_create(class);
+	}
+	if (stack) {
+		stack->live = 1;
+		class_stats[class].live++;
+	}
+	spin_unlock_irqrestore(&stack_lock, irq);
+	return stack;
+}
+
+/* Return a stack to its pool; it must not be the one we are running on */
+void stack_free(struct kstack *stack)
+{
+	struct stack_class_stats *st = &class_stats[stack->class];
+	size_t used = stack_high_water(stack);
+	uint64_t irq;
+
+	poison((uintptr_t) stack_top(stack) - used, (uintptr_t) stack_top(stack));
+
+	irq = spin_lock_irqsave(&stack_lock);
+	if (used > st->high_water)
+		st->high_water = used;
+	st->live--;
+	stack->live = 0;
+	stack->next = free_stacks[stack->class];
+	free_stacks[stack->class] = stack;
+	spin_unlock_irqrestore(&stack_lock, irq);
+}
+
+/* The stack whose guard page contains addr, if any */
+struct kstack *stack_find_guard(uintptr_t addr)
+{
+	for (struct kstack *s = all_stacks; s; s = s->all) {
+		if (addr >= s->base - PAGE_SIZE && addr < s->base)
+			return s;
+	}
+	return NULL;
+}
+
+void stack_init(void)
+{
+	kstack_cache = kmem_cache_create("kstack", sizeof(struct kstack), 0);
+	vm_share_slot(STACK_REGION_BASE);
+}
+
+/*
+ * Give the calling CPU a copy of the boot GDT plus its own TSS, whose
+ * IST slots point to fresh guarded stacks: one for #DF, NMI and #MC
+ * each, and one per interrupt class. The selectors do not change, so
+ * the segment registers need no reload.
+ */
+void stack_cpu_init(void)
+{
+	unsigned int cpu = smp_cpu_id();
+	uint64_t *g = cpu_gdt[cpu];
+	struct tss *tss = &cpu_tss[cpu];
+	uint64_t base = (uintptr_t) tss;
+	uint64_t limit = sizeof(*tss) - 1;
+	struct gdt_pointer gdtp = { sizeof(cpu_gdt[0]) - 1, (uintptr_t) g };
+
+	for (unsigned int i = 0; i < IST_STACKS; i++) {
+		struct kstack *ist = stack_alloc(STACK_IST_SIZE);
+
+		if (!ist) {
+			printf("stack: no IST stack\n");
+			return;
+		}
+		tss->ist[i] = (uintptr_t) stack_top(ist);
+	}
+	tss->iomap_base = sizeof(*tss);
+
+	memcpy(g, gdt, GDT_BOOT_ENTRIES * sizeof(uint64_t));
+	g[GDT_TSS_INDEX] = (limit & 0xFFFF) | (base & 0xFFFFFF) << 16
+		| 0x89ULL << 40 | ((limit >> 16) & 0xF) << 48
+		| ((base >> 24) & 0xFF) << 56;
+	g[GDT_TSS_INDEX + 1] = base >> 32;
+	__asm__ __volatile__ ("lgdt %0" : : "m" (gdtp) : "memory");
+	__asm__ __volatile__ ("ltr %w0" : : "r" (GDT_TSS_SEL));
+}
+
+void stack_print_info(void)
+{
+	uint64_t live_max[STACK_CLASSES] = { 0 };
+	uint64_t mapped = 0, fit;
+	unsigned int c;
+	uint64_t irq = spin_lock_irqsave(&stack_lock);
+
+	/* Fold in the current depth of stacks that are still in use */
+	for (struct kstack *s = all_stacks; s; s = s->all) {
+		mapped += s->size;
+		if (s->live && stack_high_water(s) > live_max[s->class])
+			live_max[s->class] = stack_high_water(s);
+	}
+	spin_unlock_irqrestore(&stack_lock, irq);
+
+	printf("class   created  live  reused  high-water  fits in\n");
+	for (c = 0; c < STACK_CLASSES; c++) {
+		struct stack_class_stats *st = &class_stats[c];
+		uint64_t hw = st->high_water > live_max[c] ? st->high_water : live_max[c];
+
+		if (!st->created)
+			continue;
+		for (fit = 0; fit < STACK_CLASSES - 1 && stack_classes[fit] < hw; fit++)
+			;
+		printf("%3llu KiB %7llu %5llu %7llu %11llu %5llu KiB\n",
+			(uint64_t) stack_classes[c] >> 10, st->created, st->live,
+			st->reused, hw, (uint64_t) stack_classes[fit] >> 10);
+	}
+	printf("%llu KiB mapped for stacks, plus one guard page each\n", mapped >> 10);
+}
@@ -0,0 +1,287 @@
+/*
+ * string.c - mem* routines with CPUID dispatch (CSE 597)
+ *
+ * The copy and fill loops live in string_asm.S so that the compiler
+ * cannot turn them back into calls to memcpy/memset. string_init()
+ * picks a variant for small (< STRING_SMALL) and large requests:
+ * rep movsb/stosb with FSRM for everything, with ERMS for large sizes
+ * only (its startup cost dominates short copies), otherwise AVX2 or
+ * SSE2 loops. Requests larger than the last-level cache use streaming
+ * stores so that they do not evict the working set. Until then the
+ * SSE2 loops, which every x86-64 CPU has, are used.
+ *
+ * Only task context gets the SIMD loops. The rest of the kernel is
+ * built with -mgeneral-regs-only because the lazy switching in fpu.c
+ * leaves a task's registers in place until another task needs them, so
+ * interrupt and exception handlers run on top of them; their copies and
+ * fills take rep movsb/stosb, which do not need any SIMD register.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <printf.h>
+#include <bench.h>
+#include <vm.h>
+#include <string.h>
+#include <clocksource.h>
+#include <irq.h>
+
+#define STRING_SMALL		2048
+#define STRING_NT_DEFAULT	(1ULL << 20)
+
+typedef void *(*memcpy_fn_t)(void *, const void *, size_t);
+typedef void *(*memset_fn_t)(void *, int, size_t);
+
+void *memcpy_erms(void *dst, const void *src, size_t n);
+void *memcpy_sse2(void *dst, const void *src, size_t n);
+void *memcpy_avx2(void *dst, const void *src, size_t n);
+void *memcpy_nt_sse2(void *dst, const void *src, size_t n);
+void *memset_erms(void *dst, int c, size_t n);
+void *memset_sse2(void *dst, int c, size_t n);
+void *memset_avx2(void *dst, int c, size_t n);
+void *memset_nt_sse2(void *dst, int c, size_t n);
+void *memmove_backward(void *dst, const void *src, size_t n);
+
+static memcpy_fn_t copy_small = memcpy_sse2, copy_large = memcpy_sse2;
+static memset_fn_t set_small = memset_sse2, set_large = memset_sse2;
+static size_t nt_threshold = STRING_NT_DEFAULT;
+
+static int has_erms, has_fsrm, has_avx2;
+
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+	if (in_interrupt())
+		return memcpy_erms(dst, src, n);
+	if (n < STRING_SMALL)
+		return copy_small(dst, src, n);
+	if (n < nt_threshold)
+		return copy_large(dst, src, n);
+	return memcpy_nt_sse2(dst, src, n);
+}
+
+void *memmove(void *dst, const void *src, size_t n)
+{
+	/* All forward variants tolerate overlap with dst below src */
+	if ((uintptr_t) dst - (uintptr_t) src >= n)
+		return memcpy(dst, src, n);
+	return memmove_backward(dst, src, n);
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+	if (in_interrupt())
+		return memset_erms(dst, c, n);
+	if (n < STRING_SMALL)
+		return set_small(dst, c, n);
+	if (n < nt_threshold)
+		return set_large(dst, c, n);
+	return memset_nt_sse2(dst, c, n);
+}
+
+void *memcpy_nt(void *dst, const void *src, size_t n)
+{
+	if (in_interrupt())
+		return memcpy_erms(dst, src, n);
+	return memcpy_nt_sse2(dst, src, n);
+}
+
+void *memset_nt(void *dst, int c, size_t n)
+{
+	if (in_interrupt())
+		return memset_erms(dst, c, n);
+	return memset_nt_sse2(dst, c, n);
+}
+
+int memcmp(const void *a, const void *b, size_t n)
+{
+	const uint8_t *p = a, *q = b;
+
+	while (n >= sizeof(word_t) && *(const word_t *) p == *(const word_t *) q) {
+		p += sizeof(word_t);
+		q += sizeof(word_t);
+		n -= sizeof(word_t);
+	}
+	for (; n != 0; n--, p++, q++) {
+		if (*p != *q)
+			return *p - *q;
+	}
+	return 0;
+}
+
+/* Largest cache reported by the deterministic cache parameters leaf */
+static uint64_t llc_size(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t size, best = 0;
+
+	if (cpuid_max(0) < 4)
+		return 0;
+	for (uint32_t i = 0; i < 16; i++) {
+		cpuid_count(4, i, &eax, &ebx, &ecx, &edx);
+		if ((eax & 0x1F) == 0)
+			break;
+		size = (uint64_t) ((ebx >> 22) + 1) * (((ebx >> 12) & 0x3FF) + 1)
+			* ((ebx & 0xFFF) + 1) * (ecx + 1);
+		if (size > best)
+			best = size;
+	}
+	return best;
+}
+
+/* AVX needs the OS to enable its state in XCR0 (CPUID.1:ECX.XSAVE/AVX) */
+static int string_enable_avx(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & (1U << 26)) || !(ecx & (1U << 28)))
+		return 0;
+	write_cr4(read_cr4() | X86_CR4_OSXSAVE);
+	xsetbv(0, xgetbv(0) | 0x7);
+	return 1;
+}
+
+/* Every other CPU must enable the same state before it runs the variants */
+void string_cpu_init(void)
+{
+	string_enable_avx();
+}
+
+void string_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t llc;
+
+	if (string_enable_avx() && cpuid_max(0) >= 7) {
+		cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+		has_avx2 = (ebx >> 5) & 1;
+	}
+	if (cpuid_max(0) >= 7) {
+		cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+		has_erms = (ebx >> 9) & 1;
+		has_fsrm = (edx >> 4) & 1;
+	}
+
+	if (has_avx2) {
+		copy_small = copy_large = memcpy_avx2;
+		set_small = set_large = memset_avx2;
+	}
+	if (has_erms) {
+		copy_large = memcpy_erms;
+		set_large = memset_erms;
+	}
+	if (has_fsrm) {
+		copy_small = memcpy_erms;
+		set_small = memset_erms;
+	}
+	if ((llc = llc_size()) != 0)
+		nt_threshold = llc;
+
+	printf("mem*: %s, %s loops, non-temporal from %llu KiB\n",
+		has_fsrm ? "FSRM" : (has_erms ? "ERMS" : "no fast strings"),
+		has_avx2 ? "AVX2" : "SSE2", (uint64_t) nt_threshold >> 10);
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_MAX_SIZE		(8ULL << 20)
+#define BENCH_BYTES			(32ULL << 20)	/* copied per size and variant */
+
+static const size_t bench_sizes_tab[] = {
+	16, 64, 256, 1ULL << 10, 4ULL << 10, 16ULL << 10, 64ULL << 10,
+	256ULL << 10, 1ULL << 20, 4ULL << 20, BENCH_MAX_SIZE,
+};
+
+struct string_variant {
+	const char *name;
+	memcpy_fn_t copy;
+	memset_fn_t set;
+	int *avail;
+};
+
+static int always = 1;
+
+static const struct string_variant variants[] = {
+	{ "rep", memcpy_erms, memset_erms, &always },
+	{ "sse2", memcpy_sse2, memset_sse2, &always },
+	{ "avx2", memcpy_avx2, memset_avx2, &has_avx2 },
+	{ "nt", memcpy_nt_sse2, memset_nt_sse2, &always },
+	{ "auto", memcpy, memset, &always },
+};
+
+#define NUM_VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+/* Throughput in MB/s (10^6 bytes) */
+static void print_rate(uint64_t bytes, uint64_t cycles)
+{
+	uint64_t ns = cycles_to_ns(cycles);
+
+	printf(" %7llu", ns ? bytes * 1000 / ns : 0);
+}
+
+static void bench_sizes(uint8_t *dst, uint8_t *src, int fill)
+{
+	uint64_t start, iters;
+	size_t size, s, v, i;
+
+	printf("%s, MB/s:\n   size", fill ? "memset" : "memcpy");
+	for (v = 0; v < NUM_VARIANTS; v++) {
+		if (*variants[v].avail)
+			printf(" %7s", variants[v].name);
+	}
+	printf("\n");
+
+	for (s = 0; s < sizeof(bench_sizes_tab) / sizeof(bench_sizes_tab[0]); s++) {
+		size = bench_sizes_tab[s];
+		if (size >= (1ULL << 20))
+			printf(" %4llu M", (uint64_t) size >> 20);
+		else if (size >= 1024)
+			printf(" %4llu K", (uint64_t) size >> 10);
+		else
+			printf(" %4llu B", (uint64_t) size);
+		iters = BENCH_BYTES / size;
+		for (v = 0; v < NUM_VARIANTS; v++) {
+			if (!*variants[v].avail)
+				continue;
+			start = bench_now();
+			for (i = 0; i < iters; i++) {
+				if (fill)
+					variants[v].set(dst, (int) i, size);
+				else
+					variants[v].copy(dst, src, size);
+			}
+			print_rate(iters * size, bench_now() - start);
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * Copy and fill sizes from 16 B to 8 MiB with each
+ * variant, on buffers that were touched beforehand so no demand-zero
+ * faults are counted. Small sizes stay in L1; the largest exceed
+ * most last-level caches, which is where streaming stores win.
+ */
+void string_bench(void)
+{
+	uint8_t *src = vmalloc(BENCH_MAX_SIZE);
+	uint8_t *dst = vmalloc(BENCH_MAX_SIZE);
+
+	if (!src || !dst) {
+		printf("string_bench: out of memory\n");
+		goto out;
+	}
+	memset(src, 0x5A, BENCH_MAX_SIZE);
+	memset(dst, 0, BENCH_MAX_SIZE);
+	bench_sizes(dst, src, 0);
+	bench_sizes(dst, src, 1);
+out:
+	if (src)
+		vfree(src);
+	if (dst)
+		vfree(dst);
+}
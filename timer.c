@@ -0,0 +1,449 @@
+/*
+ * timer.c - hierarchical timer wheel (CSE 597)
+ *
+ * Each CPU has a wheel of WHEEL_LEVELS levels with 64 slots each
+ * (Varghese & Lauck, "Hashed and Hierarchical Timing Wheels"). Level 0
+ * has one slot per tick of 2^TIMER_TICK_SHIFT TSC cycles, each level
+ * above covers 64 times the span of the one below. A timer goes into
+ * the slot of its expiry at the lowest level whose span reaches it,
+ * which makes adding and cancelling O(1) however many timers are
+ * armed. When level 0 wraps, the next slot of level 1 is cascaded,
+ * i.e. its timers are redistributed to the levels below, and so on up.
+ *
+ * There is no periodic tick to turn the wheel. After each run, the
+ * LAPIC timer is armed for the earliest tick at which anything can
+ * happen: the next non-empty slot of level 0, or the boundary where
+ * the next non-empty slot of a higher level gets cascaded. Expiry is
+ * rounded up to a tick, so timers never fire early; they fire at most
+ * one tick late.
+ *
+ * Timers are added to the wheel of the CPU that arms them, so a CPU
+ * only ever has to reprogram its own LAPIC timer. Other CPUs may
+ * cancel them, hence the lock per wheel.
+ *
+ * The interrupt only raises SOFTIRQ_TIMER; the wheel turns and the
+ * callbacks run in the CPU's softirqd, with interrupts enabled.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <vm.h>
+#include <sched.h>
+#include <clocksource.h>
+#include <clockevent.h>
+#include <softirq.h>
+#include <timer.h>
+
+#define TIMER_TICK_SHIFT	17			/* ~44 us per tick at 3 GHz */
+#define TIMER_TICK			(1ULL << TIMER_TICK_SHIFT)
+#define WHEEL_BITS			6
+#define WHEEL_SLOTS			(1U << WHEEL_BITS)	/* one bitmap word per level */
+#define WHEEL_MASK			(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS		5			/* 2^47 cycles, half a day at 3 GHz */
+#define WHEEL_SPAN			(1ULL << (WHEEL_LEVELS * WHEEL_BITS))
+#define TICK_NONE			(~0ULL)
+
+struct timer_wheel {
+	spinlock_t lock;
+	uint64_t clk;				/* the next tick to process */
+	uint64_t next;				/* the tick the LAPIC timer is armed for */
+	uint64_t pending;
+	uint64_t bitmap[WHEEL_LEVELS];	/* bit s: slots[level][s] is non-empty */
+	struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t fired;
+	uint64_t cascaded;
+} __attribute__((aligned(64)));
+
+static struct timer_wheel wheels[MAX_CPUS];
+
+static inline uint64_t expires_tick(uint64_t expires)
+{
+	return (expires + TIMER_TICK - 1) >> TIMER_TICK_SHIFT;
+}
+
+static void slot_add(struct timer_wheel *w, struct timer *t, unsigned int level,
+		unsigned int slot)
+{
+	struct timer **head = &w->slots[level][slot];
+
+	t->level = level;
+	t->slot = slot;
+	if ((t->next = *head))
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+	w->bitmap[level] |= 1ULL << slot;
+}
+
+static void slot_del(struct timer_wheel *w, struct timer *t)
+{
+	if ((*t->pprev = t->next))
+		t->next->pprev = t->pprev;
+	if (!w->slots[t->level][t->slot])
+		w->bitmap[t->level] &= ~(1ULL << t->slot);
+	t->pprev = NULL;
+}
+
+/* Pick the level by the distance from w->clk; called with w->lock held */
+static void wheel_insert(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t tick = expires_tick(t->expires);
+	uint64_t delta = tick > w->clk ? tick - w->clk : 0;
+	unsigned int level = 0;
+
+	if (delta >= WHEEL_SPAN) {
+		delta = WHEEL_SPAN - 1;		/* cascaded again when it gets there */
+		tick = w->clk + delta;
+	} else if (delta == 0) {
+		tick = w->clk;
+	}
+	while (delta >= (1ULL << ((level + 1) * WHEEL_BITS)))
+		level++;
+	slot_add(w, t, level, (tick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+}
+
+/*
+ * The earliest tick at which the wheel may have work, TICK_NONE if it
+ * is empty. Exact for level 0; for a higher level it is the boundary
+ * where its next non-empty slot is cascaded. Slots behind the current
+ * index belong to the next rotation, which starts at the level's next
+ * wrap.
+ */
+static uint64_t wheel_next(struct timer_wheel *w)
+{
+	uint64_t best = TICK_NONE;
+
+	for (unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = level * WHEEL_BITS;
+		uint64_t pos = w->clk >> shift, when, ahead;
+		unsigned int idx = pos & WHEEL_MASK;
+
+		if (!w->bitmap[level])
+			continue;
+		/* Level 0's current slot is still due, and so is a higher
+		   level's if clk sits on its boundary and it is not cascaded */
+		if (level && (w->clk & ((1ULL << shift) - 1)))
+			idx++;
+		ahead = idx < WHEEL_SLOTS ? w->bitmap[level] >> idx << idx : 0;
+		if (ahead)
+			when = ((pos & ~(uint64_t) WHEEL_MASK) | __builtin_ctzll(ahead)) << shift;
+		else
+			when = ((pos >> WHEEL_BITS) + 1) << (shift + WHEEL_BITS);
+		if (when < best)
+			best = when;
+	}
+	return best;
+}
+
+/* Arm the LAPIC timer for the wheel's next event; w->lock held */
+static void wheel_rearm(struct timer_wheel *w)
+{
+	w->next = wheel_next(w);
+	clockevent_set_timer(w->next == TICK_NONE ? 0 : w->next << TIMER_TICK_SHIFT);
+}
+
+static void wheel_cascade(struct timer_wheel *w, unsigned int level,
+		unsigned int slot)
+{
+	struct timer *t;
+
+	while ((t = w->slots[level][slot])) {
+		slot_del(w, t);
+		wheel_insert(w, t);
+		w->cascaded++;
+	}
+}
+
+/*
+ * Run everything due up to tick now. The lock is dropped, and the
+ * interrupts enabled, around each callback, so a callback can re-arm
+ * its timer or cancel others. irq is what spin_lock_irqsave() returned.
+ */
+static void wheel_run(struct timer_wheel *w, uint64_t now, uint64_t irq)
+{
+	struct timer *t;
+	uint64_t next;
+
+	while (w->clk <= now) {
+		unsigned int idx = w->clk & WHEEL_MASK;
+
+		for (unsigned int level = 1; level < WHEEL_LEVELS
+				&& !(w->clk & ((1ULL << (level * WHEEL_BITS)) - 1)); level++)
+			wheel_cascade(w, level, (w->clk >> (level * WHEEL_BITS)) & WHEEL_MASK);
+
+		/* A callback may add a timer that is already due to this slot */
+		while ((t = w->slots[0][idx])) {
+			slot_del(w, t);
+			w->pending--;
+			w->fired++;
+			spin_unlock_irqrestore(&w->lock, irq);
+			t->fn(t->arg);
+			irq = spin_lock_irqsave(&w->lock);
+		}
+
+		/* Skip the ticks where nothing can happen */
+		w->clk++;
+		next = w->pending ? wheel_next(w) : TICK_NONE;
+		if (next > now + 1)
+			next = now + 1;
+		if (next > w->clk)
+			w->clk = next;
+	}
+}
+
+/*
+ * From the LAPIC timer interrupt, before the scheduler runs. It may
+ * have been for the time slice; then only put back the wheel's
+ * deadline, which clockevent_interrupt() cleared.
+ */
+void timer_interrupt(void)
+{
+	struct timer_wheel *w = &wheels[smp_cpu_id()];
+	int due;
+
+	spin_lock(&w->lock);
+	due = w->pending && w->next <= rdtsc() >> TIMER_TICK_SHIFT;
+	if (!due)
+		wheel_rearm(w);
+	spin_unlock(&w->lock);
+	if (due)
+		raise_softirq(SOFTIRQ_TIMER);
+}
+
+/* SOFTIRQ_TIMER, in softirqd */
+void timer_softirq(void)
+{
+	struct timer_wheel *w = &wheels[smp_cpu_id()];
+	uint64_t irq = spin_lock_irqsave(&w->lock);
+
+	wheel_run(w, rdtsc() >> TIMER_TICK_SHIFT, irq);
+	wheel_rearm(w);
+	spin_unlock_irqrestore(&w->lock, irq);
+}
+
+void timer_init(struct timer *t, void (*fn)(void *), void *arg)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->fn = fn;
+	t->arg = arg;
+	t->cpu = 0;
+}
+
+/* Returns 1 if the timer was pending; the caller holds the wheel lock */
+static int timer_detach(struct timer *t)
+{
+	struct timer_wheel *w = &wheels[t->cpu];
+
+	if (!timer_pending(t))
+		return 0;
+	slot_del(w, t);
+	w->pending--;
+	return 1;
+}
+
+/* Lock the wheel t is on, which may change until we hold its lock */
+static struct timer_wheel *timer_lock(struct timer *t, uint64_t *irq)
+{
+	struct timer_wheel *w;
+
+	for (;;) {
+		w = &wheels[__atomic_load_n(&t->cpu, __ATOMIC_RELAXED)];
+		*irq = spin_lock_irqsave(&w->lock);
+		if (w == &wheels[t->cpu])
+			return w;
+		spin_unlock_irqrestore(&w->lock, *irq);
+	}
+}
+
+/*
+ * (Re)arm t to fire at TSC value expires on this CPU. Returns 1 if it
+ * was pending before. Both wheels are held while the timer moves, in
+ * CPU order.
+ */
+int mod_timer(struct timer *t, uint64_t expires)
+{
+	unsigned int self, cpu;
+	struct timer_wheel *w;
+	uint64_t irq = irq_save(), tick;
+	int was;
+
+	self = smp_cpu_id();
+	w = &wheels[self];
+	for (;;) {
+		cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+		spin_lock(&wheels[cpu < self ? cpu : self].lock);
+		if (cpu != self)
+			spin_lock(&wheels[cpu < self ? self : cpu].lock);
+		if (t->cpu == cpu)
+			break;
+		if (cpu != self)
+			spin_unlock(&wheels[cpu].lock);
+		spin_unlock(&w->lock);
+	}
+	was = timer_detach(t);
+	if (!w->pending)
+		w->clk = rdtsc() >> TIMER_TICK_SHIFT;
+	t->expires = expires;
+	t->cpu = self;
+	wheel_insert(w, t);
+	w->pending++;
+	if (cpu != self)
+		spin_unlock(&wheels[cpu].lock);
+
+	/* Only an earlier event needs the LAPIC timer reprogrammed */
+	tick = expires_tick(expires);
+	if (tick < w->clk)
+		tick = w->clk;
+	if (tick < w->next || w->next == TICK_NONE || w->pending == 1)
+		wheel_rearm(w);
+	spin_unlock_irqrestore(&w->lock, irq);
+	return was;
+}
+
+void add_timer(struct timer *t, uint64_t expires)
+{
+	mod_timer(t, expires);
+}
+
+/* Returns 1 if the timer was pending; it may still be running elsewhere */
+int del_timer(struct timer *t)
+{
+	uint64_t irq;
+	struct timer_wheel *w = timer_lock(t, &irq);
+	int was = timer_detach(t);
+
+	spin_unlock_irqrestore(&w->lock, irq);
+	return was;
+}
+
+struct sleeper {
+	struct task *task;
+	volatile int sleeping;
+};
+
+static void sleep_wake(void *arg)
+{
+	struct sleeper *s = arg;
+	struct task *task = s->task;
+
+	s->sleeping = 0;
+	task_wake(task);
+}
+
+/*
+ * Block for at least ns nanoseconds. The timer fires on this CPU, and
+ * we only run again once softirqd, which nothing here can preempt,
+ * has blocked again, so both the sleeper and the timer are done with
+ * when we return.
+ */
+void sleep_ns(uint64_t ns)
+{
+	struct sleeper s = { task_current(), 1 };
+	struct timer t;
+
+	timer_init(&t, sleep_wake, &s);
+	add_timer(&t, rdtsc() + ns_to_cycles(ns));
+	while (s.sleeping)
+		task_block_while(&s.sleeping);
+}
+
+void timer_print_info(void)
+{
+	printf("Timer wheel: %u levels of %u slots, %llu ns per tick\n",
+		WHEEL_LEVELS, WHEEL_SLOTS, cycles_to_ns(TIMER_TICK));
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct timer_wheel *w = &wheels[cpu];
+
+		if (cpu_locals[cpu].online)
+			printf("  CPU %u: %llu pending, %llu fired, %llu cascaded\n",
+				cpu, w->pending, w->fired, w->cascaded);
+	}
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_MAX_TIMERS	100000U
+#define BENCH_OPS			100000U
+#define BENCH_SLEEPS		10U
+#define BENCH_SLEEP_NS		(1 * NSEC_PER_MSEC)
+
+static volatile uint64_t bench_fired;
+
+static void bench_fn(void *arg)
+{
+	bench_fired++;
+}
+
+/* Somewhere between 1 and 100 s from now, in 1 ms steps */
+static uint64_t bench_expiry(uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return rdtsc() + ns_to_cycles(NSEC_PER_SEC
+		+ (*seed % 99000) * NSEC_PER_MSEC);
+}
+
+/*
+ * Re-arm and cancel timers while 0 to 100k others are armed, between
+ * 1 and 100 s out so that none of them fires. The cost should not
+ * depend on how many there are.
+ */
+void timer_bench(void)
+{
+	static const unsigned int counts[] = { 0, 1000, 10000, BENCH_MAX_TIMERS };
+	struct timer *timers = vmalloc(BENCH_MAX_TIMERS * sizeof(struct timer));
+	struct timer probe[64];
+	uint64_t start, cycles, late = 0;
+	unsigned int armed = 0;
+	uint32_t seed = 2463534242U;
+	char what[48];
+
+	if (!timers) {
+		printf("timer_bench: out of memory\n");
+		return;
+	}
+	for (unsigned int i = 0; i < 64; i++)
+		timer_init(&probe[i], bench_fn, NULL);
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		for (; armed < counts[c]; armed++) {
+			timer_init(&timers[armed], bench_fn, NULL);
+			add_timer(&timers[armed], bench_expiry(&seed));
+		}
+
+		start = bench_now();
+		for (unsigned int i = 0; i < BENCH_OPS; i++)
+			mod_timer(&probe[i & 63], bench_expiry(&seed));
+		cycles = bench_now() - start;
+		snprintf(what, sizeof(what), "%u armed, mod_timer", armed);
+		bench_report(what, BENCH_OPS, cycles);
+
+		start = bench_now();
+		for (unsigned int i = 0; i < 64; i++)
+			del_timer(&probe[i]);
+		cycles = bench_now() - start;
+		snprintf(what, sizeof(what), "%u armed, del_timer", armed);
+		bench_report(what, 64, cycles);
+	}
+
+	for (unsigned int i = 0; i < armed; i++)
+		del_timer(&timers[i]);
+	vfree(timers);
+
+	/* And how long a short sleep really takes */
+	for (unsigned int i = 0; i < BENCH_SLEEPS; i++) {
+		start = ktime_get_ns();
+		sleep_ns(BENCH_SLEEP_NS);
+		late += ktime_get_ns() - start - BENCH_SLEEP_NS;
+	}
+	printf("  sleep_ns(%llu us): %llu us late on average\n",
+		BENCH_SLEEP_NS / NSEC_PER_USEC, late / BENCH_SLEEPS / NSEC_PER_USEC);
+}
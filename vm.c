@@ -0,0 +1,774 @@
+/*
+ * vm.c - kernel page tables (CSE 597)
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <msr.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <pmm.h>
+#include <slab.h>
+#include <vm.h>
+#include <clocksource.h>
+#include <string.h>
+
+#define PT_ENTRIES			512ULL
+#define PT_INDEX(va, shift)	(((va) >> (shift)) & (PT_ENTRIES - 1))
+
+#define IDENTITY_MAP_END	(4ULL << 30)
+#define IDENTITY_MAX_CUTS	256
+#define IDENTITY_MAX_RAM	128
+
+#define MTRR_VALID			(1ULL << 11)	/* in PHYSMASK */
+#define MTRR_FIXED_END		(1ULL << 20)	/* the fixed ranges cover 0-1 MiB */
+
+/* PA0..PA7 = WB, WC, UC-, UC, WB, WC, UC-, UC (the default has WT in PA1) */
+#define PAT_VALUE			0x0007010600070106ULL
+
+struct vm_area {
+	uint64_t start;
+	uint64_t size;				/* a guard page follows busy areas */
+	struct vm_area *next;
+};
+
+struct vm_stats vm_stats;
+struct vm_fault_stats vm_fault_stats;
+uint64_t *vm_kernel_pml4;
+
+static int vm_has_1g;
+static int vm_has_pcid;
+
+/* Per-CPU PCID allocation; PCID 0 is the kernel's own address space */
+#define PCID_MAX			4095
+static uint16_t pcid_next[MAX_CPUS];
+static uint32_t pcid_gen[MAX_CPUS];
+static struct vm_area *vm_free_areas;	/* sorted by address */
+static struct vm_area *vm_busy_areas;
+static spinlock_t vm_lock;				/* the area lists and vmalloc mappings */
+
+static uint64_t *vm_alloc_table(void)
+{
+	uint64_t *table = pmm_alloc_page();
+
+	if (!table)
+		return NULL;
+	memset(table, 0, PAGE_SIZE);
+	vm_stats.table_pages++;
+	return table;
+}
+
+/*
+ * Return the table referenced by *entry, allocating it if the entry is
+ * empty. Fails if the entry is already a large-page leaf.
+ */
+static uint64_t *vm_next_table(uint64_t *entry)
+{
+	if (!(*entry & PTE_P)) {
+		uint64_t *table = vm_alloc_table();
+		if (!table)
+			return NULL;
+		*entry = (uint64_t) (uintptr_t) table | PTE_P | PTE_W;
+	} else if (*entry & PTE_PS) {
+		return NULL;
+	}
+	return (uint64_t *) (uintptr_t) (*entry & PTE_ADDR_MASK);
+}
+
+/* As vm_map_range(), with leaves of at most largest bytes */
+static int map_range(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t size,
+		uint64_t flags, uint64_t largest)
+{
+	uint64_t end = va + size;
+
+	while (va < end) {
+		uint64_t left = end - va;
+		uint64_t *pdpt, *pd, *pt;
+
+		pdpt = vm_next_table(&pml4[PT_INDEX(va, 39)]);
+		if (!pdpt)
+			return -1;
+		if (vm_has_1g && largest >= PAGE_SIZE_1G && left >= PAGE_SIZE_1G
+				&& ((va | pa) & (PAGE_SIZE_1G - 1)) == 0) {
+			pdpt[PT_INDEX(va, 30)] = pa | flags | PTE_PS;
+			vm_stats.pages_1g++;
+			va += PAGE_SIZE_1G;
+			pa += PAGE_SIZE_1G;
+			continue;
+		}
+
+		pd = vm_next_table(&pdpt[PT_INDEX(va, 30)]);
+		if (!pd)
+			return -1;
+		if (largest >= PAGE_SIZE_2M && left >= PAGE_SIZE_2M
+				&& ((va | pa) & (PAGE_SIZE_2M - 1)) == 0) {
+			pd[PT_INDEX(va, 21)] = pa | flags | PTE_PS;
+			vm_stats.pages_2m++;
+			va += PAGE_SIZE_2M;
+			pa += PAGE_SIZE_2M;
+			continue;
+		}
+
+		pt = vm_next_table(&pd[PT_INDEX(va, 21)]);
+		if (!pt)
+			return -1;
+		pt[PT_INDEX(va, 12)] = pa | flags;
+		vm_stats.pages_4k++;
+		va += PAGE_SIZE;
+		pa += PAGE_SIZE;
+	}
+	return 0;
+}
+
+/*
+ * Map [va, va + size) to [pa, pa + size) using the largest page size that
+ * the alignment of both addresses and the remaining length allow, so 4 KiB
+ * entries are only used for the unaligned head and tail of a range.
+ */
+int vm_map_range(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t size,
+		uint64_t flags)
+{
+	return map_range(pml4, va, pa, size, flags, PAGE_SIZE_1G);
+}
+
+/* The 4 KiB page table entry of va, or NULL if a level above is missing */
+static uint64_t *vm_walk(uint64_t *pml4, uint64_t va)
+{
+	uint64_t *table = pml4;
+
+	for (unsigned int shift = 39; shift > 12; shift -= 9) {
+		uint64_t entry = table[PT_INDEX(va, shift)];
+		if (!(entry & PTE_P) || (entry & PTE_PS))
+			return NULL;
+		table = (uint64_t *) (uintptr_t) (entry & PTE_ADDR_MASK);
+	}
+	return &table[PT_INDEX(va, 12)];
+}
+
+static int vm_page_present(uint64_t *pml4, uint64_t va)
+{
+	uint64_t *pte = vm_walk(pml4, va);
+
+	return pte && (*pte & PTE_P);
+}
+
+/* Clear the 4 KiB mapping of va and return the frame it pointed to */
+uint64_t vm_unmap_page(uint64_t *pml4, uint64_t va)
+{
+	uint64_t *pte = vm_walk(pml4, va), pa;
+
+	if (!pte || !(*pte & PTE_P))
+		return 0;
+	pa = *pte & PTE_ADDR_MASK;
+	*pte = 0;
+	invlpg((void *) (uintptr_t) va);
+	return pa;
+}
+
+#ifdef VM_IDENTITY_4K
+/* The original layout: 2048 PTs + 4 PDs + PDPT + PML4, 4 KiB pages only */
+static uint64_t *build_identity_4g_tables(void)
+{
+	uint64_t *pml4 = vm_alloc_table();
+	uint64_t *pdp_page = vm_alloc_table();
+	uint64_t page_byte_address = 0;
+
+	pml4[0] = ((uint64_t) (uintptr_t) pdp_page) | PTE_KERNEL;
+	for (uint64_t k = 0; k < 4; ++k) {
+		uint64_t *pd = vm_alloc_table();
+		pdp_page[k] = (uint64_t) (uintptr_t) pd | PTE_KERNEL;
+		for (uint64_t j = 0; j < PT_ENTRIES; ++j) {
+			uint64_t *pt = vm_alloc_table();
+			pd[j] = (uint64_t) (uintptr_t) pt | PTE_KERNEL;
+			for (uint64_t i = 0; i < PT_ENTRIES; ++i) {
+				pt[i] = page_byte_address | PTE_KERNEL;
+				page_byte_address += PAGE_SIZE;
+			}
+		}
+	}
+	vm_stats.pages_4k += 4 * PT_ENTRIES * PT_ENTRIES;
+	return pml4;
+}
+#else
+/* Where the memory type may change below IDENTITY_MAP_END, sorted */
+static uint64_t identity_cuts[IDENTITY_MAX_CUTS];
+static unsigned int identity_num_cuts;
+static struct {
+	uint64_t start, end;
+} identity_ram[IDENTITY_MAX_RAM];
+static unsigned int identity_num_ram;
+
+static void identity_cut(uint64_t addr)
+{
+	unsigned int i, j;
+
+	addr &= ~(PAGE_SIZE - 1);
+	if (addr >= IDENTITY_MAP_END || identity_num_cuts == IDENTITY_MAX_CUTS)
+		return;
+	for (i = 0; i < identity_num_cuts && identity_cuts[i] < addr; i++)
+		;
+	if (i < identity_num_cuts && identity_cuts[i] == addr)
+		return;
+	for (j = identity_num_cuts++; j > i; j--)
+		identity_cuts[j] = identity_cuts[j - 1];
+	identity_cuts[i] = addr;
+}
+
+static void identity_add_ram(uint64_t start, uint64_t end)
+{
+	identity_cut(start);
+	identity_cut(end);
+	if (start < IDENTITY_MAP_END && identity_num_ram < IDENTITY_MAX_RAM) {
+		identity_ram[identity_num_ram].start = start;
+		identity_ram[identity_num_ram].end = end;
+		identity_num_ram++;
+	}
+}
+
+/* The variable MTRRs, assuming contiguous masks as firmware sets them */
+static void identity_add_mtrrs(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t base, mask;
+	unsigned int count;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (!(edx & (1U << 12)))
+		return;
+	identity_cut(MTRR_FIXED_END);
+	count = rdmsr(MSR_MTRRCAP) & 0xFF;
+	for (unsigned int n = 0; n < count; n++) {
+		mask = rdmsr(MSR_MTRR_PHYSMASK(n));
+		if (!(mask & MTRR_VALID) || !(mask & PTE_ADDR_MASK))
+			continue;
+		mask &= PTE_ADDR_MASK;
+		base = rdmsr(MSR_MTRR_PHYSBASE(n)) & mask;
+		identity_cut(base);
+		identity_cut(base + (mask & -mask));
+	}
+}
+
+static int identity_is_ram(uint64_t addr)
+{
+	for (unsigned int i = 0; i < identity_num_ram; i++) {
+		if (identity_ram[i].start <= addr && addr < identity_ram[i].end)
+			return 1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Build the 0-4 GiB identity map and return the physical address of
+ * its PML4. Table pages come from the frame allocator.
+ *
+ * A large page must not span two memory types (the SDM leaves the
+ * result undefined), and below 4 GiB the MTRRs make the MMIO hole UC.
+ * So the map breaks its pages wherever usable RAM in the memory map or
+ * a variable MTRR begins or ends, and anything that is not RAM gets
+ * 2 MiB pages at most.
+ */
+uint64_t vm_identity_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t start, *pml4;
+
+	if (cpuid_max(0x80000000U) >= 0x80000001U) {
+		cpuid(0x80000001U, &eax, &ebx, &ecx, &edx);
+		vm_has_1g = (edx >> 26) & 1;
+	}
+
+	start = rdtsc();
+#ifdef VM_IDENTITY_4K
+	pml4 = build_identity_4g_tables();
+#else
+	pml4 = vm_alloc_table();
+	identity_cut(0);
+	pmm_for_each_ram(identity_add_ram);
+	identity_add_mtrrs();
+	for (unsigned int i = 0; i < identity_num_cuts; i++) {
+		uint64_t from = identity_cuts[i];
+		uint64_t to = i + 1 < identity_num_cuts ? identity_cuts[i + 1]
+			: IDENTITY_MAP_END;
+
+		map_range(pml4, from, from, to - from, PTE_KERNEL,
+			identity_is_ram(from) ? PAGE_SIZE_1G : PAGE_SIZE_2M);
+	}
+#endif
+	vm_stats.build_cycles = rdtsc() - start;
+	vm_kernel_pml4 = pml4;
+	return (uint64_t) (uintptr_t) pml4;
+}
+
+/* Drop every TLB entry, global ones included */
+void vm_flush_all(void)
+{
+	uint64_t cr4 = read_cr4();
+
+	if (cr4 & X86_CR4_PGE) {
+		write_cr4(cr4 ^ X86_CR4_PGE);
+		write_cr4(cr4);
+	} else {
+		write_cr3(read_cr3());
+	}
+}
+
+/* Enable global pages, PCIDs and the PAT layout on the calling CPU */
+void vm_cpu_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t cr4 = read_cr4();
+	unsigned int cpu = smp_cpu_id();
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (edx & (1U << 13))
+		cr4 |= X86_CR4_PGE;
+	/* PCIDE may only be set while CR3[11:0] is zero, as it is here */
+	if (ecx & (1U << 17)) {
+		cr4 |= X86_CR4_PCIDE;
+		vm_has_pcid = 1;
+	}
+	write_cr4(cr4);
+	pcid_next[cpu] = 1;
+	pcid_gen[cpu] = 1;
+
+	if (edx & (1U << 16)) {
+		wbinvd();
+		wrmsr(MSR_PAT, PAT_VALUE);
+		wbinvd();
+		vm_flush_all();
+	}
+}
+
+/* Replace a large-page leaf with a table of 512 next-size entries */
+static int vm_split(uint64_t *entry, unsigned int shift)
+{
+	uint64_t *table = vm_alloc_table();
+	uint64_t child = 1ULL << (shift - 9);
+	uint64_t base = *entry & PTE_ADDR_MASK;
+	uint64_t flags = *entry & ~PTE_ADDR_MASK & ~PTE_PS;
+
+	if (!table)
+		return -1;
+	if (child > PAGE_SIZE)
+		flags |= PTE_PS;
+	for (size_t i = 0; i < PT_ENTRIES; i++)
+		table[i] = (base + i * child) | flags;
+	*entry = (uint64_t) (uintptr_t) table | PTE_P | PTE_W;
+
+	if (shift == 30) {
+		vm_stats.pages_1g--;
+		vm_stats.pages_2m += PT_ENTRIES;
+	} else {
+		vm_stats.pages_2m--;
+		vm_stats.pages_4k += PT_ENTRIES;
+	}
+	return 0;
+}
+
+/*
+ * Set the memory type of a kernel range. Large pages that the range
+ * only partially covers are split, so the rest keeps its type. The
+ * kernel tables are shared, so every CPU writes back its caches and
+ * drops its TLB entries before this returns; call it with interrupts
+ * enabled and no locks held, as smp_cache_shootdown() needs.
+ */
+int vm_set_cache(uint64_t va, uint64_t size, uint64_t cache)
+{
+	uint64_t end = (va + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint64_t irq = spin_lock_irqsave(&vm_lock);
+	int ret = 0;
+
+	va &= ~(PAGE_SIZE - 1);
+	while (va < end) {
+		uint64_t *table = vm_kernel_pml4, *entry;
+		unsigned int shift = 39;
+
+		for (;;) {
+			entry = &table[PT_INDEX(va, shift)];
+			if (!(*entry & PTE_P)) {
+				ret = -1;
+				goto out;
+			}
+			if (shift == 12 || (*entry & PTE_PS)) {
+				if (shift == 12 || ((va & ((1ULL << shift) - 1)) == 0
+						&& end - va >= (1ULL << shift)))
+					break;
+				if (vm_split(entry, shift) != 0) {
+					ret = -1;
+					goto out;
+				}
+			}
+			table = (uint64_t *) (uintptr_t) (*entry & PTE_ADDR_MASK);
+			shift -= 9;
+		}
+		*entry = (*entry & ~(PTE_PWT | PTE_PCD)) | cache;
+		va += 1ULL << shift;
+	}
+out:
+	/* Even a failed call may have changed part of the range */
+	wbinvd();
+	vm_flush_all();
+	spin_unlock_irqrestore(&vm_lock, irq);
+	smp_cache_shootdown();
+	return ret;
+}
+
+struct vm_space *vm_space_create(void)
+{
+	struct vm_space *space = kmalloc(sizeof(struct vm_space));
+
+	if (!space)
+		return NULL;
+	if (!(space->pml4 = vm_alloc_table())) {
+		kfree(space);
+		return NULL;
+	}
+	for (size_t i = 0; i < PT_ENTRIES; i++)
+		space->pml4[i] = vm_kernel_pml4[i];
+	for (size_t i = 0; i < MAX_CPUS; i++)
+		space->gen[i] = 0;
+	return space;
+}
+
+static void vm_free_tables(uint64_t *table, unsigned int level)
+{
+	for (size_t i = 0; level > 1 && i < PT_ENTRIES; i++) {
+		if ((table[i] & PTE_P) && !(table[i] & PTE_PS))
+			vm_free_tables((uint64_t *) (uintptr_t) (table[i] & PTE_ADDR_MASK),
+				level - 1);
+	}
+	pmm_free(table);
+	vm_stats.table_pages--;
+}
+
+/* Free the page tables of private mappings; the frames are the caller's */
+void vm_space_destroy(struct vm_space *space)
+{
+	for (size_t i = 0; i < PT_ENTRIES; i++) {
+		if ((space->pml4[i] & PTE_P) && space->pml4[i] != vm_kernel_pml4[i])
+			vm_free_tables((uint64_t *) (uintptr_t)
+				(space->pml4[i] & PTE_ADDR_MASK), 3);
+	}
+	vm_free_tables(space->pml4, 1);
+	kfree(space);
+}
+
+/*
+ * Load an address space (NULL: the kernel's). With PCIDs, an address
+ * space keeps its PCID on this CPU across switches and CR3 is written
+ * with the no-flush bit, so its translations stay warm. When the PCIDs
+ * run out, a new generation starts and the whole TLB is flushed once.
+ */
+void vm_space_switch(struct vm_space *space)
+{
+	unsigned int cpu = smp_cpu_id();
+	uint64_t cr3;
+
+	if (!space) {
+		write_cr3((uintptr_t) vm_kernel_pml4 | (vm_has_pcid ? CR3_NOFLUSH : 0));
+		return;
+	}
+	if (!vm_has_pcid) {
+		write_cr3((uintptr_t) space->pml4);
+		return;
+	}
+
+	cr3 = (uintptr_t) space->pml4;
+	if (space->gen[cpu] == pcid_gen[cpu]) {
+		cr3 |= space->pcid[cpu] | CR3_NOFLUSH;
+	} else {
+		if (pcid_next[cpu] > PCID_MAX) {
+			pcid_gen[cpu]++;
+			pcid_next[cpu] = 1;
+			vm_flush_all();		/* covers every PCID */
+		}
+		space->pcid[cpu] = pcid_next[cpu]++;
+		space->gen[cpu] = pcid_gen[cpu];
+		cr3 |= space->pcid[cpu];
+	}
+	write_cr3(cr3);
+}
+
+/*
+ * Populate the kernel PML4 slot covering va, so that address spaces
+ * created later share whatever gets mapped below it.
+ */
+int vm_share_slot(uint64_t va)
+{
+	return vm_next_table(&vm_kernel_pml4[PT_INDEX(va, 39)]) ? 0 : -1;
+}
+
+/* Without its PML4 slot or first area, vmalloc() just returns NULL */
+void vmalloc_init(void)
+{
+	struct vm_area *area;
+
+	if (vm_share_slot(VMALLOC_BASE) != 0
+			|| !(area = kmalloc(sizeof(struct vm_area)))) {
+		printf("vmalloc: out of memory, disabled\n");
+		return;
+	}
+	vm_free_areas = area;
+	vm_free_areas->start = VMALLOC_BASE;
+	vm_free_areas->size = VMALLOC_SIZE;
+	vm_free_areas->next = NULL;
+}
+
+/*
+ * Reserve size bytes of kernel virtual memory. Nothing is mapped until
+ * the first access, which vm_fault() backs with a zeroed frame.
+ */
+void *vmalloc(size_t size)
+{
+	struct vm_area **prev, *cur, *area;
+	uint64_t need, irq;
+
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	need = size + PAGE_SIZE;
+	if (!size || !(area = kmalloc(sizeof(struct vm_area))))
+		return NULL;
+
+	irq = spin_lock_irqsave(&vm_lock);
+	for (prev = &vm_free_areas; (cur = *prev); prev = &cur->next) {
+		if (cur->size >= need)
+			break;
+	}
+	if (!cur) {
+		spin_unlock_irqrestore(&vm_lock, irq);
+		kfree(area);
+		return NULL;
+	}
+	area->start = cur->start;
+	area->size = size;
+	cur->start += need;
+	cur->size -= need;
+	if (!cur->size) {
+		*prev = cur->next;
+		kfree(cur);
+	}
+	area->next = vm_busy_areas;
+	vm_busy_areas = area;
+	spin_unlock_irqrestore(&vm_lock, irq);
+	return (void *) (uintptr_t) area->start;
+}
+
+/*
+ * Other CPUs may still hold translations for the area, so it only goes
+ * back on the free list after a shootdown. Call with interrupts enabled.
+ */
+void vfree(void *ptr)
+{
+	struct vm_area **prev, *cur, *area, *before;
+	uint64_t irq = spin_lock_irqsave(&vm_lock);
+
+	for (prev = &vm_busy_areas; (area = *prev); prev = &area->next) {
+		if (area->start == (uintptr_t) ptr)
+			break;
+	}
+	if (!area) {
+		spin_unlock_irqrestore(&vm_lock, irq);
+		printf("vfree: bad pointer %p\n", ptr);
+		return;
+	}
+	*prev = area->next;
+
+	for (uint64_t va = area->start; va < area->start + area->size; va += PAGE_SIZE) {
+		uint64_t pa = vm_unmap_page(vm_kernel_pml4, va);
+		if (pa) {
+			pmm_free((void *) (uintptr_t) pa);
+			vm_fault_stats.resident--;
+		}
+	}
+	area->size += PAGE_SIZE;
+	spin_unlock_irqrestore(&vm_lock, irq);
+
+	smp_tlb_shootdown();
+
+	/* Insert into the sorted free list, merging with both neighbours */
+	irq = spin_lock_irqsave(&vm_lock);
+	before = NULL;
+	for (cur = vm_free_areas; cur && cur->start < area->start; cur = cur->next)
+		before = cur;
+	if (cur && area->start + area->size == cur->start) {
+		cur->start = area->start;
+		cur->size += area->size;
+		kfree(area);
+		area = cur;
+	} else {
+		area->next = cur;
+	}
+	if (before && before->start + before->size == area->start) {
+		before->size += area->size;
+		before->next = area->next;
+		kfree(area);
+	} else if (before) {
+		before->next = area;
+	} else {
+		vm_free_areas = area;
+	}
+	spin_unlock_irqrestore(&vm_lock, irq);
+}
+
+/* Resolve a page fault; returns 0 if the access can be retried */
+int vm_fault(uint64_t addr, uint64_t err)
+{
+	uint64_t start = rdtsc();
+	struct vm_area *area;
+	uint64_t *frame, irq;
+
+	vm_fault_stats.faults++;
+	if ((err & PF_PRESENT) || addr < VMALLOC_BASE
+			|| addr >= VMALLOC_BASE + VMALLOC_SIZE)
+		goto bad;
+
+	irq = spin_lock_irqsave(&vm_lock);
+	/* Another CPU may have faulted the same page in meanwhile */
+	if (vm_page_present(vm_kernel_pml4, addr)) {
+		spin_unlock_irqrestore(&vm_lock, irq);
+		return 0;
+	}
+	for (area = vm_busy_areas; area; area = area->next) {
+		if (addr >= area->start && addr < area->start + area->size)
+			break;
+	}
+	if (!area || !(frame = pmm_alloc_page())) {
+		spin_unlock_irqrestore(&vm_lock, irq);
+		goto bad;
+	}
+
+	memset(frame, 0, PAGE_SIZE);
+	if (vm_map_range(vm_kernel_pml4, addr & ~(PAGE_SIZE - 1),
+			(uintptr_t) frame, PAGE_SIZE, PTE_KERNEL) != 0) {
+		spin_unlock_irqrestore(&vm_lock, irq);
+		pmm_free(frame);
+		goto bad;
+	}
+	vm_fault_stats.demand_zero++;
+	vm_fault_stats.resident++;
+	spin_unlock_irqrestore(&vm_lock, irq);
+	vm_fault_stats.cycles += rdtsc() - start;
+	return 0;
+
+bad:
+	vm_fault_stats.bad++;
+	return -1;
+}
+
+void vm_print_stats(void)
+{
+	printf("Identity map: %llu x 1G, %llu x 2M, %llu x 4K pages\n",
+		vm_stats.pages_1g, vm_stats.pages_2m, vm_stats.pages_4k);
+	printf("Page tables: %llu pages (%llu KiB), built in %llu us\n",
+		vm_stats.table_pages, vm_stats.table_pages * (PAGE_SIZE / 1024),
+		cycles_to_ns(vm_stats.build_cycles) / NSEC_PER_USEC);
+	printf("vmalloc: %llu KiB resident\n",
+		vm_fault_stats.resident * (PAGE_SIZE / 1024));
+	printf("Page faults: %llu total, %llu demand-zero, %llu bad",
+		vm_fault_stats.faults, vm_fault_stats.demand_zero, vm_fault_stats.bad);
+	if (vm_fault_stats.demand_zero)
+		printf(", %llu ns/fault",
+			cycles_to_ns(vm_fault_stats.cycles) / vm_fault_stats.demand_zero);
+	printf("\n");
+}
+
+#define BENCH_VMALLOC_SIZE		(64ULL << 20)
+#define BENCH_VMALLOC_STRIDE	(64 * PAGE_SIZE)
+
+void vmalloc_bench(void)
+{
+	uint64_t faults = vm_fault_stats.demand_zero;
+	uint64_t cycles = vm_fault_stats.cycles;
+	uint64_t n = BENCH_VMALLOC_SIZE / BENCH_VMALLOC_STRIDE;
+	volatile char *buf = vmalloc(BENCH_VMALLOC_SIZE);
+	uint64_t start, off;
+
+	if (!buf) {
+		printf("vmalloc bench: out of virtual memory\n");
+		return;
+	}
+
+	start = bench_now();
+	for (off = 0; off < BENCH_VMALLOC_SIZE; off += BENCH_VMALLOC_STRIDE)
+		buf[off] = 1;
+	bench_report("sparse first touch", n, bench_now() - start);
+
+	start = bench_now();
+	for (off = 0; off < BENCH_VMALLOC_SIZE; off += BENCH_VMALLOC_STRIDE)
+		buf[off] = 2;
+	bench_report("sparse touch, backed", n, bench_now() - start);
+
+	faults = vm_fault_stats.demand_zero - faults;
+	printf("  %llu faults, %llu ns/fault in the handler, "
+		"%llu KiB resident of %llu KiB\n", faults,
+		faults ? cycles_to_ns(vm_fault_stats.cycles - cycles) / faults : 0,
+		vm_fault_stats.resident * (PAGE_SIZE / 1024),
+		BENCH_VMALLOC_SIZE / 1024);
+	vfree((void *) buf);
+}
+
+#define BENCH_SWITCHES		20000ULL
+#define BENCH_SPACE_PAGES	64
+
+static uint64_t space_switch_loop(struct vm_space *a, struct vm_space *b,
+		int pcid)
+{
+	int saved = vm_has_pcid;
+	uint64_t start, i, j;
+
+	vm_has_pcid = pcid;
+	vm_space_switch(NULL);
+	a->gen[smp_cpu_id()] = b->gen[smp_cpu_id()] = 0;
+	start = bench_now();
+	for (i = 0; i < BENCH_SWITCHES; i++) {
+		volatile uint64_t *buf = (uint64_t *) (uintptr_t) VM_PRIVATE_BASE;
+		vm_space_switch(i & 1 ? b : a);
+		for (j = 0; j < BENCH_SPACE_PAGES; j++)
+			buf[j * (PAGE_SIZE / sizeof(uint64_t))]++;
+	}
+	start = bench_now() - start;
+	vm_space_switch(NULL);
+	vm_has_pcid = saved;
+	return start;
+}
+
+/*
+ * Switch between two address spaces, touching BENCH_SPACE_PAGES private
+ * pages after every switch, with and without PCIDs.
+ */
+void vm_space_bench(void)
+{
+	struct vm_space *a = vm_space_create(), *b = vm_space_create();
+	void *frames = pmm_alloc(7);	/* 2 x 64 pages */
+
+	if (!a || !b || !frames) {
+		printf("address space bench: out of memory\n");
+		goto out;
+	}
+	if (vm_map_range(a->pml4, VM_PRIVATE_BASE, (uintptr_t) frames,
+			BENCH_SPACE_PAGES * PAGE_SIZE, PTE_PRIVATE) != 0
+			|| vm_map_range(b->pml4, VM_PRIVATE_BASE,
+			(uintptr_t) frames + BENCH_SPACE_PAGES * PAGE_SIZE,
+			BENCH_SPACE_PAGES * PAGE_SIZE, PTE_PRIVATE) != 0) {
+		printf("address space bench: mapping failed\n");
+		goto out;
+	}
+
+	bench_report("switch + touch, CR3 flush", BENCH_SWITCHES,
+		space_switch_loop(a, b, 0));
+	if (vm_has_pcid)
+		bench_report("switch + touch, PCID no-flush", BENCH_SWITCHES,
+			space_switch_loop(a, b, 1));
+	else
+		printf("  PCID not supported by this CPU\n");
+
+out:
+	if (frames)
+		pmm_free(frames);
+	if (a)
+		vm_space_destroy(a);
+	if (b)
+		vm_space_destroy(b);
+}
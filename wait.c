@@ -0,0 +1,309 @@
+/*
+ * wait.c - wait queues, mutexes and semaphores (CSE 597)
+ *
+ * A waiting task queues an entry on its own stack and blocks in the
+ * scheduler until a waker dequeues the entry, clears its flag and
+ * wakes the task, so it uses no CPU in the meantime. The flag is what
+ * task_block_while() checks after marking the task blocked, which
+ * closes the window between queueing and blocking. A waker holds the
+ * queue lock until it is done with the entry, and a woken task takes
+ * that lock once more before it returns, so the entry (and the task)
+ * are still there for as long as the waker uses them.
+ *
+ * Mutexes and semaphores are a trylock on an atomic word, with a
+ * wait_event() on the trylock as the slow path.
+ */
+
+#include <types.h>
+#include <cpu.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <printf.h>
+#include <bench.h>
+#include <sched.h>
+#include <clocksource.h>
+#include <wait.h>
+
+void wait_queue_init(struct wait_queue *wq)
+{
+	spin_lock_init(&wq->lock);
+	wq->head = NULL;
+	wq->tail = NULL;
+}
+
+/* Queue the current task; it has to wait_block() or wait_cancel() next */
+void wait_prepare(struct wait_queue *wq, struct wait_entry *w)
+{
+	uint64_t irq = spin_lock_irqsave(&wq->lock);
+
+	w->task = task_current();
+	w->next = NULL;
+	w->waiting = 1;
+	if (wq->tail)
+		wq->tail->next = w;
+	else
+		wq->head = w;
+	wq->tail = w;
+	spin_unlock_irqrestore(&wq->lock, irq);
+}
+
+/* Called with wq->lock held; the entry must still be queued */
+static void wait_unlink(struct wait_queue *wq, struct wait_entry *w)
+{
+	struct wait_entry *prev = NULL, *e;
+
+	for (e = wq->head; e != w; e = e->next)
+		prev = e;
+	if (prev)
+		prev->next = w->next;
+	else
+		wq->head = w->next;
+	if (wq->tail == w)
+		wq->tail = prev;
+}
+
+/*
+ * The condition came true before we blocked. If a waker has already
+ * picked our entry, pass the wakeup on: it may have been meant for
+ * one of the tasks behind us.
+ */
+void wait_cancel(struct wait_queue *wq, struct wait_entry *w)
+{
+	uint64_t irq = spin_lock_irqsave(&wq->lock);
+	int woken = !w->waiting;
+
+	if (!woken)
+		wait_unlink(wq, w);
+	spin_unlock_irqrestore(&wq->lock, irq);
+	if (woken)
+		wake_up_one(wq);
+}
+
+void wait_block(struct wait_queue *wq, struct wait_entry *w)
+{
+	uint64_t irq;
+
+	/* Someone else may task_wake() us for their own reasons */
+	while (w->waiting)
+		task_block_while(&w->waiting);
+	irq = spin_lock_irqsave(&wq->lock);
+	spin_unlock_irqrestore(&wq->lock, irq);
+}
+
+/* Called with wq->lock held */
+static int wake_first(struct wait_queue *wq)
+{
+	struct wait_entry *w = wq->head;
+	struct task *t;
+
+	if (!w)
+		return 0;
+	if (!(wq->head = w->next))
+		wq->tail = NULL;
+	t = w->task;
+	__atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+	task_wake(t);
+	return 1;
+}
+
+void wake_up_one(struct wait_queue *wq)
+{
+	uint64_t irq = spin_lock_irqsave(&wq->lock);
+
+	wake_first(wq);
+	spin_unlock_irqrestore(&wq->lock, irq);
+}
+
+void wake_up_all(struct wait_queue *wq)
+{
+	uint64_t irq = spin_lock_irqsave(&wq->lock);
+
+	while (wake_first(wq))
+		;
+	spin_unlock_irqrestore(&wq->lock, irq);
+}
+
+/*
+ * Mutexes
+ */
+
+void mutex_init(struct mutex *m)
+{
+	m->locked = 0;
+	m->owner = NULL;
+	wait_queue_init(&m->wq);
+}
+
+int mutex_trylock(struct mutex *m)
+{
+	if (m->locked || __atomic_exchange_n(&m->locked, 1, __ATOMIC_ACQUIRE))
+		return 0;
+	m->owner = task_current();
+	return 1;
+}
+
+void mutex_lock(struct mutex *m)
+{
+	wait_event(&m->wq, mutex_trylock(m));
+}
+
+/*
+ * The fence orders the release before the look at the queue; a locker
+ * queues itself before its last trylock, so one of the two sees the
+ * other.
+ */
+void mutex_unlock(struct mutex *m)
+{
+	m->owner = NULL;
+	__atomic_store_n(&m->locked, 0, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (m->wq.head)
+		wake_up_one(&m->wq);
+}
+
+/*
+ * Semaphores
+ */
+
+void sem_init(struct semaphore *s, int64_t count)
+{
+	s->count = count;
+	wait_queue_init(&s->wq);
+}
+
+int sem_trydown(struct semaphore *s)
+{
+	int64_t c = s->count;
+
+	while (c > 0) {
+		if (__atomic_compare_exchange_n(&s->count, &c, c - 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
+}
+
+void sem_down(struct semaphore *s)
+{
+	wait_event(&s->wq, sem_trydown(s));
+}
+
+void sem_up(struct semaphore *s)
+{
+	__atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+	if (s->wq.head)
+		wake_up_one(&s->wq);
+}
+
+/*
+ * Benchmark
+ */
+
+#define BENCH_ROUNDS		100000ULL	/* semaphore round trips */
+#define BENCH_LOCKS			100000ULL	/* mutex acquisitions per task */
+#define BENCH_WORK			(1ULL << 26)	/* LCG steps of the worker */
+
+static struct semaphore bench_ping, bench_pong;
+static struct mutex bench_mutex;
+static struct wait_queue bench_wq = WAIT_QUEUE_INIT;	/* for bench_done */
+static volatile int bench_done;
+static volatile uint64_t bench_count;
+static volatile uint64_t bench_sink;
+static uint64_t bench_work_cycles;
+
+static void bench_pinger(void *arg)
+{
+	for (uint64_t i = 0; i < BENCH_ROUNDS; i++) {
+		sem_up(&bench_ping);
+		sem_down(&bench_pong);
+	}
+	bench_task_done();
+}
+
+static void bench_ponger(void *arg)
+{
+	for (uint64_t i = 0; i < BENCH_ROUNDS; i++) {
+		sem_down(&bench_ping);
+		sem_up(&bench_pong);
+	}
+	bench_task_done();
+}
+
+static void bench_locker(void *arg)
+{
+	for (uint64_t i = 0; i < BENCH_LOCKS; i++) {
+		mutex_lock(&bench_mutex);
+		bench_count++;
+		mutex_unlock(&bench_mutex);
+	}
+	bench_task_done();
+}
+
+static void bench_worker(void *arg)
+{
+	uint64_t start = bench_now(), x = 1;
+
+	for (uint64_t i = 0; i < BENCH_WORK; i++)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	bench_sink = x;
+	bench_work_cycles = bench_now() - start;
+	bench_done = 1;
+	wake_up_all(&bench_wq);
+	bench_task_done();
+}
+
+/* Waits for the worker on the same CPU, by spinning or by sleeping */
+static void bench_waiter(void *arg)
+{
+	if (arg) {
+		while (!bench_done)
+			cpu_relax();
+	} else {
+		wait_event(&bench_wq, bench_done);
+	}
+	bench_task_done();
+}
+
+void wait_bench(void)
+{
+	unsigned int n = smp_num_cpus < 4 ? 4 : smp_num_cpus;
+	uint64_t cycles, irq;
+	char what[48];
+
+	if (n > MAX_CPUS)
+		n = MAX_CPUS;
+
+	/* Two tasks on this CPU hand a token back and forth */
+	sem_init(&bench_ping, 0);
+	sem_init(&bench_pong, 0);
+	cycles = bench_now();
+	irq = irq_save();
+	bench_task_start(smp_cpu_id(), "wait-bench", bench_pinger, NULL);
+	bench_task_start(smp_cpu_id(), "wait-bench", bench_ponger, NULL);
+	irq_restore(irq);
+	cycles = bench_tasks_wait(cycles);
+	bench_report("semaphore round trips", BENCH_ROUNDS, cycles);
+
+	/* n tasks spread over the CPUs increment one counter */
+	mutex_init(&bench_mutex);
+	bench_count = 0;
+	cycles = bench_tasks_run(n, smp_num_cpus, "wait-bench", bench_locker, NULL);
+	snprintf(what, sizeof(what), "%u tasks, mutex lock/unlock", n);
+	bench_report(what, n * BENCH_LOCKS, cycles);
+	if (bench_count != n * BENCH_LOCKS)
+		printf("    count is %llu, expected %llu\n", bench_count, n * BENCH_LOCKS);
+
+	/* A worker shares its CPU with a spinning, then a sleeping waiter */
+	for (int spin = 1; spin >= 0; spin--) {
+		bench_done = 0;
+		irq = irq_save();
+		bench_task_start(smp_cpu_id(), "wait-bench", bench_worker, NULL);
+		bench_task_start(smp_cpu_id(), "wait-bench", bench_waiter,
+			(void *) (uintptr_t) spin);
+		irq_restore(irq);
+		bench_tasks_wait(0);
+		printf("  worker next to a %s waiter: %llu us\n",
+			spin ? "spinning" : "sleeping",
+			cycles_to_ns(bench_work_cycles) / NSEC_PER_USEC);
+	}
+}